@@ -0,0 +1,380 @@
+/* fsbench.c - time the kernel's filesystem code on the host
+ *
+ * Usage: fsbench <image>...
+ *        fsbench -g <files> <dir>
+ *   With images, each one is mapped into memory and handed to filesys_init like the
+ *   multiboot module is at boot, then these are timed:
+ *     lookups     read_dentry_by_name on every file path, and on names that do not exist
+ *     sequential  read_data over every file from start to end, 64kB at a time
+ *     random      read_data of 4kB at random offsets of random files
+ *     dir scan    dir_read (one name per call) and dir_getdents over every directory
+ *   With -g, a synthetic tree of <files> files is written to <dir> for mkfs: up to 61
+ *   files go in the root directory, more are spread over subdirectories.
+ *
+ * filesys.c, lz4.c and crc32c.c are compiled unchanged from student-distrib. The
+ * kernel keeps addresses in 32 bits, so the image is mapped below 4GB (MAP_32BIT).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _TYPES_H                                    // use <stdint.h> instead of the kernel types
+#include "filesys.h"
+
+#define BENCH_MIN_NS         200000000ULL           // run each test for at least 0.2s
+#define BENCH_SEQ_CHUNK      (64 * 1024)
+#define BENCH_RAND_CHUNK     BLOCK_SIZE
+#define BENCH_DIR_FD         2                      // the file descriptor dir_read runs on
+#define BENCH_MAX_FILES      FS_MAX_INODES
+#define BENCH_ROOT_FILES     (MAX_FILES_NUMBER - 2) // the root also holds "." and "rtc"
+#define BENCH_DIR_FILES      256                    // files per subdirectory of a synthetic tree
+#define BENCH_BIG_EVERY      97                     // every 97th synthetic file is large
+#define BENCH_BIG_SIZE       (1024 * 1024)
+#define BENCH_SMALL_MAX      8192
+
+/* from fsbench_glue.c */
+extern void fsbench_open_dir(int32_t fd, uint32_t inode);
+
+typedef struct bench_file
+{
+    char path[FS_MAX_PATH_LEN];                     // '/' separated path from the root, as path_lookup takes it
+    uint32_t inode;
+    uint32_t length;
+} bench_file_t;
+
+static bench_file_t* files;
+static uint32_t num_files;
+static uint32_t dirs[BENCH_MAX_FILES];              // inodes of the root and every subdirectory
+static uint32_t num_dirs;
+static uint8_t buf[BENCH_SEQ_CHUNK];
+static uint32_t bench_seed = 1;
+
+/*
+ * die
+ *  DESCRIPTION : print an error and exit
+ *  INPUTS : const char* msg - the message
+ *           const char* what - the file it is about, may be NULL
+ *  OUTPUTS : the message on stderr
+ *  RETURN VALUE : does not return
+ *  SIDE EFFECTS : exit the program
+ */
+static void die(const char* msg, const char* what)
+{
+    if (what != NULL) fprintf(stderr, "fsbench: %s: %s\n", what, msg);
+    else fprintf(stderr, "fsbench: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * bench_rand
+ *  DESCRIPTION : a small LCG, so every run reads the same sequence of offsets
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : the next pseudo-random number, 31 bits
+ *  SIDE EFFECTS : advance bench_seed
+ */
+static uint32_t bench_rand(void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 1) & 0x7FFFFFFF;
+}
+
+/*
+ * now_ns
+ *  DESCRIPTION : read the monotonic clock
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : the time in nanoseconds
+ *  SIDE EFFECTS : none
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * write_tree
+ *  DESCRIPTION : write a synthetic tree for mkfs. Most files are 0 to 8kB (so many end up
+ *                inline), every 97th one is 1MB. The contents are text-like and vary from
+ *                file to file so mkfs does not share their blocks.
+ *  INPUTS : uint32_t count - number of files
+ *           const char* root - directory to create
+ *  OUTPUTS : the files
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : exit on error
+ */
+static void write_tree(uint32_t count, const char* root)
+{
+    static uint8_t data[BENCH_BIG_SIZE];
+    char path[FS_MAX_PATH_LEN * 4];
+    uint32_t i, j, size;
+    FILE* f;
+
+    if (mkdir(root, 0755) != 0) die("cannot create directory", root);
+    for (i = 0; i < count; i++) {
+        if (count <= BENCH_ROOT_FILES) {
+            snprintf(path, sizeof(path), "%s/file%04u", root, i);
+        } else {
+            if (i % BENCH_DIR_FILES == 0) {
+                snprintf(path, sizeof(path), "%s/dir%03u", root, i / BENCH_DIR_FILES);
+                if (mkdir(path, 0755) != 0) die("cannot create directory", path);
+            }
+            snprintf(path, sizeof(path), "%s/dir%03u/file%04u", root, i / BENCH_DIR_FILES, i);
+        }
+        size = (i % BENCH_BIG_EVERY == 0) ? BENCH_BIG_SIZE : bench_rand() % BENCH_SMALL_MAX;
+        for (j = 0; j < size; j++) data[j] = "etaoin shrdlu\n"[bench_rand() % 14];
+        if ((f = fopen(path, "wb")) == NULL) die("cannot create", path);
+        if (fwrite(data, 1, size, f) != size) die("write error", path);
+        fclose(f);
+    }
+    printf("%s: %u files\n", root, count);
+}
+
+/*
+ * map_image
+ *  DESCRIPTION : map an image below 4GB and start the filesystem on it
+ *  INPUTS : const char* file - the image
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : exit on error, call filesys_init
+ */
+static void map_image(const char* file)
+{
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0)) die("cannot open", file);
+    void* img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_32BIT, fd, 0);  // writes stay private
+    if (img == MAP_FAILED) die("cannot map", file);
+    close(fd);
+    filesys_init((uint32_t)(uintptr_t)img);
+}
+
+/*
+ * collect
+ *  DESCRIPTION : list every directory and regular file under a directory, walking it
+ *                with dir_getdents
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           const char* prefix - its path, "" for the root
+ *  OUTPUTS : files, num_files, dirs, num_dirs
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : reuse file descriptor BENCH_DIR_FD
+ */
+static void collect(uint32_t dir, const char* prefix)
+{
+    fs_dirent_t ents[16];
+    uint32_t first = num_files, last, i;
+    int32_t cnt;
+    dirs[num_dirs++] = dir;
+
+    fsbench_open_dir(BENCH_DIR_FD, dir);
+    while ((cnt = dir_getdents(BENCH_DIR_FD, ents, sizeof(ents))) > 0) {
+        for (i = 0; i < cnt / sizeof(fs_dirent_t); i++) {
+            if ((ents[i].file_type == FILE_TYPE_RTC) || (ents[i].name[0] == '.')) continue;
+            if (num_files == BENCH_MAX_FILES) return;
+            if (snprintf(files[num_files].path, FS_MAX_PATH_LEN, "%s%s", prefix, (char*)ents[i].name) >= FS_MAX_PATH_LEN) continue;
+            files[num_files].inode = ents[i].inode;
+            files[num_files].length = (ents[i].file_type == FILE_TYPE_DIR) ? (uint32_t)-1 : ents[i].length;
+            num_files++;
+        }
+    }
+
+    /* recurse after the listing, the walk shares one file descriptor */
+    last = num_files;
+    for (i = first; i < last; i++) {
+        if (files[i].length != (uint32_t)-1) continue;
+        char sub[FS_MAX_PATH_LEN];
+        if (snprintf(sub, FS_MAX_PATH_LEN, "%s/", files[i].path) >= FS_MAX_PATH_LEN) continue;
+        collect(files[i].inode, sub);
+    }
+}
+
+/*
+ * drop_dirs
+ *  DESCRIPTION : keep only the regular files in the list built by collect
+ *  INPUTS : none
+ *  OUTPUTS : files, num_files
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void drop_dirs(void)
+{
+    uint32_t i, n = 0;
+    for (i = 0; i < num_files; i++) {
+        if (files[i].length != (uint32_t)-1) files[n++] = files[i];
+    }
+    num_files = n;
+}
+
+/*
+ * bench_lookups
+ *  DESCRIPTION : time read_dentry_by_name on the paths of every file in random order,
+ *                then on the same paths with a suffix so every lookup misses
+ *  INPUTS : none
+ *  OUTPUTS : a line on stdout
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void bench_lookups(void)
+{
+    char miss[FS_MAX_PATH_LEN + 2];
+    dentry_t dentry;
+    uint64_t start, hits = 0, misses = 0, hit_ns, miss_ns;
+    uint32_t i, j;
+
+    start = now_ns();
+    do {
+        for (i = 0; i < num_files; i++, hits++) {
+            j = bench_rand() % num_files;
+            if (read_dentry_by_name((uint8_t*)files[j].path, &dentry) != 0) die("lookup failed", files[j].path);
+        }
+    } while (now_ns() - start < BENCH_MIN_NS);
+    hit_ns = now_ns() - start;
+
+    start = now_ns();
+    do {
+        for (i = 0; i < num_files; i++, misses++) {
+            snprintf(miss, sizeof(miss), "%.*s~", FS_MAX_PATH_LEN - 2, files[bench_rand() % num_files].path);
+            if (read_dentry_by_name((uint8_t*)miss, &dentry) == 0) die("lookup of a missing name succeeded", miss);
+        }
+    } while (now_ns() - start < BENCH_MIN_NS);
+    miss_ns = now_ns() - start;
+
+    printf("  lookups      %10.0f hits/s %10.0f misses/s\n", hits * 1e9 / hit_ns, misses * 1e9 / miss_ns);
+}
+
+/*
+ * bench_sequential
+ *  DESCRIPTION : time reading every file from start to end with read_data
+ *  INPUTS : none
+ *  OUTPUTS : a line on stdout
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void bench_sequential(void)
+{
+    uint64_t start, bytes = 0, ns;
+    uint32_t i, offset;
+    int32_t cnt;
+
+    start = now_ns();
+    do {
+        for (i = 0; i < num_files; i++) {
+            for (offset = 0; offset < files[i].length; offset += cnt) {
+                cnt = read_data(files[i].inode, offset, buf, BENCH_SEQ_CHUNK);
+                if (cnt <= 0) die("read failed", files[i].path);
+                bytes += cnt;
+            }
+        }
+    } while ((bytes != 0) && (now_ns() - start < BENCH_MIN_NS));
+    ns = now_ns() - start;
+
+    printf("  sequential   %10.1f MB/s\n", bytes * 1e9 / ns / (1024 * 1024));
+}
+
+/*
+ * bench_random
+ *  DESCRIPTION : time 4kB reads with read_data at random offsets of random non-empty files
+ *  INPUTS : none
+ *  OUTPUTS : a line on stdout
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void bench_random(void)
+{
+    uint64_t start, bytes = 0, reads = 0, ns;
+    uint32_t i, n;
+    int32_t cnt;
+
+    start = now_ns();
+    do {
+        for (n = 0; n < 1024; n++) {
+            i = bench_rand() % num_files;
+            if (files[i].length == 0) continue;
+            cnt = read_data(files[i].inode, bench_rand() % files[i].length, buf, BENCH_RAND_CHUNK);
+            if (cnt <= 0) die("read failed", files[i].path);
+            bytes += cnt;
+            reads++;
+        }
+    } while ((reads != 0) && (now_ns() - start < BENCH_MIN_NS));
+    ns = now_ns() - start;
+
+    printf("  random       %10.1f MB/s %10.0f reads/s\n", bytes * 1e9 / ns / (1024 * 1024), reads * 1e9 / ns);
+}
+
+/*
+ * bench_dir_scan
+ *  DESCRIPTION : time listing every directory with dir_read, one name per call, and
+ *                with dir_getdents, a buffer of records per call
+ *  INPUTS : none
+ *  OUTPUTS : a line on stdout
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : reuse file descriptor BENCH_DIR_FD
+ */
+static void bench_dir_scan(void)
+{
+    static fs_dirent_t ents[64];
+    uint64_t start, read_ents = 0, dents_ents = 0, read_ns, dents_ns;
+    uint32_t d;
+    int32_t cnt;
+
+    start = now_ns();
+    do {
+        for (d = 0; d < num_dirs; d++) {
+            fsbench_open_dir(BENCH_DIR_FD, dirs[d]);
+            while (dir_read(BENCH_DIR_FD, buf, MAX_FILENAME_LEN) > 0) read_ents++;
+        }
+    } while (now_ns() - start < BENCH_MIN_NS);
+    read_ns = now_ns() - start;
+
+    start = now_ns();
+    do {
+        for (d = 0; d < num_dirs; d++) {
+            fsbench_open_dir(BENCH_DIR_FD, dirs[d]);
+            while ((cnt = dir_getdents(BENCH_DIR_FD, ents, sizeof(ents))) > 0) dents_ents += cnt / sizeof(fs_dirent_t);
+        }
+    } while (now_ns() - start < BENCH_MIN_NS);
+    dents_ns = now_ns() - start;
+
+    printf("  dir scan     %10.1f ns/entry (dir_read) %6.1f ns/entry (getdents)\n",
+           (double)read_ns / read_ents, (double)dents_ns / dents_ents);
+}
+
+int main(int argc, char** argv)
+{
+    int i;
+    if ((argc == 4) && !strcmp(argv[1], "-g")) {
+        write_tree(strtoul(argv[2], NULL, 0), argv[3]);
+        return 0;
+    }
+    if ((argc < 2) || (argv[1][0] == '-')) {
+        fprintf(stderr, "usage: %s <image>...\n       %s -g <files> <dir>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    files = calloc(BENCH_MAX_FILES, sizeof(bench_file_t));
+    if (files == NULL) die("out of memory", NULL);
+
+    for (i = 1; i < argc; i++) {
+        map_image(argv[i]);
+        num_files = 0;
+        num_dirs = 0;
+        collect(FS_ROOT_INODE, "");
+        drop_dirs();
+        printf("%s: %u files, %u directories\n", argv[i], num_files, num_dirs);
+        if (num_files == 0) continue;
+        bench_lookups();
+        bench_sequential();
+        bench_random();
+        bench_dir_scan();
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* fsbench_glue.c - the kernel side of fsbench
+ *
+ * Built with the kernel headers next to filesys.c, this supplies what filesys.c
+ * expects from the rest of the kernel and lets fsbench open directories the way
+ * the open system call does, without pulling in system_call.c.
+ */
+
+#include "types.h"
+#include "system_call.h"
+#include "filesys.h"
+#include "ata.h"
+
+static file_desc_t open_files[FD_MAX];                  // the descriptors fd_lookup hands to filesys.c
+
+/*
+ * fd_lookup
+ *  DESCRIPTION : the open file behind a descriptor, as in system_call.c
+ *  INPUTS : int32_t fd - the file descriptor
+ *  OUTPUTS : none
+ *  RETURN VALUE : the open file, NULL if fd is not open
+ *  SIDE EFFECTS : none
+ */
+file_desc_t* fd_lookup(int32_t fd)
+{
+    if ((fd < 0) || (fd >= FD_MAX) || (open_files[fd].flags == 0)) return NULL;
+    return &open_files[fd];
+}
+
+/*
+ * fsbench_open_dir
+ *  DESCRIPTION : fill in file descriptor fd for a directory, at its first dentry
+ *  INPUTS : int32_t fd - the file descriptor
+ *           uint32_t inode - inode of the directory
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify open_files
+ */
+void fsbench_open_dir(int32_t fd, uint32_t inode)
+{
+    open_files[fd].file_op_ptr = NULL;                  // only dir_read and dir_getdents are called directly
+    open_files[fd].inode = inode;
+    open_files[fd].file_position = 0;
+    open_files[fd].flags = 1;
+    open_files[fd].refcount = 1;
+}
+
+/*
+ * ata_sectors, ata_read, ata_write
+ *  DESCRIPTION : fsbench has no disk, the image stays in memory as it does without one
+ *  INPUTS : as in ata.c
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 sectors, -1 for every transfer
+ *  SIDE EFFECTS : none
+ */
+uint32_t ata_sectors(void)
+{
+    return 0;
+}
+
+int32_t ata_read(uint32_t lba, uint32_t count, void* buf)
+{
+    return -1;
+}
+
+int32_t ata_write(uint32_t lba, uint32_t count, const void* buf)
+{
+    return -1;
+}
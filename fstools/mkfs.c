@@ -0,0 +1,678 @@
+/* mkfs.c - build a filesystem image for the kernel from a host directory
+ *
+ * Usage: mkfs -i <dir> -o <image> [-h <hotlist>] [-z] [-x] [-D] [-C] [-b <blocks>] [-n <inodes>]
+ *   -i   directory to copy into the image (subdirectories included)
+ *   -o   image file to write
+ *   -h   file listing one path per line, these files are laid out first in that order
+ *   -z   store files LZ4 compressed when that saves at least one block
+ *   -x   never store small files inline in their inode
+ *   -D   do not share identical data blocks between files
+ *   -C   do not store block checksums
+ *   -b   free data blocks to leave for files written at run time (default 64)
+ *   -n   free inodes to leave for files created at run time (default 32)
+ *
+ * Layout: boot block, inodes, then data blocks. Directories come first, then the
+ * files on the hot list, then executables, then everything else. Every file gets
+ * one contiguous run of data blocks, in the same order as its inode, with its
+ * indirect blocks behind the run so the data itself is never split. A block
+ * whose contents are already in the image is not stored again, the file points
+ * at the earlier copy instead (the kernel copies such shared blocks on write).
+ * Behind the file data comes a table with the CRC32C of every data block, which
+ * the kernel checks the first time it reads each block.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _TYPES_H                                    // use <stdint.h> instead of the kernel types
+#include "filesys.h"
+#include "lz4.h"
+#include "crc32c.h"
+
+#define MKFS_PATH_LEN        4096
+#define DEFAULT_SPARE_BLOCKS 64
+#define DEFAULT_SPARE_INODES 32
+#define HOT_NONE             0x7FFFFFFF              // hot rank of a file not on the hot list
+#define LZ4_HASH_BITS        12
+#define LZ4_MAX_OFFSET       65535
+#define LZ4_LAST_LITERALS    5                       // the format ends every block with at least 5 literals
+#define LZ4_MATCH_LIMIT      12                      // and starts no match in its last 12 bytes
+#define DEDUP_EMPTY          0xFFFFFFFF              // unused slot of the block dedup table
+
+typedef struct fs_node
+{
+    char name[MAX_FILENAME_LEN + 1];
+    char path[MKFS_PATH_LEN];                           // host path
+    char rel[MKFS_PATH_LEN];                            // path inside the image, matched against the hot list
+    int is_dir;
+    int is_exec;
+    int hot_rank;
+    uint8_t* data;                                      // file contents, or the dentries of a directory
+    uint32_t size;
+    uint8_t* stored;                                    // what goes into the data blocks (data, or the compressed stream)
+    uint32_t stored_size;
+    uint32_t flags;                                     // INODE_FLAG_*
+    uint32_t inode;
+    uint32_t* blocks;                                   // data block of each stored block
+    uint32_t num_blocks;                                // stored blocks
+    uint32_t first_table;                               // first of the indirect blocks behind the run
+    uint32_t table_blocks;                              // number of indirect blocks
+    struct fs_node* parent;
+    struct fs_node** children;
+    uint32_t num_children;
+} fs_node_t;
+
+static char** hot_list;
+static int hot_count;
+
+static uint32_t* dedup_table;                               // open addressed, holds block numbers, DEDUP_EMPTY if unused
+static uint32_t dedup_mask;
+
+/*
+ * die
+ *  DESCRIPTION : print an error and exit
+ *  INPUTS : const char* msg - the message
+ *           const char* what - the file it is about, may be NULL
+ *  OUTPUTS : the message on stderr
+ *  RETURN VALUE : does not return
+ *  SIDE EFFECTS : exit the program
+ */
+static void die(const char* msg, const char* what)
+{
+    if (what != NULL) fprintf(stderr, "mkfs: %s: %s\n", what, msg);
+    else fprintf(stderr, "mkfs: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * xmalloc
+ *  DESCRIPTION : allocate zeroed memory or exit
+ *  INPUTS : size_t size - number of bytes
+ *  OUTPUTS : none
+ *  RETURN VALUE : the memory
+ *  SIDE EFFECTS : none
+ */
+static void* xmalloc(size_t size)
+{
+    void* p = calloc(1, size ? size : 1);
+    if (p == NULL) die("out of memory", NULL);
+    return p;
+}
+
+/*
+ * read_file
+ *  DESCRIPTION : read a whole host file
+ *  INPUTS : fs_node_t* node - the node, path set
+ *  OUTPUTS : node->data and node->size
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : exit on error
+ */
+static void read_file(fs_node_t* node)
+{
+    FILE* f = fopen(node->path, "rb");
+    long size;
+    if (f == NULL) die("cannot open", node->path);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if ((size < 0) || ((unsigned long)size > 0xFFFFFFFFUL)) die("file too large", node->path);
+    node->data = xmalloc(size);
+    node->size = size;
+    if (fread(node->data, 1, size, f) != (size_t)size) die("read error", node->path);
+    fclose(f);
+    node->is_exec = (size >= 4) && (node->data[0] == 0x7F) && (node->data[1] == 'E') &&
+                    (node->data[2] == 'L') && (node->data[3] == 'F');
+}
+
+/*
+ * node_cmp
+ *  DESCRIPTION : qsort order of directory entries, by name
+ */
+static int node_cmp(const void* a, const void* b)
+{
+    return strcmp((*(fs_node_t* const*)a)->name, (*(fs_node_t* const*)b)->name);
+}
+
+/*
+ * scan_dir
+ *  DESCRIPTION : read a host directory into a node tree. Names are cut to
+ *                MAX_FILENAME_LEN like the dentries hold them.
+ *  INPUTS : fs_node_t* dir - the directory node, path and rel set
+ *  OUTPUTS : dir->children
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : exit on error
+ */
+static void scan_dir(fs_node_t* dir)
+{
+    DIR* d = opendir(dir->path);
+    struct dirent* ent;
+    struct stat st;
+    uint32_t cap = 16, i;
+    if (d == NULL) die("cannot open directory", dir->path);
+    dir->children = xmalloc(cap * sizeof(fs_node_t*));
+
+    while ((ent = readdir(d)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        fs_node_t* node = xmalloc(sizeof(fs_node_t));
+        memcpy(node->name, ent->d_name, strnlen(ent->d_name, MAX_FILENAME_LEN));
+        if ((snprintf(node->path, MKFS_PATH_LEN, "%s/%s", dir->path, ent->d_name) >= MKFS_PATH_LEN) ||
+            (snprintf(node->rel, MKFS_PATH_LEN, "%s%s%s", dir->rel, (dir->rel[0] == '\0') ? "" : "/", node->name) >= MKFS_PATH_LEN)) {
+            die("path too long", dir->path);
+        }
+        node->parent = dir;
+        node->hot_rank = HOT_NONE;
+        if (stat(node->path, &st) != 0) die("cannot stat", node->path);
+        if (S_ISDIR(st.st_mode)) {
+            node->is_dir = 1;
+            scan_dir(node);
+        } else if (S_ISREG(st.st_mode)) {
+            read_file(node);
+        } else {
+            free(node);
+            continue;                                                           // skip sockets, devices, ...
+        }
+        if (dir->num_children == cap) {
+            cap *= 2;
+            dir->children = realloc(dir->children, cap * sizeof(fs_node_t*));
+            if (dir->children == NULL) die("out of memory", NULL);
+        }
+        dir->children[dir->num_children++] = node;
+    }
+    closedir(d);
+
+    qsort(dir->children, dir->num_children, sizeof(fs_node_t*), node_cmp);
+    for (i = 1; i < dir->num_children; i++) {
+        if (!strcmp(dir->children[i - 1]->name, dir->children[i]->name)) die("two names are the same once cut to 32 characters", dir->children[i]->path);
+    }
+}
+
+/*
+ * read_hot_list
+ *  DESCRIPTION : read the hot list, one image path per line, '#' starts a comment
+ *  INPUTS : const char* file - the list
+ *  OUTPUTS : hot_list, hot_count
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : exit on error
+ */
+static void read_hot_list(const char* file)
+{
+    char line[MKFS_PATH_LEN];
+    int cap = 16;
+    FILE* f = fopen(file, "r");
+    if (f == NULL) die("cannot open", file);
+    hot_list = xmalloc(cap * sizeof(char*));
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* end = line + strcspn(line, "#\r\n");
+        while ((end > line) && ((end[-1] == ' ') || (end[-1] == '\t'))) end--;
+        *end = '\0';
+        if (line[0] == '\0') continue;
+        if (hot_count == cap) {
+            cap *= 2;
+            hot_list = realloc(hot_list, cap * sizeof(char*));
+            if (hot_list == NULL) die("out of memory", NULL);
+        }
+        hot_list[hot_count++] = strdup(line);
+    }
+    fclose(f);
+}
+
+/*
+ * collect
+ *  DESCRIPTION : list every directory (breadth first) and every file below a directory
+ *  INPUTS : fs_node_t* root - the root directory
+ *  OUTPUTS : dirs, num_dirs, files, num_files
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : allocate the lists
+ */
+static void collect(fs_node_t* root, fs_node_t*** dirs, uint32_t* num_dirs, fs_node_t*** files, uint32_t* num_files)
+{
+    uint32_t cap_dirs = 16, cap_files = 64, head, i;
+    *dirs = xmalloc(cap_dirs * sizeof(fs_node_t*));
+    *files = xmalloc(cap_files * sizeof(fs_node_t*));
+    *num_dirs = 0;
+    *num_files = 0;
+    (*dirs)[(*num_dirs)++] = root;
+    for (head = 0; head < *num_dirs; head++) {
+        fs_node_t* dir = (*dirs)[head];
+        for (i = 0; i < dir->num_children; i++) {
+            fs_node_t* child = dir->children[i];
+            if (child->is_dir) {
+                if (*num_dirs == cap_dirs) *dirs = realloc(*dirs, (cap_dirs *= 2) * sizeof(fs_node_t*));
+                if (*dirs == NULL) die("out of memory", NULL);
+                (*dirs)[(*num_dirs)++] = child;
+            } else {
+                if (*num_files == cap_files) *files = realloc(*files, (cap_files *= 2) * sizeof(fs_node_t*));
+                if (*files == NULL) die("out of memory", NULL);
+                (*files)[(*num_files)++] = child;
+            }
+        }
+    }
+}
+
+/*
+ * layout_cmp
+ *  DESCRIPTION : qsort order of the files on disk: hot list order, then executables,
+ *                then the rest, each group by path
+ */
+static int layout_cmp(const void* a, const void* b)
+{
+    const fs_node_t* x = *(fs_node_t* const*)a;
+    const fs_node_t* y = *(fs_node_t* const*)b;
+    if (x->hot_rank != y->hot_rank) return (x->hot_rank < y->hot_rank) ? -1 : 1;
+    if (x->is_exec != y->is_exec) return y->is_exec - x->is_exec;
+    return strcmp(x->rel, y->rel);
+}
+
+/*
+ * put_dentry
+ *  DESCRIPTION : fill a dentry
+ *  INPUTS : dentry_t* dentry - the dentry
+ *           const char* name - the name, at most MAX_FILENAME_LEN characters
+ *           uint32_t type - FILE_TYPE_*
+ *           uint32_t inode - the inode number
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void put_dentry(dentry_t* dentry, const char* name, uint32_t type, uint32_t inode)
+{
+    memset(dentry, 0, sizeof(dentry_t));
+    memcpy(dentry->file_name, name, strnlen(name, MAX_FILENAME_LEN));          // not NUL terminated at 32 characters
+    dentry->file_type = type;
+    dentry->inode = inode;
+}
+
+/*
+ * build_dir
+ *  DESCRIPTION : make the contents of a subdirectory: ".", ".." and one dentry per child
+ *  INPUTS : fs_node_t* dir - the directory, inode numbers of its children assigned
+ *  OUTPUTS : dir->data and dir->size
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void build_dir(fs_node_t* dir)
+{
+    uint32_t i;
+    dentry_t* dentries = xmalloc((dir->num_children + 2) * sizeof(dentry_t));
+    put_dentry(&dentries[0], ".", FILE_TYPE_DIR, dir->inode);
+    put_dentry(&dentries[1], "..", FILE_TYPE_DIR, dir->parent->inode);
+    for (i = 0; i < dir->num_children; i++) {
+        fs_node_t* child = dir->children[i];
+        put_dentry(&dentries[i + 2], child->name, child->is_dir ? FILE_TYPE_DIR : FILE_TYPE_REGULAR, child->inode);
+    }
+    dir->data = (uint8_t*)dentries;
+    dir->size = (dir->num_children + 2) * sizeof(dentry_t);
+}
+
+/*
+ * lz4_put_len
+ *  DESCRIPTION : write the bytes that extend a 4-bit length field past 15
+ */
+static uint8_t* lz4_put_len(uint8_t* op, uint32_t len)
+{
+    for (; len >= LZ4_LEN_MORE; len -= LZ4_LEN_MORE) *op++ = LZ4_LEN_MORE;
+    *op++ = len;
+    return op;
+}
+
+/*
+ * lz4_encode_block
+ *  DESCRIPTION : greedy LZ4 block compressor with a hash table of 4-byte sequences,
+ *                the counterpart of lz4_decode_block in the kernel
+ *  INPUTS : const uint8_t* src - the data
+ *           uint32_t n - its size
+ *           uint8_t* dst - where to put the block
+ *           uint32_t cap - size of dst
+ *  OUTPUTS : the block in dst
+ *  RETURN VALUE : the size of the block, 0 if it does not fit in cap
+ *  SIDE EFFECTS : none
+ */
+static uint32_t lz4_encode_block(const uint8_t* src, uint32_t n, uint8_t* dst, uint32_t cap)
+{
+    int32_t table[1 << LZ4_HASH_BITS];
+    uint32_t ip = 0, anchor = 0, lit, seq, ref, len;
+    uint32_t match_limit = (n > LZ4_MATCH_LIMIT) ? n - LZ4_MATCH_LIMIT : 0;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+    uint8_t* token;
+    int i;
+    for (i = 0; i < (1 << LZ4_HASH_BITS); i++) table[i] = -1;
+
+    while (ip < match_limit) {
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        int32_t cand = table[h];
+        table[h] = ip;
+        if ((cand < 0) || (ip - cand > LZ4_MAX_OFFSET) || memcmp(src + cand, src + ip, 4)) {
+            ip++;
+            continue;
+        }
+        ref = cand;
+        for (len = LZ4_MIN_MATCH; (ip + len < n - LZ4_LAST_LITERALS) && (src[ref + len] == src[ip + len]); len++);
+
+        lit = ip - anchor;
+        if (op + 1 + lit + lit / LZ4_LEN_MORE + 2 + 2 + len / LZ4_LEN_MORE + 1 > oend) return 0;
+        token = op++;
+        *token = ((lit >= LZ4_LEN_MASK) ? LZ4_LEN_MASK : lit) << 4;
+        if (lit >= LZ4_LEN_MASK) op = lz4_put_len(op, lit - LZ4_LEN_MASK);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xFF;
+        *op++ = (ip - ref) >> 8;
+        len -= LZ4_MIN_MATCH;
+        *token |= (len >= LZ4_LEN_MASK) ? LZ4_LEN_MASK : len;
+        if (len >= LZ4_LEN_MASK) op = lz4_put_len(op, len - LZ4_LEN_MASK);
+        ip += len + LZ4_MIN_MATCH;
+        anchor = ip;
+    }
+
+    lit = n - anchor;                                                           // the last sequence is literals only
+    if (op + 1 + lit + lit / LZ4_LEN_MORE + 1 > oend) return 0;
+    token = op++;
+    *token = ((lit >= LZ4_LEN_MASK) ? LZ4_LEN_MASK : lit) << 4;
+    if (lit >= LZ4_LEN_MASK) op = lz4_put_len(op, lit - LZ4_LEN_MASK);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/*
+ * compress_file
+ *  DESCRIPTION : build the stored form of a compressed file: an offset table of
+ *                (blocks + 1) words, then each block LZ4 compressed, or as is when
+ *                it does not shrink. The result is kept only if it saves a block.
+ *  INPUTS : fs_node_t* node - the file
+ *  OUTPUTS : node->stored, node->stored_size, node->flags
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void compress_file(fs_node_t* node)
+{
+    uint32_t nb = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t pos = (nb + 1) * sizeof(uint32_t);
+    uint8_t* stream = xmalloc(pos + (size_t)nb * BLOCK_SIZE);
+    uint32_t* table = (uint32_t*)stream;
+    uint32_t i;
+    for (i = 0; i < nb; i++) {
+        uint32_t raw = node->size - i * BLOCK_SIZE;
+        if (raw > BLOCK_SIZE) raw = BLOCK_SIZE;
+        table[i] = pos;
+        uint32_t size = lz4_encode_block(node->data + i * BLOCK_SIZE, raw, stream + pos, raw - 1);
+        if (size == 0) {
+            memcpy(stream + pos, node->data + i * BLOCK_SIZE, raw);             // incompressible, stored size == raw size
+            size = raw;
+        }
+        pos += size;
+    }
+    table[nb] = pos;
+
+    if ((pos + BLOCK_SIZE - 1) / BLOCK_SIZE >= nb) {
+        free(stream);                                                           // saves nothing
+        return;
+    }
+    node->stored = stream;
+    node->stored_size = pos;
+    node->flags = INODE_FLAG_COMPRESSED;
+}
+
+/*
+ * table_blocks_for
+ *  DESCRIPTION : count the indirect blocks a file of num_blocks data blocks needs
+ */
+static uint32_t table_blocks_for(uint32_t num_blocks)
+{
+    uint32_t tables = 0;
+    if (num_blocks > INODE_DIRECT_BLOCKS) tables++;                              // single indirect
+    if (num_blocks > INODE_DIRECT_BLOCKS + BLOCK_PTRS) {
+        tables++;                                                               // double indirect
+        tables += (num_blocks - INODE_DIRECT_BLOCKS - BLOCK_PTRS + BLOCK_PTRS - 1) / BLOCK_PTRS;
+    }
+    return tables;
+}
+
+/*
+ * block_hash
+ *  DESCRIPTION : FNV-1a hash of a data block
+ */
+static uint32_t block_hash(const uint8_t* block)
+{
+    uint32_t hash = 2166136261U;
+    uint32_t i;
+    for (i = 0; i < BLOCK_SIZE; i++) hash = (hash ^ block[i]) * 16777619U;
+    return hash;
+}
+
+/*
+ * place_blocks
+ *  DESCRIPTION : give each stored block of a file a data block. New contents go to the
+ *                next free block, so unique blocks form one run; contents already in
+ *                the pool reuse that block when dedup is on. The indirect blocks follow.
+ *  INPUTS : fs_node_t* node - the file or directory, stored form chosen
+ *           uint8_t* pool - the data block area of the image
+ *           uint32_t* next_block - first unused block of the pool
+ *           int dedup - share identical blocks
+ *  OUTPUTS : node->blocks, node->first_table, the unique blocks in pool
+ *  RETURN VALUE : the number of blocks shared with earlier files
+ *  SIDE EFFECTS : update dedup_table
+ */
+static uint32_t place_blocks(fs_node_t* node, uint8_t* pool, uint32_t* next_block, int dedup)
+{
+    uint8_t block[BLOCK_SIZE];
+    uint32_t shared = 0;
+    uint32_t i;
+    node->blocks = xmalloc(node->num_blocks * sizeof(uint32_t));
+    for (i = 0; i < node->num_blocks; i++) {
+        uint32_t size = node->stored_size - i * BLOCK_SIZE;
+        if (size > BLOCK_SIZE) size = BLOCK_SIZE;
+        memset(block, 0, BLOCK_SIZE);                                           // the tail of the last block is zero
+        memcpy(block, node->stored + (size_t)i * BLOCK_SIZE, size);
+
+        uint32_t slot = block_hash(block) & dedup_mask;
+        if (dedup) {
+            while ((dedup_table[slot] != DEDUP_EMPTY) && memcmp(pool + (size_t)BLOCK_SIZE * dedup_table[slot], block, BLOCK_SIZE)) {
+                slot = (slot + 1) & dedup_mask;
+            }
+            if (dedup_table[slot] != DEDUP_EMPTY) {
+                node->blocks[i] = dedup_table[slot];
+                shared++;
+                continue;
+            }
+            dedup_table[slot] = *next_block;
+        }
+        node->blocks[i] = (*next_block)++;
+        memcpy(pool + (size_t)BLOCK_SIZE * node->blocks[i], block, BLOCK_SIZE);
+    }
+    node->first_table = *next_block;
+    *next_block += node->table_blocks;
+    return shared;
+}
+
+/*
+ * write_inode
+ *  DESCRIPTION : fill the inode of a node and its indirect blocks in the image
+ *  INPUTS : inode_t* inodes - the inode area of the image
+ *           uint8_t* pool - the data block area of the image
+ *           fs_node_t* node - the file or directory, blocks placed
+ *  OUTPUTS : the inode and indirect blocks in the image
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void write_inode(inode_t* inodes, uint8_t* pool, fs_node_t* node)
+{
+    inode_t* inode = inodes + node->inode;
+    uint32_t table_block = node->first_table;
+    uint32_t i;
+
+    inode->length = node->size;
+    inode->flags = node->flags;
+    if (node->flags & INODE_FLAG_INLINE) {
+        memcpy(inode->data_blocks, node->stored, node->stored_size);
+        return;
+    }
+    for (i = 0; (i < node->num_blocks) && (i < INODE_DIRECT_BLOCKS); i++) inode->data_blocks[i] = node->blocks[i];
+    if (node->num_blocks > INODE_DIRECT_BLOCKS) {
+        uint32_t* table = (uint32_t*)(pool + (size_t)BLOCK_SIZE * table_block);
+        inode->indirect_block = table_block++;
+        for (i = INODE_DIRECT_BLOCKS; (i < node->num_blocks) && (i < INODE_DIRECT_BLOCKS + BLOCK_PTRS); i++) {
+            table[i - INODE_DIRECT_BLOCKS] = node->blocks[i];
+        }
+    }
+    if (node->num_blocks > INODE_DIRECT_BLOCKS + BLOCK_PTRS) {
+        uint32_t* outer = (uint32_t*)(pool + (size_t)BLOCK_SIZE * table_block);
+        uint32_t* table = NULL;
+        inode->double_indirect_block = table_block++;
+        for (i = INODE_DIRECT_BLOCKS + BLOCK_PTRS; i < node->num_blocks; i++) {
+            uint32_t idx = i - INODE_DIRECT_BLOCKS - BLOCK_PTRS;
+            if (idx % BLOCK_PTRS == 0) {
+                outer[idx / BLOCK_PTRS] = table_block;
+                table = (uint32_t*)(pool + (size_t)BLOCK_SIZE * table_block++);
+            }
+            table[idx % BLOCK_PTRS] = node->blocks[i];
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* in_dir = NULL;
+    const char* out_file = NULL;
+    const char* hot_file = NULL;
+    int compress = 0, inline_small = 1, dedup = 1, checksums = 1, opt;
+    uint32_t spare_blocks = DEFAULT_SPARE_BLOCKS, spare_inodes = DEFAULT_SPARE_INODES;
+    fs_node_t root;
+    fs_node_t** dirs;
+    fs_node_t** files;
+    fs_node_t** order;
+    uint32_t num_dirs, num_files, num_nodes, i, j;
+    uint32_t next_block = 0, max_blocks = 0, num_inline = 0, num_compressed = 0, num_shared = 0, raw_blocks = 0, csum_blocks = 0;
+
+    while ((opt = getopt(argc, argv, "i:o:h:zxDCb:n:")) != -1) {
+        switch (opt) {
+            case 'i': in_dir = optarg; break;
+            case 'o': out_file = optarg; break;
+            case 'h': hot_file = optarg; break;
+            case 'z': compress = 1; break;
+            case 'x': inline_small = 0; break;
+            case 'D': dedup = 0; break;
+            case 'C': checksums = 0; break;
+            case 'b': spare_blocks = strtoul(optarg, NULL, 0); break;
+            case 'n': spare_inodes = strtoul(optarg, NULL, 0); break;
+            default: in_dir = NULL; optind = argc; break;
+        }
+    }
+    if ((in_dir == NULL) || (out_file == NULL)) {
+        fprintf(stderr, "usage: %s -i <dir> -o <image> [-h <hotlist>] [-z] [-x] [-D] [-C] [-b <blocks>] [-n <inodes>]\n", argv[0]);
+        return 1;
+    }
+    if (hot_file != NULL) read_hot_list(hot_file);
+
+    /* read the tree */
+    memset(&root, 0, sizeof(root));
+    snprintf(root.path, MKFS_PATH_LEN, "%s", in_dir);
+    root.is_dir = 1;
+    root.inode = FS_ROOT_INODE;
+    root.parent = &root;
+    scan_dir(&root);
+    if (root.num_children + 2 > MAX_FILES_NUMBER) die("too many entries in the root directory", in_dir);   // plus "." and "rtc"
+    collect(&root, &dirs, &num_dirs, &files, &num_files);
+    for (i = 0; i < num_files; i++) {
+        for (j = 0; j < (uint32_t)hot_count; j++) {
+            if (!strcmp(files[i]->rel, hot_list[j])) {
+                files[i]->hot_rank = j;
+                break;
+            }
+        }
+    }
+    qsort(files, num_files, sizeof(fs_node_t*), layout_cmp);
+
+    /* inode numbers follow the layout: subdirectories, then files, inode 0 is the root */
+    num_nodes = (num_dirs - 1) + num_files;
+    order = xmalloc((num_nodes + 1) * sizeof(fs_node_t*));
+    for (i = 1; i < num_dirs; i++) order[i - 1] = dirs[i];
+    for (i = 0; i < num_files; i++) order[num_dirs - 1 + i] = files[i];
+    for (i = 0; i < num_nodes; i++) order[i]->inode = i + 1;
+    if (num_nodes + 1 + spare_inodes > FS_MAX_INODES) die("too many files", in_dir);
+    for (i = 1; i < num_dirs; i++) build_dir(dirs[i]);
+
+    /* choose how each file is stored */
+    for (i = 0; i < num_nodes; i++) {
+        fs_node_t* node = order[i];
+        node->stored = node->data;
+        node->stored_size = node->size;
+        if (inline_small && (node->size <= INODE_INLINE_MAX)) {
+            node->flags = INODE_FLAG_INLINE;
+            num_inline++;
+            continue;
+        }
+        if (compress && !node->is_dir) compress_file(node);
+        if (node->flags & INODE_FLAG_COMPRESSED) num_compressed++;
+        node->num_blocks = (node->stored_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        node->table_blocks = table_blocks_for(node->num_blocks);
+        if (node->num_blocks > INODE_MAX_BLOCKS) die("file too large", node->path);
+        max_blocks += node->num_blocks + node->table_blocks;
+        raw_blocks += (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    if (max_blocks > FS_MAX_DATA_BLOCKS) max_blocks = FS_MAX_DATA_BLOCKS + 1;  // too large even before dedup, fails below
+
+    /* give each file a contiguous run of the blocks that are not shared */
+    uint8_t* pool = xmalloc((size_t)BLOCK_SIZE * max_blocks);
+    for (dedup_mask = 1; dedup_mask < 2 * max_blocks; dedup_mask <<= 1);
+    dedup_table = xmalloc(dedup_mask * sizeof(uint32_t));
+    memset(dedup_table, 0xFF, dedup_mask * sizeof(uint32_t));
+    dedup_mask--;
+    for (i = 0; i < num_nodes; i++) {
+        if (order[i]->flags & INODE_FLAG_INLINE) continue;
+        if (order[i]->num_blocks + order[i]->table_blocks + next_block > max_blocks) die("image too large", in_dir);
+        num_shared += place_blocks(order[i], pool, &next_block, dedup);
+    }
+    /* the checksum table covers every data block, its own blocks included */
+    if (checksums) {
+        while (csum_blocks * BLOCK_PTRS < next_block + spare_blocks + csum_blocks) csum_blocks++;
+    }
+    if (next_block + csum_blocks + spare_blocks > FS_MAX_DATA_BLOCKS) die("image too large", in_dir);
+
+    /* write the image */
+    uint32_t num_inodes = num_nodes + 1 + spare_inodes;
+    uint32_t num_data_blocks = next_block + csum_blocks + spare_blocks;
+    size_t img_size = (size_t)BLOCK_SIZE * (1 + num_inodes + num_data_blocks);
+    uint8_t* img = xmalloc(img_size);
+    boot_block_t* boot = (boot_block_t*)img;
+    boot->num_inodes = num_inodes;
+    boot->num_data_blocks = num_data_blocks;
+    boot->layout_magic = FS_LAYOUT_MAGIC;                                                           // not a createfs image, the kernel leaves the inodes alone
+    put_dentry(&boot->dir_entries[boot->num_dir_entries++], ".", FILE_TYPE_DIR, FS_ROOT_INODE);
+    put_dentry(&boot->dir_entries[boot->num_dir_entries++], "rtc", FILE_TYPE_RTC, 0);
+    for (i = 0; i < root.num_children; i++) {
+        fs_node_t* child = root.children[i];
+        put_dentry(&boot->dir_entries[boot->num_dir_entries++], child->name, child->is_dir ? FILE_TYPE_DIR : FILE_TYPE_REGULAR, child->inode);
+    }
+    for (i = 0; i < num_nodes; i++) write_inode((inode_t*)(img + BLOCK_SIZE), pool, order[i]);
+    memcpy(img + (size_t)BLOCK_SIZE * (1 + num_inodes), pool, (size_t)BLOCK_SIZE * next_block);
+    if (checksums) {
+        uint8_t* data = img + (size_t)BLOCK_SIZE * (1 + num_inodes);
+        uint32_t* csum = (uint32_t*)(data + (size_t)BLOCK_SIZE * next_block);
+        crc32c_init();
+        for (i = 0; i < num_data_blocks; i++) {
+            if ((i >= next_block) && (i < next_block + csum_blocks)) continue;                     // the table itself stays 0
+            csum[i] = crc32c(0, data + (size_t)BLOCK_SIZE * i, BLOCK_SIZE);
+        }
+        boot->csum_magic = FS_CSUM_MAGIC;
+        boot->csum_block = next_block;
+    }
+
+    FILE* out = fopen(out_file, "wb");
+    if (out == NULL) die("cannot create", out_file);
+    if (fwrite(img, 1, img_size, out) != img_size) die("write error", out_file);
+    fclose(out);
+
+    printf("%s: %u files, %u directories, %u inodes, %u data blocks (%u free, %u of checksums)\n",
+           out_file, num_files, num_dirs - 1, num_inodes, num_data_blocks, spare_blocks, csum_blocks);
+    printf("%u files inline, %u compressed, %u blocks shared, %u blocks of file data stored in %u\n",
+           num_inline, num_compressed, num_shared, raw_blocks, next_block);
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include "ata.h"
+#include "lib.h"
+#include "paging.h"
+#include "i8259.h"
+
+static uint32_t ata_disk_sectors;                                                                   // size of the filesystem disk, 0 if there is none
+static uint16_t ata_bm_base;                                                                        // bus master registers of the primary channel, 0 if there are none
+static prd_t ata_prdt[BM_PRD_ENTRIES] __attribute__((aligned(64)));                                 // aligned so the table never crosses a 64KB boundary
+static volatile uint32_t ata_irq_done;                                                              // set by ata_handler when a DMA command completes
+static volatile uint8_t ata_irq_status;                                                             // ATA status read by ata_handler
+static volatile uint8_t ata_irq_bm_status;                                                          // bus master status read by ata_handler
+static volatile uint32_t ata_busy;                                                                  // a transfer is in progress
+
+/*
+ * ata_delay
+ *  DESCRIPTION : wait the 400ns a drive needs after it is selected, by reading the
+ *                alternate status register four times
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : none
+ */
+static void ata_delay(void)
+{
+    uint32_t i;
+    for (i = 0; i < 4; i++) inb(ATA_CONTROL_PORT);
+}
+
+/*
+ * ata_wait
+ *  DESCRIPTION : poll the status register until the drive is no longer busy and has
+ *                every bit of want set
+ *  INPUTS : uint8_t want - status bits to wait for, 0 to wait for BSY to clear only
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the drive is ready
+ *                 -1 - the drive reported an error or timed out
+ *  SIDE EFFECTS : reading the status acknowledges a pending interrupt of the drive
+ */
+static int32_t ata_wait(uint8_t want)
+{
+    uint32_t i;
+    uint8_t status;
+    for (i = 0; i < ATA_TIMEOUT; i++) {
+        status = inb(ATA_STATUS_PORT);
+        if (status & ATA_SR_BSY) continue;
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) return -1;
+        if ((status & want) == want) return 0;
+    }
+    return -1;
+}
+
+/*
+ * ata_command
+ *  DESCRIPTION : select the filesystem disk and issue an LBA28 command
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors, 1 to ATA_MAX_SECTORS
+ *           uint8_t cmd - ATA_CMD_*
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the command was issued
+ *                 -1 - the drive stayed busy
+ *  SIDE EFFECTS : start the command on the drive
+ */
+static int32_t ata_command(uint32_t lba, uint32_t count, uint8_t cmd)
+{
+    outb(0xE0 | (ATA_FS_DRIVE << 4) | ((lba >> 24) & 0x0F), ATA_DRIVE_PORT);                        // LBA mode, bits 24-27 of the sector
+    ata_delay();
+    if (ata_wait(0) != 0) return -1;
+    outb((uint8_t)count, ATA_COUNT_PORT);                                                           // 0 means 256
+    outb((uint8_t)lba, ATA_LBA_LO_PORT);
+    outb((uint8_t)(lba >> 8), ATA_LBA_MID_PORT);
+    outb((uint8_t)(lba >> 16), ATA_LBA_HI_PORT);
+    outb(cmd, ATA_STATUS_PORT);
+    return 0;
+}
+
+/*
+ * ata_pio
+ *  DESCRIPTION : move up to ATA_MAX_SECTORS sectors through the data port, one sector
+ *                per DRQ, polling the status in between
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors, 1 to ATA_MAX_SECTORS
+ *           uint8_t* buf - the data
+ *           uint32_t read - 1 to read from the disk, 0 to write to it
+ *  OUTPUTS : the sectors read in buf
+ *  RETURN VALUE : 0 - success
+ *                 -1 - the drive reported an error or timed out
+ *  SIDE EFFECTS : none
+ */
+static int32_t ata_pio(uint32_t lba, uint32_t count, uint8_t* buf, uint32_t read)
+{
+    uint32_t i, words;
+    uint8_t* ptr;
+    if (ata_command(lba, count, read ? ATA_CMD_READ_PIO : ATA_CMD_WRITE_PIO) != 0) return -1;
+    for (i = 0; i < count; i++) {
+        if (ata_wait(ATA_SR_DRQ) != 0) return -1;
+        ptr = buf + i * ATA_SECTOR_SIZE;
+        words = ATA_SECTOR_SIZE / 2;
+        if (read) {
+            asm volatile ("cld; rep insw" : "+D"(ptr), "+c"(words) : "d"(ATA_DATA_PORT) : "memory");
+        } else {
+            asm volatile ("cld; rep outsw" : "+S"(ptr), "+c"(words) : "d"(ATA_DATA_PORT) : "memory");
+        }
+    }
+    return ata_wait(0);
+}
+
+/*
+ * ata_wait_irq
+ *  DESCRIPTION : wait for the interrupt that ends a DMA command. With interrupts enabled
+ *                the CPU halts until ata_handler has run, so other work (the scheduler)
+ *                goes on meanwhile. With interrupts disabled the handler cannot run and
+ *                the bus master status is polled and acknowledged here instead.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the command completed
+ *                 -1 - it timed out (polling only)
+ *  SIDE EFFECTS : may halt the CPU until the next interrupt
+ */
+static int32_t ata_wait_irq(void)
+{
+    uint32_t flags, i;
+    cli_and_save(flags);
+    if (flags & EFLAGS_IF) {
+        while (!ata_irq_done) asm volatile ("sti; hlt; cli" : : : "memory");                       // sti holds off interrupts for one instruction, none is missed
+        restore_flags(flags);
+        return 0;
+    }
+    for (i = 0; (i < ATA_TIMEOUT) && !(inb(ata_bm_base + BM_STATUS) & BM_SR_IRQ); i++);
+    ata_irq_bm_status = inb(ata_bm_base + BM_STATUS);
+    outb(ata_irq_bm_status | BM_SR_IRQ | BM_SR_ERR, ata_bm_base + BM_STATUS);                       // write 1 to clear
+    ata_irq_status = inb(ATA_STATUS_PORT);
+    restore_flags(flags);
+    return (i < ATA_TIMEOUT) ? 0 : -1;
+}
+
+/*
+ * ata_dma
+ *  DESCRIPTION : move up to ATA_MAX_SECTORS sectors with the bus master. The buffer is
+ *                described by one PRD per piece up to the next 64KB boundary.
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors, 1 to ATA_MAX_SECTORS
+ *           uint8_t* buf - the data, word aligned, identity mapped or in the physical map
+ *           uint32_t read - 1 to read from the disk, 0 to write to it
+ *  OUTPUTS : the sectors read in buf
+ *  RETURN VALUE : 0 - success
+ *                 -1 - the drive or the bus master reported an error
+ *  SIDE EFFECTS : modify ata_prdt, wait for the interrupt of the channel
+ */
+static int32_t ata_dma(uint32_t lba, uint32_t count, uint8_t* buf, uint32_t read)
+{
+    uint32_t addr = ((uint32_t)buf >= PHYS_MAP_ADDR) ? VIRT_TO_PHYS(buf) : (uint32_t)buf;           // a kernel stack is in the physical map
+    uint32_t left = count * ATA_SECTOR_SIZE;
+    uint32_t chunk, i;
+    uint8_t direction = read ? BM_CMD_READ : 0;
+    int32_t ret;
+
+    for (i = 0; left > 0; i++) {
+        if (i == BM_PRD_ENTRIES) return -1;
+        chunk = 0x10000 - (addr & 0xFFFF);                                                          // up to the next 64KB boundary
+        if (chunk > left) chunk = left;
+        ata_prdt[i].addr = addr;
+        ata_prdt[i].count = (uint16_t)chunk;                                                        // 64KB is stored as 0
+        ata_prdt[i].flags = 0;
+        addr += chunk;
+        left -= chunk;
+    }
+    ata_prdt[i - 1].flags = BM_PRD_EOT;
+
+    outb(direction, ata_bm_base + BM_COMMAND);                                                      // stopped, direction set
+    outl((uint32_t)ata_prdt, ata_bm_base + BM_PRDT);
+    outb(inb(ata_bm_base + BM_STATUS) | BM_SR_IRQ | BM_SR_ERR, ata_bm_base + BM_STATUS);
+    ata_irq_done = 0;
+    if (ata_command(lba, count, read ? ATA_CMD_READ_DMA : ATA_CMD_WRITE_DMA) != 0) return -1;
+    outb(direction | BM_CMD_START, ata_bm_base + BM_COMMAND);
+    ret = ata_wait_irq();
+    outb(direction, ata_bm_base + BM_COMMAND);                                                      // stop the bus master
+    if ((ret != 0) || (ata_irq_bm_status & BM_SR_ERR) || (ata_irq_status & (ATA_SR_ERR | ATA_SR_DF))) return -1;
+    return 0;
+}
+
+/*
+ * ata_lock
+ *  DESCRIPTION : take the channel for one transfer. A process that finds it taken halts
+ *                until the holder, scheduled by the PIT, releases it.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the channel is taken
+ *                 -1 - it is busy and interrupts are disabled, waiting would never end
+ *  SIDE EFFECTS : set ata_busy
+ */
+static int32_t ata_lock(void)
+{
+    uint32_t flags;
+    cli_and_save(flags);
+    while (ata_busy) {
+        if (!(flags & EFLAGS_IF)) {
+            restore_flags(flags);
+            return -1;
+        }
+        asm volatile ("sti; hlt; cli" : : : "memory");
+    }
+    ata_busy = 1;
+    restore_flags(flags);
+    return 0;
+}
+
+/*
+ * ata_transfer
+ *  DESCRIPTION : split a transfer into commands of at most ATA_MAX_SECTORS sectors.
+ *                Short commands go through PIO, which costs less to set up; the rest
+ *                use DMA when the controller has a bus master. Writes end with a cache
+ *                flush so the data is on the disk when this returns.
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors
+ *           uint8_t* buf - the data
+ *           uint32_t read - 1 to read from the disk, 0 to write to it
+ *  OUTPUTS : the sectors read in buf
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no disk, out of range, or the drive failed
+ *  SIDE EFFECTS : take and release the channel
+ */
+static int32_t ata_transfer(uint32_t lba, uint32_t count, uint8_t* buf, uint32_t read)
+{
+    uint32_t n;
+    int32_t ret = 0;
+    if ((ata_disk_sectors == 0) || (count > ata_disk_sectors) || (lba > ata_disk_sectors - count)) return -1;
+    if (ata_lock() != 0) return -1;
+    while ((count > 0) && (ret == 0)) {
+        n = (count < ATA_MAX_SECTORS) ? count : ATA_MAX_SECTORS;
+        if ((ata_bm_base != 0) && (n >= ATA_DMA_MIN_SECTORS) && !((uint32_t)buf & 1)) {
+            ret = ata_dma(lba, n, buf, read);
+        } else {
+            ret = ata_pio(lba, n, buf, read);
+        }
+        lba += n;
+        count -= n;
+        buf += n * ATA_SECTOR_SIZE;
+    }
+    if ((ret == 0) && !read) {
+        if ((ata_command(0, 0, ATA_CMD_FLUSH) != 0) || (ata_wait(0) != 0)) ret = -1;
+    }
+    ata_busy = 0;
+    return ret;
+}
+
+/*
+ * pci_read_config
+ *  DESCRIPTION : read a word of the PCI configuration space through mechanism #1
+ *  INPUTS : uint32_t dev - device number on bus 0
+ *           uint32_t func - function number
+ *           uint32_t offset - register, a multiple of 4
+ *  OUTPUTS : none
+ *  RETURN VALUE : the register
+ *  SIDE EFFECTS : none
+ */
+static uint32_t pci_read_config(uint32_t dev, uint32_t func, uint32_t offset)
+{
+    outl(0x80000000 | (dev << 11) | (func << 8) | offset, PCI_CONFIG_ADDRESS);
+    return inl(PCI_CONFIG_DATA);
+}
+
+/*
+ * ata_find_bus_master
+ *  DESCRIPTION : look for an IDE controller with bus mastering on PCI bus 0, enable its
+ *                DMA and remember where its primary channel registers are. The drive
+ *                ports are the legacy 0x1F0 ones either way.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify ata_bm_base and the command register of the controller
+ */
+static void ata_find_bus_master(void)
+{
+    uint32_t dev, func, class, bar4, command;
+    for (dev = 0; dev < 32; dev++) {
+        for (func = 0; func < 8; func++) {
+            if ((pci_read_config(dev, func, 0) & 0xFFFF) == 0xFFFF) continue;                       // no such function
+            class = pci_read_config(dev, func, 0x08);
+            if (((class >> 16) != PCI_CLASS_IDE) || !(class & 0x8000)) continue;                    // prog-if bit 7: bus master capable
+            bar4 = pci_read_config(dev, func, 0x20);
+            if (!(bar4 & 0x1)) continue;                                                            // not an I/O space BAR
+            command = pci_read_config(dev, func, 0x04) & 0xFFFF;                                    // the status half is write 1 to clear, leave it
+            outl(0x80000000 | (dev << 11) | (func << 8) | 0x04, PCI_CONFIG_ADDRESS);
+            outl(command | PCI_COMMAND_IO | PCI_COMMAND_MASTER, PCI_CONFIG_DATA);
+            ata_bm_base = bar4 & 0xFFFC;
+            return;
+        }
+    }
+}
+
+/*
+ * ata_init
+ *  DESCRIPTION : identify the filesystem disk, find the bus master and enable the
+ *                interrupt of the primary channel
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the disk is ready
+ *                 -1 - there is no ATA disk in the slot
+ *  SIDE EFFECTS : modify ata_disk_sectors and ata_bm_base, enable IRQ 14
+ */
+int32_t ata_init(void)
+{
+    uint16_t identify[ATA_SECTOR_SIZE / 2];
+    uint16_t* buf = identify;
+    uint32_t words = ATA_SECTOR_SIZE / 2;
+    uint8_t status;
+
+    ata_disk_sectors = 0;
+    outb(0, ATA_CONTROL_PORT);                                                                      // the drives may raise interrupts
+    outb(0xA0 | (ATA_FS_DRIVE << 4), ATA_DRIVE_PORT);
+    ata_delay();
+    outb(0, ATA_COUNT_PORT);
+    outb(0, ATA_LBA_LO_PORT);
+    outb(0, ATA_LBA_MID_PORT);
+    outb(0, ATA_LBA_HI_PORT);
+    outb(ATA_CMD_IDENTIFY, ATA_STATUS_PORT);
+    status = inb(ATA_STATUS_PORT);
+    if ((status == 0) || (status == 0xFF)) return -1;                                               // nothing answers
+    if (ata_wait(0) != 0) return -1;
+    if (inb(ATA_LBA_MID_PORT) || inb(ATA_LBA_HI_PORT)) return -1;                                   // ATAPI or SATA signature
+    if (ata_wait(ATA_SR_DRQ) != 0) return -1;
+    asm volatile ("cld; rep insw" : "+D"(buf), "+c"(words) : "d"(ATA_DATA_PORT) : "memory");
+
+    ata_disk_sectors = identify[60] | ((uint32_t)identify[61] << 16);                               // LBA28 sectors
+    if (ata_disk_sectors == 0) return -1;
+    ata_find_bus_master();
+    enable_irq(ATA_IRQ);
+    return 0;
+}
+
+/*
+ * ata_sectors
+ *  DESCRIPTION : the size of the filesystem disk
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : number of sectors, 0 if ata_init found no disk
+ *  SIDE EFFECTS : none
+ */
+uint32_t ata_sectors(void)
+{
+    return ata_disk_sectors;
+}
+
+/*
+ * ata_read
+ *  DESCRIPTION : read sectors of the filesystem disk
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors
+ *           void* buf - kernel memory for count * ATA_SECTOR_SIZE bytes
+ *  OUTPUTS : the sectors in buf
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no disk, out of range, or the drive failed
+ *  SIDE EFFECTS : none
+ */
+int32_t ata_read(uint32_t lba, uint32_t count, void* buf)
+{
+    return ata_transfer(lba, count, (uint8_t*)buf, 1);
+}
+
+/*
+ * ata_write
+ *  DESCRIPTION : write sectors of the filesystem disk and flush the drive cache
+ *  INPUTS : uint32_t lba - first sector
+ *           uint32_t count - number of sectors
+ *           const void* buf - kernel memory holding count * ATA_SECTOR_SIZE bytes
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no disk, out of range, or the drive failed
+ *  SIDE EFFECTS : modify the disk
+ */
+int32_t ata_write(uint32_t lba, uint32_t count, const void* buf)
+{
+    return ata_transfer(lba, count, (uint8_t*)buf, 0);
+}
+
+/*
+ * ata_handler
+ *  DESCRIPTION : When an interrupt of the primary channel occurs, acknowledge it at the
+ *                bus master and the drive, and wake ata_wait_irq if a DMA command ended
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify ata_irq_done, ata_irq_status and ata_irq_bm_status
+ */
+void ata_handler(void)
+{
+    uint8_t bm_status = 0;
+    if (ata_bm_base != 0) {
+        bm_status = inb(ata_bm_base + BM_STATUS);
+        outb(bm_status | BM_SR_IRQ | BM_SR_ERR, ata_bm_base + BM_STATUS);
+    }
+    ata_irq_status = inb(ATA_STATUS_PORT);                                                          // lets the drive drop its interrupt line
+    if (bm_status & BM_SR_IRQ) {                                                                    // late interrupts of PIO commands find it clear
+        ata_irq_bm_status = bm_status;
+        ata_irq_done = 1;
+    }
+    send_eoi(ATA_IRQ);
+}
@@ -0,0 +1,79 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include "types.h"
+
+/* primary channel of the IDE controller */
+#define ATA_IRQ              14
+#define ATA_DATA_PORT        0x1F0
+#define ATA_ERROR_PORT       0x1F1
+#define ATA_COUNT_PORT       0x1F2
+#define ATA_LBA_LO_PORT      0x1F3
+#define ATA_LBA_MID_PORT     0x1F4
+#define ATA_LBA_HI_PORT      0x1F5
+#define ATA_DRIVE_PORT       0x1F6
+#define ATA_STATUS_PORT      0x1F7                   // also the command register
+#define ATA_CONTROL_PORT     0x3F6                   // also the alternate status register
+
+#define ATA_SR_BSY           0x80
+#define ATA_SR_DRDY          0x40
+#define ATA_SR_DF            0x20
+#define ATA_SR_DRQ           0x08
+#define ATA_SR_ERR           0x01
+
+#define ATA_CMD_READ_PIO     0x20
+#define ATA_CMD_WRITE_PIO    0x30
+#define ATA_CMD_READ_DMA     0xC8
+#define ATA_CMD_WRITE_DMA    0xCA
+#define ATA_CMD_FLUSH        0xE7
+#define ATA_CMD_IDENTIFY     0xEC
+
+#define ATA_MASTER           0
+#define ATA_SLAVE            1
+#define ATA_FS_DRIVE         ATA_SLAVE               // the master (hda) holds the boot image with GRUB
+#define ATA_SECTOR_SIZE      512
+#define ATA_MAX_SECTORS      256                     // most sectors one LBA28 command moves
+#define ATA_DMA_MIN_SECTORS  8                       // smaller transfers use PIO, a 4KB block and up use DMA
+#define ATA_TIMEOUT          1000000                 // status polls before a command is given up
+#define EFLAGS_IF            0x200                   // interrupts were enabled when the flags were saved
+
+/* bus master IDE registers, offsets from BAR4 of the controller */
+#define BM_COMMAND           0
+#define BM_STATUS            2
+#define BM_PRDT              4
+#define BM_CMD_START         0x01
+#define BM_CMD_READ          0x08                    // the device writes to memory
+#define BM_SR_ACTIVE         0x01
+#define BM_SR_ERR            0x02
+#define BM_SR_IRQ            0x04
+#define BM_PRD_ENTRIES       8                       // a 128KB command needs 2 (3 when unaligned)
+#define BM_PRD_EOT           0x8000                  // flags of the last descriptor
+
+/* PCI configuration space */
+#define PCI_CONFIG_ADDRESS   0xCF8
+#define PCI_CONFIG_DATA      0xCFC
+#define PCI_CLASS_IDE        0x0101                  // mass storage, IDE
+#define PCI_COMMAND_IO       0x1
+#define PCI_COMMAND_MASTER   0x4
+
+/* one physical region descriptor of a bus master transfer */
+typedef struct prd
+{
+    uint32_t addr;                                      // physical address, may not cross a 64KB boundary
+    uint16_t count;                                     // bytes, 0 means 64KB
+    uint16_t flags;
+
+} prd_t;
+
+/* detect the filesystem disk and the bus master of its controller */
+extern int32_t ata_init(void);
+/* sectors of the filesystem disk, 0 if there is none */
+extern uint32_t ata_sectors(void);
+/* read count sectors starting at lba into buf, a kernel address, identity mapped or in the physical map */
+extern int32_t ata_read(uint32_t lba, uint32_t count, void* buf);
+/* write count sectors from buf, a kernel address, identity mapped or in the physical map, starting at lba */
+extern int32_t ata_write(uint32_t lba, uint32_t count, const void* buf);
+/* handle the interrupt of the primary channel */
+extern void ata_handler(void);
+
+#endif
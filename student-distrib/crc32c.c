@@ -0,0 +1,64 @@
+#include "crc32c.h"
+
+static uint32_t crc32c_table[CRC32C_SLICES][256];                                                   // table[k][b]: b followed by k zero bytes
+static uint32_t crc32c_ready;
+
+/*
+ * crc32c_init
+ *  DESCRIPTION : build the slicing-by-8 tables. Table 0 is the classic bytewise table,
+ *                table k advances the crc of table k-1 over one more zero byte.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : fill crc32c_table once
+ */
+void crc32c_init(void)
+{
+    uint32_t b, k, bit, crc;
+    if (crc32c_ready) return;
+    for (b = 0; b < 256; b++) {
+        crc = b;
+        for (bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        crc32c_table[0][b] = crc;
+    }
+    for (b = 0; b < 256; b++) {
+        crc = crc32c_table[0][b];
+        for (k = 1; k < CRC32C_SLICES; k++) {
+            crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+            crc32c_table[k][b] = crc;
+        }
+    }
+    crc32c_ready = 1;
+}
+
+/*
+ * crc32c
+ *  DESCRIPTION : CRC32C (iSCSI, ext4) of a buffer, eight bytes per step through the
+ *                slicing tables and the remaining bytes one at a time
+ *  INPUTS : uint32_t crc - the crc of the data before buf, 0 to start
+ *           const uint8_t* buf - the data
+ *           uint32_t len - number of bytes
+ *  OUTPUTS : none
+ *  RETURN VALUE : the crc of the data up to the end of buf
+ *  SIDE EFFECTS : none
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+    uint32_t lo, hi;
+    crc = ~crc;
+    while (len >= CRC32C_SLICES) {
+        lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));      // little endian words
+        hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+            ^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF]
+            ^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        buf += CRC32C_SLICES;
+        len -= CRC32C_SLICES;
+    }
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include "types.h"
+
+#define CRC32C_POLY          0x82F63B78              // Castagnoli polynomial, bit reversed
+#define CRC32C_SLICES        8                       // bytes consumed per step of the table-driven loop
+
+/* fill the lookup tables, must run once before crc32c */
+extern void crc32c_init(void);
+/* continue the CRC32C crc over len bytes of buf, start with crc = 0 */
+extern uint32_t crc32c(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+#endif
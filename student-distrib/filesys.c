@@ -1,9 +1,2174 @@
 #include "filesys.h"
 #include "lib.h"
+#include "lz4.h"
+#include "crc32c.h"
+#include "ata.h"
 #include "system_call.h"
 #include "x86_desc.h"
 
-int inode_array[64];
+static uint32_t inode_bitmap[FS_MAX_INODES / 32];                                                   // 1 bit per inode, 1 means busy
+static uint32_t block_bitmap[FS_MAX_DATA_BLOCKS / 32];                                              // 1 bit per data block, 1 means busy
+static uint16_t block_refcount[FS_MAX_DATA_BLOCKS];                                                // inodes and indirect blocks pointing at each data block
+static uint32_t block_alloc_cursor;                                                                 // next-fit start point of the block allocator
+static uint32_t block_verified[FS_MAX_DATA_BLOCKS / 32];                                            // 1 bit per data block, 1 means its checksum matched or the kernel wrote it
+static uint32_t block_bad[FS_MAX_DATA_BLOCKS / 32];                                                 // 1 bit per data block, 1 means its checksum failed
+static uint32_t* block_csum;                                                                        // CRC32C of each data block, brought up to date by fs_sync
+static uint32_t image_dirty[(FS_MAX_IMAGE_BLOCKS + 31) / 32];                                       // 1 bit per 4KB block of the image, 1 means the disk copy is stale
+static volatile uint32_t image_dirty_count;                                                         // blocks set in image_dirty
+static uint32_t disk_attached;                                                                      // 1 when the image is backed by the ATA disk
+static uint32_t block_present[FS_MAX_DATA_BLOCKS / 32];                                             // 1 bit per data block, 1 means its contents are in memory
+static uint32_t readahead_next;                                                                     // the block a sequential reader fetches next
+static uint32_t readahead_window;                                                                   // blocks fetched by the last read from the disk
+static volatile uint32_t fs_syncing;                                                                // fs_sync is writing to the disk
+static uint32_t fs_flush_ticks;                                                                     // PIT ticks since the last write-back
+static volatile uint32_t fs_flush_due;                                                              // set by the PIT, fs_flush writes back when it finds it
+static uint32_t image_meta[(FS_MAX_IMAGE_BLOCKS + 31) / 32];                                        // 1 bit per 4KB block of the image, 1 means it goes to the disk through the journal
+static volatile uint32_t image_meta_count;                                                          // blocks set in image_meta, the size of the next transaction
+static uint32_t block_freed[FS_MAX_DATA_BLOCKS / 32];                                               // 1 bit per data block, freed since the last commit
+static uint32_t block_committing[FS_MAX_DATA_BLOCKS / 32];                                          // the bits of block_freed fs_sync is committing
+static uint8_t journal_buf[FS_JOURNAL_BLOCKS * BLOCK_SIZE];                                         // a transaction: the descriptor, then the logged blocks
+static uint32_t journal_start;                                                                      // disk block of the journal, 0 if the disk has no room for one
+static uint32_t journal_sequence;                                                                   // number of the last committed transaction
+static volatile uint32_t fs_op_depth;                                                               // operations changing the image that have not finished
+static volatile uint32_t fs_op_gen;                                                                 // operations started, a commit that sees it change backs off
+
+/* last indirect block resolved by inode_get_block, so sequential reads skip the walk */
+static struct {
+    inode_t*  node;                                                                                 // inode the cached table belongs to, NULL if none
+    uint32_t  first;                                                                                // file block index of table[0] minus INODE_DIRECT_BLOCKS
+    uint32_t* table;                                                                                // the indirect block holding the block numbers
+} block_map_cache;
+
+/* LRU cache of decompressed blocks of compressed files */
+static struct {
+    uint32_t valid;                                                                                 // 0 means the slot is unused
+    uint32_t inode;                                                                                 // the file and block index the data belongs to
+    uint32_t block_idx;
+    uint32_t last_use;                                                                              // zcache_clock at the last hit, smallest is evicted
+    uint8_t  data[BLOCK_SIZE];
+} zcache[ZCACHE_SLOTS];
+static uint32_t zcache_clock;
+static uint8_t zcache_stage[BLOCK_SIZE];                                                            // a compressed block gathered from scattered data blocks
+
+static dcache_entry_t dcache[DCACHE_SIZE];                                                          // (parent inode, name) -> dentry, including misses
+static ecache_entry_t ecache[ECACHE_SIZE];                                                          // inode -> what execute needs, including files that are not executable
+static uint32_t dir_free_head[FS_MAX_INODES];                                                       // 1 + index of the first removed dentry of each directory, 0 if none
+
+static void mark_dentry (dentry_t* dentry, uint32_t depth);
+static int32_t inode_write (uint32_t inode, uint32_t offset, const uint8_t* buf, uint32_t length, uint32_t meta);
+static void ecache_invalidate (uint32_t inode);
+
+static uint8_t dentry_hash_table[DENTRY_HASH_SIZE];                                                 // open-addressed name index, holds dentry indices
+static uint8_t dentry_name_len[MAX_FILES_NUMBER];                                                   // precomputed filename length of each dentry
+
+/**
+ * fs_name_len
+ *  DESCRIPTION : compute the length of a filename without reading past
+ *                MAX_FILENAME_LEN + 1 bytes (dentry names are not always NUL terminated)
+ *  INPUTS : const uint8_t* name - the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : the length of the name, MAX_FILENAME_LEN + 1 if it is too long
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint32_t fs_name_len (const uint8_t* name)
+{
+    uint32_t len = 0;
+    while ((len <= MAX_FILENAME_LEN) && (name[len] != '\0')) len++;
+    return len;
+}
+
+/**
+ * fs_name_hash
+ *  DESCRIPTION : FNV-1a hash of a filename
+ *  INPUTS : const uint8_t* name - the filename
+ *           uint32_t len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : the 32-bit hash value
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint32_t fs_name_hash (const uint8_t* name, uint32_t len)
+{
+    uint32_t hash = 2166136261U;                                                                    // FNV offset basis
+    uint32_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= name[i];
+        hash *= 16777619U;                                                                          // FNV prime
+    }
+    return hash;
+}
+
+/**
+ * dentry_index_insert
+ *  DESCRIPTION : add the dentry at the given index to the name index
+ *  INPUTS : uint32_t index - the index of the dentry in the boot block
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dentry_hash_table and dentry_name_len
+ *
+ */
+void dentry_index_insert (uint32_t index)
+{
+    if (index >= MAX_FILES_NUMBER) return;
+    uint32_t len = fs_name_len(dentry_ptr[index].file_name);
+    if (len > MAX_FILENAME_LEN) len = MAX_FILENAME_LEN;
+    dentry_name_len[index] = len;
+    if (len == 0) return;                                                                           // unused dentry, nothing to index
+
+    uint32_t slot = fs_name_hash(dentry_ptr[index].file_name, len) & (DENTRY_HASH_SIZE - 1);
+    while ((dentry_hash_table[slot] != DENTRY_HASH_EMPTY) && (dentry_hash_table[slot] != DENTRY_HASH_DELETED)) {
+        slot = (slot + 1) & (DENTRY_HASH_SIZE - 1);                                                 // linear probing, the table is never full
+    }
+    dentry_hash_table[slot] = index;
+}
+
+/**
+ * dentry_index_remove
+ *  DESCRIPTION : drop the dentry at the given index from the name index. Its slot is
+ *                marked deleted rather than emptied so the probe chains through it stay intact.
+ *  INPUTS : uint32_t index - the index of the dentry in the boot block
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dentry_hash_table and dentry_name_len
+ *
+ */
+void dentry_index_remove (uint32_t index)
+{
+    uint32_t probes;
+    if ((index >= MAX_FILES_NUMBER) || (dentry_name_len[index] == 0)) return;                       // not indexed
+    uint32_t slot = fs_name_hash(dentry_ptr[index].file_name, dentry_name_len[index]) & (DENTRY_HASH_SIZE - 1);
+    for (probes = 0; (probes < DENTRY_HASH_SIZE) && (dentry_hash_table[slot] != DENTRY_HASH_EMPTY); probes++) {
+        if (dentry_hash_table[slot] == index) {
+            dentry_hash_table[slot] = DENTRY_HASH_DELETED;
+            break;
+        }
+        slot = (slot + 1) & (DENTRY_HASH_SIZE - 1);
+    }
+    dentry_name_len[index] = 0;
+}
+
+/**
+ * dentry_index_build
+ *  DESCRIPTION : rebuild the name index from all dentries in the boot block
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dentry_hash_table and dentry_name_len
+ *
+ */
+void dentry_index_build (void)
+{
+    uint32_t i;
+    memset(dentry_hash_table, DENTRY_HASH_EMPTY, sizeof(dentry_hash_table));
+    for (i = 0; (i < boot_block_ptr->num_dir_entries) && (i < MAX_FILES_NUMBER); i++) {
+        dentry_index_insert(i);
+    }
+}
+
+/**
+ * dentry_index_find
+ *  DESCRIPTION : find the dentry whose filename is the first len bytes of name
+ *  INPUTS : const uint8_t* name - the filename, need not be NUL terminated
+ *           uint32_t name_len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : the index of the dentry in the boot block
+ *                 -1 - cannot find the corresponding file
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t dentry_index_find (const uint8_t* name, uint32_t name_len)
+{
+    if ((name_len == 0) || (name_len > MAX_FILENAME_LEN)) return -1;                                // If the filename length is out of range, return -1
+
+    uint32_t slot = fs_name_hash(name, name_len) & (DENTRY_HASH_SIZE - 1);
+    uint32_t probes;
+    for (probes = 0; (probes < DENTRY_HASH_SIZE) && (dentry_hash_table[slot] != DENTRY_HASH_EMPTY); probes++) {
+        uint32_t index = dentry_hash_table[slot];
+        if ((index != DENTRY_HASH_DELETED) && (dentry_name_len[index] == name_len) && (!strncmp((int8_t*)name, (int8_t*)dentry_ptr[index].file_name, name_len))) {
+            return index;
+        }
+        slot = (slot + 1) & (DENTRY_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+/**
+ * dentry_index_lookup
+ *  DESCRIPTION : find the dentry with the given filename through the name index
+ *  INPUTS : const uint8_t* fname - the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : the index of the dentry in the boot block
+ *                 -1 - cannot find the corresponding file
+ *  SIDE EFFECTS : none
+ *
+ */
+int32_t dentry_index_lookup (const uint8_t* fname)
+{
+    if (fname == NULL) return -1;
+    return dentry_index_find(fname, fs_name_len(fname));
+}
+
+/**
+ * alloc_inode
+ *  DESCRIPTION : find a free inode in the inode bitmap and mark it busy
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : the inode number
+ *                 -1 - every inode is in use
+ *  SIDE EFFECTS : modify inode_bitmap
+ *
+ */
+int32_t alloc_inode (void)
+{
+    uint32_t i, bit;
+    uint32_t num_inodes = boot_block_ptr->num_inodes;
+    if (num_inodes > FS_MAX_INODES) num_inodes = FS_MAX_INODES;
+    for (i = 0; i < num_inodes; i += 32) {
+        if (inode_bitmap[i / 32] == 0xFFFFFFFF) continue;                                           // skip 32 busy inodes at once
+        for (bit = i; (bit < i + 32) && (bit < num_inodes); bit++) {
+            if (!(inode_bitmap[bit / 32] & (1 << (bit % 32)))) {
+                inode_bitmap[bit / 32] |= (1 << (bit % 32));
+                return bit;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * free_inode
+ *  DESCRIPTION : mark an inode free in the inode bitmap and drop its cached blocks
+ *  INPUTS : uint32_t inode - the inode number
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify inode_bitmap, zcache and ecache
+ *
+ */
+void free_inode (uint32_t inode)
+{
+    if ((inode == 0) || (inode >= FS_MAX_INODES)) return;                                           // inode 0 is reserved for "." and rtc
+    inode_bitmap[inode / 32] &= ~(1 << (inode % 32));
+    zcache_invalidate(inode);
+    ecache_invalidate(inode);
+}
+
+/**
+ * block_is_free
+ *  DESCRIPTION : check the free-block bitmap
+ *  INPUTS : uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - the block exists and is free
+ *                 0 - otherwise
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t block_is_free (uint32_t block)
+{
+    if ((block >= boot_block_ptr->num_data_blocks) || (block >= FS_MAX_DATA_BLOCKS)) return 0;
+    return !(block_bitmap[block / 32] & (1 << (block % 32)));
+}
+
+/**
+ * block_freed_pending
+ *  DESCRIPTION : tell whether a data block was freed after the last commit. The metadata
+ *                on the disk may still point at it, so it cannot be rewritten in place.
+ *  INPUTS : uint32_t block - the data block number, below FS_MAX_DATA_BLOCKS
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - freed since the last commit, or by the commit running
+ *                 0 - otherwise
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t block_freed_pending (uint32_t block)
+{
+    return ((block_freed[block / 32] | block_committing[block / 32]) & (1 << (block % 32))) != 0;
+}
+
+/**
+ * block_fetch
+ *  DESCRIPTION : read a data block missing from memory off the disk. Its slot in the
+ *                image is its cache slot, nothing is ever evicted. A reader that asks for
+ *                the block right after the last fetch is sequential, and its window of
+ *                blocks read ahead in the same transfer doubles up to FS_READAHEAD_MAX;
+ *                any other block starts the window over at one. The run stops at the
+ *                first block already in memory.
+ *  INPUTS : uint32_t block - the data block number, below num_data_blocks
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the block is in memory
+ *                 -1 - the disk failed
+ *  SIDE EFFECTS : modify block_present and the readahead state, read from the disk
+ *
+ */
+static int32_t block_fetch (uint32_t block)
+{
+    uint32_t num_blocks = boot_block_ptr->num_data_blocks;
+    uint32_t n, i;
+    if (block >= num_blocks) return -1;                                                             // its slot would lie past the image
+    if (block == readahead_next) {
+        readahead_window = (2 * readahead_window < FS_READAHEAD_MAX) ? 2 * readahead_window : FS_READAHEAD_MAX;
+    } else {
+        readahead_window = 1;
+    }
+    for (n = 1; (n < readahead_window) && (block + n < num_blocks) && !(block_present[(block + n) / 32] & (1 << ((block + n) % 32))); n++);
+    if (ata_read((1 + boot_block_ptr->num_inodes + block) * FS_SECTORS_PER_BLOCK, n * FS_SECTORS_PER_BLOCK, data_block_ptr + BLOCK_SIZE*block) != 0) {
+        printf("filesys: reading data block %d failed\n", block);
+        return -1;
+    }
+    for (i = block; i < block + n; i++) block_present[i / 32] |= (1 << (i % 32));
+    readahead_next = block + n;
+    return 0;
+}
+
+/**
+ * block_check
+ *  DESCRIPTION : get a data block ready for use: read it from the disk if it is not in
+ *                memory yet, and verify it against its CRC32C the first time it is used.
+ *                A block that passes, or that the kernel has written itself, is
+ *                remembered in block_verified, so later uses cost one bit test.
+ *  INPUTS : uint32_t block - the data block number, below num_data_blocks
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the block can be trusted
+ *                 -1 - the block does not match its checksum or cannot be read
+ *  SIDE EFFECTS : modify block_verified and block_bad, report a bad block once
+ *
+ */
+static int32_t block_check (uint32_t block)
+{
+    if (block >= FS_MAX_DATA_BLOCKS) return -1;
+    if (block_verified[block / 32] & (1 << (block % 32))) return 0;                                 // fast path, the block is also in memory
+    if (block_bad[block / 32] & (1 << (block % 32))) return -1;
+    if (!(block_present[block / 32] & (1 << (block % 32))) && (block_fetch(block) != 0)) return -1;
+    if ((block_csum != NULL) && (crc32c(0, data_block_ptr + BLOCK_SIZE*block, BLOCK_SIZE) != block_csum[block])) {
+        block_bad[block / 32] |= (1 << (block % 32));
+        printf("filesys: data block %d is corrupt\n", block);
+        return -1;
+    }
+    block_verified[block / 32] |= (1 << (block % 32));
+    return 0;
+}
+
+/**
+ * block_csum_init
+ *  DESCRIPTION : find the checksum table of the image. Nothing is verified here, blocks are
+ *                checked by block_check when they are first used. The table blocks are
+ *                kept busy for good. Without a table every block is trusted as before.
+ *                A block the kernel writes is trusted from then on; its entry is brought
+ *                up to date by fs_sync before the block reaches the disk, and is left
+ *                stale when there is no disk.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify block_csum, block_verified, block_bad, block_bitmap and block_refcount,
+ *                 read the table from the disk
+ *
+ */
+static void block_csum_init (void)
+{
+    uint32_t num_blocks = boot_block_ptr->num_data_blocks;
+    uint32_t csum_blocks = (num_blocks + BLOCK_PTRS - 1) / BLOCK_PTRS;
+    uint32_t i;
+    memset(block_bad, 0, sizeof(block_bad));
+    block_csum = NULL;
+    if ((boot_block_ptr->csum_magic == FS_CSUM_MAGIC) && (num_blocks <= FS_MAX_DATA_BLOCKS) &&
+        (boot_block_ptr->csum_block < num_blocks) && (csum_blocks <= num_blocks - boot_block_ptr->csum_block)) {
+        block_csum = (uint32_t*)(data_block_ptr + BLOCK_SIZE*boot_block_ptr->csum_block);
+    } else if (boot_block_ptr->csum_magic == FS_CSUM_MAGIC) {
+        printf("filesys: bad checksum table, blocks are not verified\n");
+    }
+    for (i = boot_block_ptr->csum_block; (block_csum != NULL) && (i < boot_block_ptr->csum_block + csum_blocks); i++) {
+        if (!(block_present[i / 32] & (1 << (i % 32))) && (block_fetch(i) != 0)) block_csum = NULL;   // unreadable, blocks are not verified
+    }
+    if (block_csum == NULL) {
+        memcpy(block_verified, block_present, sizeof(block_verified));                              // nothing to check against
+        return;
+    }
+    crc32c_init();
+    memset(block_verified, 0, sizeof(block_verified));
+    for (i = boot_block_ptr->csum_block; i < boot_block_ptr->csum_block + csum_blocks; i++) {
+        block_verified[i / 32] |= (1 << (i % 32));                                                  // the table does not cover itself
+        block_bitmap[i / 32] |= (1 << (i % 32));
+        block_refcount[i] = REFCOUNT_STICKY;
+    }
+}
+
+/**
+ * fs_dirty_range
+ *  DESCRIPTION : remember that a range of the image changed so fs_sync writes the blocks
+ *                holding it to the disk. Every store into the image goes through here.
+ *                Metadata (the boot block, inodes, indirect blocks, directories and the
+ *                checksum table) goes through the journal, file contents are written in
+ *                place. A block freed since the last commit may still be in use on the
+ *                disk, so its new contents go through the journal too.
+ *  INPUTS : const void* addr - start of the range, inside the image
+ *           uint32_t len - number of bytes
+ *           uint32_t meta - 1 if the range holds metadata, 0 for file contents
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify image_dirty, image_meta, image_meta_count and image_dirty_count
+ *
+ */
+static void fs_dirty_range (const void* addr, uint32_t len, uint32_t meta)
+{
+    uint32_t data_start = 1 + boot_block_ptr->num_inodes;
+    uint32_t num_blocks = data_start + boot_block_ptr->num_data_blocks;
+    uint32_t first, last, i, block, bit;
+    if (!disk_attached || (len == 0)) return;                                                       // nothing to keep in step
+    first = ((const uint8_t*)addr - (const uint8_t*)boot_block_ptr) / BLOCK_SIZE;
+    last = ((const uint8_t*)addr + len - 1 - (const uint8_t*)boot_block_ptr) / BLOCK_SIZE;
+    for (i = first; (i <= last) && (i < num_blocks) && (i < FS_MAX_IMAGE_BLOCKS); i++) {
+        bit = 1 << (i % 32);
+        block = i - data_start;
+        if ((i >= data_start) && block_freed_pending(block)) meta = 1;
+        if (meta && !(image_meta[i / 32] & bit)) {                                                  // before the dirty bit, the flusher reads them in that order
+            if (!(__sync_fetch_and_or(&image_meta[i / 32], bit) & bit)) __sync_fetch_and_add(&image_meta_count, 1);
+        }
+        if (image_dirty[i / 32] & bit) continue;
+        if (!(__sync_fetch_and_or(&image_dirty[i / 32], bit) & bit)) {                              // atomic, the flusher clears bits from the PIT interrupt
+            __sync_fetch_and_add(&image_dirty_count, 1);
+        }
+    }
+}
+
+/**
+ * fs_dirty
+ *  DESCRIPTION : remember that a range of metadata changed, see fs_dirty_range
+ *  INPUTS : const void* addr - start of the range, inside the image
+ *           uint32_t len - number of bytes
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify image_dirty, image_meta and image_dirty_count
+ *
+ */
+static void fs_dirty (const void* addr, uint32_t len)
+{
+    fs_dirty_range(addr, len, 1);
+}
+
+/**
+ * fs_op_begin, fs_op_end
+ *  DESCRIPTION : bracket an operation that changes the image. The flusher does not commit
+ *                while one is running, so a transaction never holds half of an operation.
+ *                When the metadata waiting for the next commit leaves less room in one
+ *                transaction than an operation and the checksum table may need, it is
+ *                committed before the operation starts instead of waiting for the flusher.
+ *                An operation never waits for a sync another process is running: the
+ *                commit notices through fs_op_gen that one started while it copied the
+ *                metadata and leaves it for the next sync, so callers may run with
+ *                interrupts off.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify fs_op_depth and fs_op_gen, may write to the disk
+ *
+ */
+static void fs_op_begin (void)
+{
+    uint32_t csum_blocks = (block_csum != NULL) ? (boot_block_ptr->num_data_blocks + BLOCK_PTRS - 1) / BLOCK_PTRS : 0;
+    if ((fs_op_depth == 0) && (journal_start != 0) &&
+        (image_meta_count + csum_blocks + FS_OP_META_MAX > FS_JOURNAL_BLOCKS - 1)) {
+        fs_sync();                                                                                  // a failed sync keeps its blocks for the next try
+    }
+    __sync_fetch_and_add(&fs_op_depth, 1);
+    __sync_fetch_and_add(&fs_op_gen, 1);                                                            // after the depth, journal_commit reads them the other way round
+}
+
+static void fs_op_end (void)
+{
+    __sync_fetch_and_sub(&fs_op_depth, 1);
+}
+
+/**
+ * alloc_data_block
+ *  DESCRIPTION : allocate a data block. The hint (normally the block after the previous
+ *                block of the file) is taken when it is free so files grow contiguously.
+ *                Otherwise the first run of at least want free blocks after the cursor is
+ *                used, and any free block as a last resort. Blocks freed since the last
+ *                commit come after all others, their new contents would have to go
+ *                through the journal.
+ *  INPUTS : uint32_t hint - preferred block number
+ *           uint32_t want - number of blocks the caller still needs
+ *  OUTPUTS : none
+ *  RETURN VALUE : the data block number
+ *                 -1 - no free data block left
+ *  SIDE EFFECTS : modify block_bitmap, block_refcount, block_alloc_cursor, block_verified and block_present
+ *
+ */
+int32_t alloc_data_block (uint32_t hint, uint32_t want)
+{
+    uint32_t num_blocks = boot_block_ptr->num_data_blocks;
+    uint32_t i, run, start, fallback, reuse;
+    if (num_blocks > FS_MAX_DATA_BLOCKS) num_blocks = FS_MAX_DATA_BLOCKS;
+    if (num_blocks == 0) return -1;
+    if (want == 0) want = 1;
+
+    if (block_is_free(hint) && !block_freed_pending(hint)) {
+        start = hint;
+    } else {
+        run = 0;
+        start = num_blocks;
+        fallback = num_blocks;
+        reuse = num_blocks;
+        for (i = 0; i < num_blocks; i++) {
+            uint32_t block = (block_alloc_cursor + i) % num_blocks;
+            if (block == 0) run = 0;                                                                // runs cannot wrap around the end
+            if ((block % 32 == 0) && (block_bitmap[block / 32] == 0xFFFFFFFF) && (block + 32 <= num_blocks)) {
+                run = 0;                                                                            // skip 32 busy blocks at once
+                i += 31;
+                continue;
+            }
+            if (!block_is_free(block)) {
+                run = 0;
+                continue;
+            }
+            if (block_freed_pending(block)) {
+                if (reuse == num_blocks) reuse = block;
+                run = 0;
+                continue;
+            }
+            if (fallback == num_blocks) fallback = block;
+            if (++run >= want) {
+                start = block + 1 - run;
+                break;
+            }
+        }
+        if (start == num_blocks) start = fallback;                                                  // no long enough run, take any free block
+        if (start == num_blocks) start = reuse;
+        if (start == num_blocks) return -1;
+    }
+    block_bitmap[start / 32] |= (1 << (start % 32));
+    block_verified[start / 32] |= (1 << (start % 32));                                              // the kernel fills it, its old checksum is stale
+    block_present[start / 32] |= (1 << (start % 32));                                               // and its old contents on the disk are never read
+    block_refcount[start] = 1;
+    block_alloc_cursor = start + 1;
+    return start;
+}
+
+/**
+ * block_get
+ *  DESCRIPTION : take one more reference to a data block. A count that reaches
+ *                REFCOUNT_STICKY stays there and the block is never freed.
+ *  INPUTS : uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify block_refcount
+ *
+ */
+static void block_get (uint32_t block)
+{
+    if (block >= FS_MAX_DATA_BLOCKS) return;
+    if (block_refcount[block] != REFCOUNT_STICKY) block_refcount[block]++;
+}
+
+/**
+ * free_data_block
+ *  DESCRIPTION : drop one reference to a data block, the block is free once the last
+ *                file or indirect block pointing at it lets go
+ *  INPUTS : uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify block_refcount, block_bitmap and block_freed
+ *
+ */
+void free_data_block (uint32_t block)
+{
+    if (block >= FS_MAX_DATA_BLOCKS) return;
+    if (block_refcount[block] == REFCOUNT_STICKY) return;
+    if (block_refcount[block] > 1) {
+        block_refcount[block]--;                                                                    // another file still uses it
+        return;
+    }
+    block_refcount[block] = 0;
+    block_bitmap[block / 32] &= ~(1 << (block % 32));
+    if (journal_start != 0) __sync_fetch_and_or(&block_freed[block / 32], 1 << (block % 32));     // the disk may still point at it until the next commit
+}
+
+/**
+ * block_table
+ *  DESCRIPTION : get the block numbers stored in an indirect block
+ *  INPUTS : uint32_t block - the data block number of the indirect block
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the BLOCK_PTRS block numbers
+ *                 NULL - bad block number or the block is corrupt
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint32_t* block_table (uint32_t block)
+{
+    if (block >= boot_block_ptr->num_data_blocks) return NULL;
+    if (block_check(block) != 0) return NULL;
+    return (uint32_t*)(data_block_ptr + BLOCK_SIZE*block);
+}
+
+/**
+ * inode_inline_data
+ *  DESCRIPTION : get the payload of an inline inode, stored right after its length field
+ *  INPUTS : inode_t* node - the inode of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the INODE_INLINE_MAX bytes of inline data
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint8_t* inode_inline_data (inode_t* node)
+{
+    return (uint8_t*)node->data_blocks;
+}
+
+/**
+ * inode_block_slot
+ *  DESCRIPTION : find where the data block number of block idx of a file is stored,
+ *                in the inode itself or in the single or double indirect block.
+ *                The last indirect block walked is cached for the next call.
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t idx - block index within the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the block number
+ *                 NULL - idx is out of range or an indirect block is bad
+ *  SIDE EFFECTS : update block_map_cache
+ *
+ */
+static uint32_t* inode_block_slot (inode_t* node, uint32_t idx)
+{
+    uint32_t* table;
+    uint32_t first;
+    if (idx < INODE_DIRECT_BLOCKS) return &node->data_blocks[idx];
+    idx -= INODE_DIRECT_BLOCKS;
+
+    if ((block_map_cache.node == node) && (idx >= block_map_cache.first) && (idx - block_map_cache.first < BLOCK_PTRS)) {
+        return &block_map_cache.table[idx - block_map_cache.first];                                 // hit: same indirect block as last time
+    }
+
+    if (idx < BLOCK_PTRS) {
+        table = block_table(node->indirect_block);                                                  // single indirect
+        first = 0;
+    } else {
+        uint32_t outer = (idx - BLOCK_PTRS) / BLOCK_PTRS;
+        if (outer >= BLOCK_PTRS) return NULL;                                                       // past the largest possible file
+        uint32_t* outer_table = block_table(node->double_indirect_block);                           // double indirect
+        if (outer_table == NULL) return NULL;
+        table = block_table(outer_table[outer]);
+        first = BLOCK_PTRS + outer * BLOCK_PTRS;
+    }
+    if (table == NULL) return NULL;
+
+    block_map_cache.node = node;
+    block_map_cache.first = first;
+    block_map_cache.table = table;
+    return &table[idx - first];
+}
+
+/**
+ * inode_get_block
+ *  DESCRIPTION : map a block index within a file to its data block number
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t idx - block index within the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the data block number
+ *                 -1 - idx is out of range or an indirect block is bad
+ *  SIDE EFFECTS : update block_map_cache
+ *
+ */
+static int32_t inode_get_block (inode_t* node, uint32_t idx)
+{
+    uint32_t* slot = inode_block_slot(node, idx);
+    return (slot == NULL) ? -1 : (int32_t)*slot;
+}
+
+/**
+ * inode_read_raw
+ *  DESCRIPTION : copy bytes out of the data blocks of a file through its block map,
+ *                extending each copy over physically adjacent blocks so contiguous
+ *                files take one memcpy. The caller checks the range against the file.
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t offset - the offset in the stored data
+ *           uint8_t* buf - the buffer to copy to
+ *           uint32_t length - the number of bytes to copy
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes copied
+ *                 -1 - past the block map, bad data block number or corrupt block
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t inode_read_raw (inode_t* node, uint32_t offset, uint8_t* buf, uint32_t length)
+{
+    uint32_t block_idx = offset / BLOCK_SIZE;                                                // each data block takes 4kB
+    uint32_t block_offset = offset % BLOCK_SIZE;                                             // offset in given data block
+    uint32_t bytes_copied = 0;                                                               // holding total bytes being copied
+
+    while (length > 0) {
+        int32_t D = inode_get_block(node, block_idx);                                        // index within data block array
+        if ((D == -1) || (D >= boot_block_ptr->num_data_blocks)) return -1;                  // past the block map or bad data block number
+        if (block_check(D) != 0) return -1;                                                  // corrupt block
+
+        /* extend the copy over physically adjacent blocks so contiguous files take one memcpy */
+        uint32_t run_blocks = 1;
+        uint32_t run_len = BLOCK_SIZE - block_offset;                                        // how many bytes can be copied from this run
+        while ((run_len < length) && (inode_get_block(node, block_idx + run_blocks) == D + run_blocks) &&
+               (block_check(D + run_blocks) == 0)) {
+            run_blocks++;
+            run_len += BLOCK_SIZE;
+        }
+        if (run_len > length) run_len = length;
+
+        memcpy(buf, data_block_ptr + BLOCK_SIZE*D + block_offset, run_len);                  // copy the run into buf
+        buf += run_len;                                                                      // update buf pointer
+        bytes_copied += run_len;                                                             // accumulate copied bytes
+        length -= run_len;                                                                   // update length
+
+        block_idx += run_blocks;                                                             // continue after the run
+        block_offset = 0;
+    }
+
+    return bytes_copied;
+}
+
+/**
+ * block_is_shared
+ *  DESCRIPTION : check whether more than one file or indirect block points at a data block
+ *  INPUTS : uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - shared, 0 - not shared
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t block_is_shared (uint32_t block)
+{
+    if (block >= FS_MAX_DATA_BLOCKS) return 0;
+    return block_refcount[block] > 1;
+}
+
+/**
+ * block_unshare
+ *  DESCRIPTION : give a file its own copy of a shared block before it is written
+ *  INPUTS : uint32_t* slot - where the file stores the block number (from inode_block_slot)
+ *           uint32_t meta - 1 if the file is a directory
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no free data block left or the block is corrupt
+ *  SIDE EFFECTS : allocate a data block, repoint the slot to it
+ *
+ */
+static int32_t block_unshare (uint32_t* slot, uint32_t meta)
+{
+    if (block_check(*slot) != 0) return -1;                                                         // do not copy a corrupt block
+    int32_t copy = alloc_data_block(*slot + 1, 1);
+    if (copy == -1) return -1;
+    memcpy(data_block_ptr + BLOCK_SIZE*copy, data_block_ptr + BLOCK_SIZE*(*slot), BLOCK_SIZE);
+    fs_dirty_range(data_block_ptr + BLOCK_SIZE*copy, BLOCK_SIZE, meta);
+    free_data_block(*slot);                                                                         // the original stays with the other files
+    *slot = copy;
+    fs_dirty(slot, sizeof(uint32_t));
+    return 0;
+}
+
+/**
+ * table_unshare
+ *  DESCRIPTION : give a file its own copy of a shared indirect block before one of its
+ *                entries changes. The copy points at the same blocks, so each of the
+ *                used entries gains a reference.
+ *  INPUTS : uint32_t* slot - where the file stores the indirect block number
+ *           uint32_t used - number of entries of the indirect block in use
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success (also when the indirect block was not shared)
+ *                 -1 - bad block number or no free data block left
+ *  SIDE EFFECTS : may allocate a data block, repoint the slot to it, invalidate block_map_cache
+ *
+ */
+static int32_t table_unshare (uint32_t* slot, uint32_t used)
+{
+    uint32_t* table = block_table(*slot);
+    uint32_t i;
+    if (table == NULL) return -1;
+    if (!block_is_shared(*slot)) return 0;
+    int32_t copy = alloc_data_block(*slot + 1, 1);
+    if (copy == -1) return -1;
+    memcpy(data_block_ptr + BLOCK_SIZE*copy, table, BLOCK_SIZE);
+    fs_dirty(data_block_ptr + BLOCK_SIZE*copy, BLOCK_SIZE);
+    for (i = 0; (i < used) && (i < BLOCK_PTRS); i++) block_get(table[i]);
+    free_data_block(*slot);
+    *slot = copy;
+    fs_dirty(slot, sizeof(uint32_t));
+    block_map_cache.node = NULL;                                                                    // may still point at the shared table
+    return 0;
+}
+
+/**
+ * inode_block_slot_private
+ *  DESCRIPTION : like inode_block_slot, but first make every indirect block on the way
+ *                to block idx private to this file so the slot can be written
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t idx - block index within the file, below num_blocks
+ *           uint32_t num_blocks - blocks currently mapped by the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the block number
+ *                 NULL - bad block map or no free data block left
+ *  SIDE EFFECTS : may copy indirect blocks
+ *
+ */
+static uint32_t* inode_block_slot_private (inode_t* node, uint32_t idx, uint32_t num_blocks)
+{
+    uint32_t first = INODE_DIRECT_BLOCKS + BLOCK_PTRS;                                              // first index behind the double indirect block
+    if (idx >= INODE_DIRECT_BLOCKS) {
+        uint32_t used = num_blocks - INODE_DIRECT_BLOCKS;
+        if (-1 == table_unshare(&node->indirect_block, (used < BLOCK_PTRS) ? used : BLOCK_PTRS)) return NULL;
+    }
+    if (idx >= first) {
+        uint32_t used = num_blocks - first;
+        if (-1 == table_unshare(&node->double_indirect_block, (used + BLOCK_PTRS - 1) / BLOCK_PTRS)) return NULL;
+        uint32_t outer = (idx - first) / BLOCK_PTRS;
+        used -= outer * BLOCK_PTRS;
+        if (-1 == table_unshare(block_table(node->double_indirect_block) + outer, (used < BLOCK_PTRS) ? used : BLOCK_PTRS)) return NULL;
+    }
+    return inode_block_slot(node, idx);
+}
+
+/**
+ * alloc_table_block
+ *  DESCRIPTION : allocate a zeroed data block to hold block numbers
+ *  INPUTS : uint32_t hint - preferred block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : the data block number
+ *                 -1 - no free data block left
+ *  SIDE EFFECTS : allocate a data block
+ *
+ */
+static int32_t alloc_table_block (uint32_t hint)
+{
+    int32_t block = alloc_data_block(hint, 1);
+    if (block != -1) {
+        memset(data_block_ptr + BLOCK_SIZE*block, 0, BLOCK_SIZE);
+        fs_dirty(data_block_ptr + BLOCK_SIZE*block, BLOCK_SIZE);
+    }
+    return block;
+}
+
+/**
+ * inode_append_block
+ *  DESCRIPTION : store the data block number of block idx of a file, where idx is the
+ *                first block past the end of the file. The indirect block covering idx is
+ *                allocated when idx is its first slot, and copied first when it is shared.
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t idx - block index within the file
+ *           uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - idx is out of range or no block is left for an indirect block
+ *  SIDE EFFECTS : may allocate indirect blocks
+ *
+ */
+static int32_t inode_append_block (inode_t* node, uint32_t idx, uint32_t block)
+{
+    uint32_t* table;
+    int32_t table_block;
+    if (idx < INODE_DIRECT_BLOCKS) {
+        node->data_blocks[idx] = block;
+        fs_dirty(node, sizeof(inode_t));
+        return 0;
+    }
+    if (idx >= INODE_MAX_BLOCKS) return -1;
+    idx -= INODE_DIRECT_BLOCKS;
+
+    if (idx < BLOCK_PTRS) {
+        if (idx == 0) {
+            if (-1 == (table_block = alloc_table_block(block + 1))) return -1;
+            node->indirect_block = table_block;
+            fs_dirty(node, sizeof(inode_t));
+        } else if (-1 == table_unshare(&node->indirect_block, idx)) {
+            return -1;                                                                              // a reflinked copy shares the table
+        }
+        table = block_table(node->indirect_block);
+        if (table == NULL) return -1;
+        table[idx] = block;
+        fs_dirty(table + idx, sizeof(uint32_t));
+        return 0;
+    }
+
+    idx -= BLOCK_PTRS;
+    if (idx == 0) {
+        if (-1 == (table_block = alloc_table_block(block + 1))) return -1;
+        node->double_indirect_block = table_block;
+        fs_dirty(node, sizeof(inode_t));
+    } else if (-1 == table_unshare(&node->double_indirect_block, (idx + BLOCK_PTRS - 1) / BLOCK_PTRS)) {
+        return -1;
+    }
+    uint32_t* outer_table = block_table(node->double_indirect_block);
+    if (outer_table == NULL) return -1;
+    if (idx % BLOCK_PTRS == 0) {
+        if (-1 == (table_block = alloc_table_block(block + 1))) {
+            if (idx == 0) {
+                free_data_block(node->double_indirect_block);
+            }
+            return -1;
+        }
+        outer_table[idx / BLOCK_PTRS] = table_block;
+        fs_dirty(outer_table + idx / BLOCK_PTRS, sizeof(uint32_t));
+    } else if (-1 == table_unshare(outer_table + idx / BLOCK_PTRS, idx % BLOCK_PTRS)) {
+        return -1;
+    }
+    table = block_table(outer_table[idx / BLOCK_PTRS]);
+    if (table == NULL) return -1;
+    table[idx % BLOCK_PTRS] = block;
+    fs_dirty(table + idx % BLOCK_PTRS, sizeof(uint32_t));
+    return 0;
+}
+
+/**
+ * inode_free_blocks
+ *  DESCRIPTION : free the data blocks of block indices [from, to) of a file, together
+ *                with every indirect block whose first slot is in that range. Used to
+ *                undo blocks just appended, whose indirect blocks are private to the
+ *                file; inode_release drops a whole file.
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t from - first block index to free
+ *           uint32_t to - one past the last block index in use
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : free data blocks, invalidate block_map_cache
+ *
+ */
+static void inode_free_blocks (inode_t* node, uint32_t from, uint32_t to)
+{
+    uint32_t idx;
+    int32_t block;
+    if (node->flags & INODE_FLAG_INLINE) return;                                                    // no blocks to free
+    for (idx = from; idx < to; idx++) {
+        block = inode_get_block(node, idx);
+        if (block != -1) free_data_block(block);
+    }
+
+    /* the indirect blocks go last, the walk above still needs them */
+    uint32_t first = INODE_DIRECT_BLOCKS + BLOCK_PTRS;                                              // first index behind the double indirect block
+    if (to > first) {
+        uint32_t* outer_table = block_table(node->double_indirect_block);
+        for (idx = first; (idx < to) && (outer_table != NULL); idx += BLOCK_PTRS) {
+            if (idx >= from) free_data_block(outer_table[(idx - first) / BLOCK_PTRS]);
+        }
+        if (from <= first) free_data_block(node->double_indirect_block);
+    }
+    if ((from <= INODE_DIRECT_BLOCKS) && (to > INODE_DIRECT_BLOCKS)) free_data_block(node->indirect_block);
+    block_map_cache.node = NULL;
+}
+
+/**
+ * inode_num_blocks
+ *  DESCRIPTION : count the data blocks in the block map of a file (not its indirect blocks).
+ *                A compressed file stores less than its length, the end of its offset
+ *                table tells how much.
+ *  INPUTS : inode_t* node - the inode of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of blocks
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint32_t inode_num_blocks (inode_t* node)
+{
+    uint32_t stored = node->length;
+    if (node->flags & INODE_FLAG_INLINE) return 0;                                                  // inline data owns no blocks
+    if (node->flags & INODE_FLAG_COMPRESSED) {
+        uint32_t last = (node->length + BLOCK_SIZE - 1) / BLOCK_SIZE;                               // the table entry just past the last block
+        if (inode_read_raw(node, last * sizeof(uint32_t), (uint8_t*)&stored, sizeof(uint32_t)) != sizeof(uint32_t)) {
+            stored = (last + 1) * sizeof(uint32_t);                                                 // corrupt, keep at least the table
+        }
+    }
+    return (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * table_release
+ *  DESCRIPTION : drop a reference to an indirect block. When it was the last one the
+ *                blocks it points at lose a reference too.
+ *  INPUTS : uint32_t block - the indirect block
+ *           uint32_t used - number of its entries in use
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : free data blocks
+ *
+ */
+static void table_release (uint32_t block, uint32_t used)
+{
+    uint32_t* table = block_table(block);
+    uint32_t i;
+    if (table == NULL) return;
+    if (block_refcount[block] == 1) {
+        for (i = 0; (i < used) && (i < BLOCK_PTRS); i++) free_data_block(table[i]);
+    }
+    free_data_block(block);
+}
+
+/**
+ * inode_release
+ *  DESCRIPTION : drop every reference a file holds on data blocks. Blocks and indirect
+ *                blocks shared with reflinked copies stay with the copies.
+ *  INPUTS : inode_t* node - the inode of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : free data blocks, invalidate block_map_cache
+ *
+ */
+static void inode_release (inode_t* node)
+{
+    uint32_t num_blocks = inode_num_blocks(node);
+    uint32_t first = INODE_DIRECT_BLOCKS + BLOCK_PTRS;
+    uint32_t i;
+    if (num_blocks > INODE_MAX_BLOCKS) num_blocks = INODE_MAX_BLOCKS;
+    for (i = 0; (i < num_blocks) && (i < INODE_DIRECT_BLOCKS); i++) free_data_block(node->data_blocks[i]);
+    if (num_blocks > INODE_DIRECT_BLOCKS) {
+        uint32_t used = num_blocks - INODE_DIRECT_BLOCKS;
+        table_release(node->indirect_block, (used < BLOCK_PTRS) ? used : BLOCK_PTRS);
+    }
+    if (num_blocks > first) {
+        uint32_t* outer_table = block_table(node->double_indirect_block);
+        if ((outer_table != NULL) && (block_refcount[node->double_indirect_block] == 1)) {
+            for (i = 0; i * BLOCK_PTRS < num_blocks - first; i++) {
+                uint32_t used = num_blocks - first - i * BLOCK_PTRS;
+                table_release(outer_table[i], (used < BLOCK_PTRS) ? used : BLOCK_PTRS);
+            }
+        }
+        free_data_block(node->double_indirect_block);
+    }
+    block_map_cache.node = NULL;
+}
+
+/**
+ * inode_spill_inline
+ *  DESCRIPTION : move the payload of an inline inode into a data block and turn the
+ *                inode back into an ordinary block-mapped one
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t want - number of blocks the file is about to need
+ *           uint32_t meta - 1 if the file is a directory
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no free data block left, the inode is unchanged
+ *  SIDE EFFECTS : may allocate a data block
+ *
+ */
+static int32_t inode_spill_inline (inode_t* node, uint32_t want, uint32_t meta)
+{
+    int32_t block = -1;
+    if (node->length > INODE_INLINE_MAX) node->length = INODE_INLINE_MAX;                          // never trust more than the inode holds
+    if (node->length > 0) {
+        block = alloc_data_block(block_alloc_cursor, want);
+        if (block == -1) return -1;
+        memset(data_block_ptr + BLOCK_SIZE*block, 0, BLOCK_SIZE);
+        memcpy(data_block_ptr + BLOCK_SIZE*block, inode_inline_data(node), node->length);         // the payload always fits in one block
+        fs_dirty_range(data_block_ptr + BLOCK_SIZE*block, BLOCK_SIZE, meta);
+    }
+    memset(inode_inline_data(node), 0, INODE_INLINE_MAX);                                           // clears the block map and both indirect blocks
+    if (block != -1) node->data_blocks[0] = block;
+    node->flags &= ~INODE_FLAG_INLINE;
+    fs_dirty(node, sizeof(inode_t));
+    block_map_cache.node = NULL;
+    return 0;
+}
+
+/**
+ * mark_block_ref
+ *  DESCRIPTION : count a reference to a block of a file found while walking the tree.
+ *                A block referenced more than once is shared (the image builder
+ *                dedups identical blocks, cp makes reflinks) and is copied on write.
+ *  INPUTS : uint32_t block - the data block number
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - first reference to the block, 0 - otherwise
+ *  SIDE EFFECTS : modify block_bitmap and block_refcount
+ *
+ */
+static int32_t mark_block_ref (uint32_t block)
+{
+    if ((block >= boot_block_ptr->num_data_blocks) || (block >= FS_MAX_DATA_BLOCKS)) return 0;
+    block_get(block);
+    if (block_refcount[block] != 1) return 0;
+    block_bitmap[block / 32] |= (1 << (block % 32));
+    return 1;
+}
+
+/**
+ * mark_table_refs
+ *  DESCRIPTION : count a reference to an indirect block, and the first time it is seen
+ *                the references it holds on the blocks it points at. A table that fails
+ *                its checksum or cannot be read keeps its own block busy, its entries are
+ *                not followed.
+ *  INPUTS : uint32_t block - the indirect block
+ *           uint32_t used - number of its entries in use
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify block_bitmap and block_refcount
+ *
+ */
+static void mark_table_refs (uint32_t block, uint32_t used)
+{
+    uint32_t i;
+    if (!mark_block_ref(block)) return;                                                             // shared, its entries are counted already
+    uint32_t* table = block_table(block);
+    if (table == NULL) return;                                                                      // corrupt or unreadable, table_release skips it too
+    for (i = 0; (i < used) && (i < BLOCK_PTRS); i++) mark_block_ref(table[i]);
+}
+
+/**
+ * mark_inode_blocks
+ *  DESCRIPTION : count the references a file holds on data and indirect blocks, so the
+ *                free-block bitmap and the reference counts match the tree
+ *  INPUTS : inode_t* node - the inode of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify block_bitmap and block_refcount
+ *
+ */
+static void mark_inode_blocks (inode_t* node)
+{
+    uint32_t i;
+    uint32_t num_blocks = inode_num_blocks(node);
+    uint32_t first = INODE_DIRECT_BLOCKS + BLOCK_PTRS;
+    if (num_blocks > INODE_MAX_BLOCKS) num_blocks = INODE_MAX_BLOCKS;
+    for (i = 0; (i < num_blocks) && (i < INODE_DIRECT_BLOCKS); i++) mark_block_ref(node->data_blocks[i]);
+    if (num_blocks > INODE_DIRECT_BLOCKS) {
+        uint32_t used = num_blocks - INODE_DIRECT_BLOCKS;
+        mark_table_refs(node->indirect_block, (used < BLOCK_PTRS) ? used : BLOCK_PTRS);
+    }
+    if ((num_blocks > first) && mark_block_ref(node->double_indirect_block)) {
+        uint32_t* outer_table = block_table(node->double_indirect_block);
+        for (i = 0; (outer_table != NULL) && (i * BLOCK_PTRS < num_blocks - first); i++) {
+            uint32_t used = num_blocks - first - i * BLOCK_PTRS;
+            mark_table_refs(outer_table[i], (used < BLOCK_PTRS) ? used : BLOCK_PTRS);
+        }
+    }
+}
+
+/**
+ * dir_entry_ptr
+ *  DESCRIPTION : get a pointer to the i-th dentry stored in a subdirectory
+ *  INPUTS : inode_t* dir - the inode of the directory
+ *           uint32_t i - index of the dentry
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the dentry
+ *                 NULL - i is past the end of the directory, the block map is bad or the block is corrupt
+ *  SIDE EFFECTS : none
+ *
+ */
+static dentry_t* dir_entry_ptr (inode_t* dir, uint32_t i)
+{
+    if (i >= dir->length / sizeof(dentry_t)) return NULL;
+    if (dir->flags & INODE_FLAG_COMPRESSED) return NULL;                                            // directories are never compressed
+    if (dir->flags & INODE_FLAG_INLINE) {
+        if ((i + 1) * sizeof(dentry_t) > INODE_INLINE_MAX) return NULL;
+        return (dentry_t*)inode_inline_data(dir) + i;                                              // small directories live in the inode
+    }
+    int32_t block = inode_get_block(dir, i / DENTRIES_PER_BLOCK);
+    if ((block == -1) || (block >= boot_block_ptr->num_data_blocks)) return NULL;
+    if (block_check(block) != 0) return NULL;
+    return (dentry_t*)(data_block_ptr + BLOCK_SIZE*block) + (i % DENTRIES_PER_BLOCK);
+}
+
+/**
+ * dcache_set
+ *  DESCRIPTION : find the dentry cache set a (parent directory, name) pair maps to
+ *  INPUTS : uint32_t parent - inode of the directory the name lives in
+ *           const uint8_t* name - the filename, need not be NUL terminated
+ *           uint32_t name_len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the first of the DCACHE_WAYS slots of the set
+ *  SIDE EFFECTS : none
+ *
+ */
+static dcache_entry_t* dcache_set (uint32_t parent, const uint8_t* name, uint32_t name_len)
+{
+    uint32_t hash = fs_name_hash(name, name_len) ^ (parent * 2654435761U);                          // mix in the parent with a Knuth multiplicative hash
+    return &dcache[(hash & (DCACHE_SIZE / DCACHE_WAYS - 1)) * DCACHE_WAYS];
+}
+
+/**
+ * dcache_match
+ *  DESCRIPTION : check whether a dentry cache slot holds the given (parent, name) pair
+ *  INPUTS : dcache_entry_t* entry - the slot
+ *           uint32_t parent - inode of the directory the name lives in
+ *           const uint8_t* name - the filename
+ *           uint32_t name_len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - match, 0 - no match
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t dcache_match (dcache_entry_t* entry, uint32_t parent, const uint8_t* name, uint32_t name_len)
+{
+    return (entry->name_len == name_len) && (entry->parent == parent) &&
+           (!strncmp((int8_t*)entry->name, (int8_t*)name, name_len));
+}
+
+/**
+ * dcache_find
+ *  DESCRIPTION : look a (parent, name) pair up in the dentry cache. A hit is moved to
+ *                the front of its set so the least recently used slot is always last.
+ *  INPUTS : uint32_t parent - inode of the directory the name lives in
+ *           const uint8_t* name - the filename
+ *           uint32_t name_len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the cached entry, NULL if the pair is not cached
+ *  SIDE EFFECTS : reorder the set
+ *
+ */
+static dcache_entry_t* dcache_find (uint32_t parent, const uint8_t* name, uint32_t name_len)
+{
+    dcache_entry_t* set = dcache_set(parent, name, name_len);
+    dcache_entry_t hit;
+    int32_t i;
+    for (i = 0; i < DCACHE_WAYS; i++) {
+        if (dcache_match(set + i, parent, name, name_len)) {
+            hit = set[i];
+            for (; i > 0; i--) set[i] = set[i - 1];
+            set[0] = hit;
+            return set;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * dcache_fill
+ *  DESCRIPTION : remember the result of a lookup at the front of its dentry cache set,
+ *                replacing an older entry for the same name or else the least recently used one
+ *  INPUTS : uint32_t parent - inode of the directory searched
+ *           const uint8_t* name - the filename
+ *           uint32_t name_len - the length of the filename
+ *           dentry_t* found - the dentry found, NULL for a miss
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+static void dcache_fill (uint32_t parent, const uint8_t* name, uint32_t name_len, dentry_t* found)
+{
+    dcache_entry_t* set = dcache_set(parent, name, name_len);
+    int32_t i;
+    for (i = 0; i < DCACHE_WAYS - 1; i++) {
+        if (dcache_match(set + i, parent, name, name_len)) break;
+    }
+    for (; i > 0; i--) set[i] = set[i - 1];
+
+    memset(set, 0, sizeof(dcache_entry_t));
+    set->parent = parent;
+    set->name_len = name_len;
+    strncpy((int8_t*)set->name, (int8_t*)name, name_len);
+    if (found == NULL) {
+        set->negative = 1;
+        return;
+    }
+    set->file_type = found->file_type;
+    set->inode = found->inode;
+}
+
+/**
+ * dcache_warm
+ *  DESCRIPTION : cache a name seen while scanning a directory, but only in a free slot
+ *                so that a long scan does not evict the names actually being looked up
+ *  INPUTS : uint32_t parent - inode of the directory scanned
+ *           dentry_t* seen - the dentry passed over
+ *           uint32_t name_len - the length of its filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+static void dcache_warm (uint32_t parent, dentry_t* seen, uint32_t name_len)
+{
+    dcache_entry_t* set = dcache_set(parent, seen->file_name, name_len);
+    int32_t i;
+    for (i = 0; i < DCACHE_WAYS; i++) {
+        if (dcache_match(set + i, parent, seen->file_name, name_len)) return;
+        if (set[i].name_len == 0) break;
+    }
+    if (i == DCACHE_WAYS) return;
+    set[i].parent = parent;
+    set[i].name_len = name_len;
+    strncpy((int8_t*)set[i].name, (int8_t*)seen->file_name, name_len);
+    set[i].negative = 0;
+    set[i].file_type = seen->file_type;
+    set[i].inode = seen->inode;
+}
+
+/**
+ * dcache_invalidate
+ *  DESCRIPTION : drop the cached lookup result (positive or negative) for a name,
+ *                called whenever a name is created in or removed from a directory
+ *  INPUTS : uint32_t parent - inode of the directory the name lives in
+ *           const uint8_t* name - the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+void dcache_invalidate (uint32_t parent, const uint8_t* name)
+{
+    uint32_t name_len = fs_name_len(name);
+    if (name_len > MAX_FILENAME_LEN) name_len = MAX_FILENAME_LEN;
+    dcache_entry_t* entry = dcache_find(parent, name, name_len);
+    if (entry != NULL) entry->name_len = 0;
+}
+
+/**
+ * dir_lookup
+ *  DESCRIPTION : look a single name up in a directory. The root directory is searched
+ *                through the name index, subdirectories by scanning their dentries.
+ *                Both hits and misses are remembered in the dentry cache.
+ *  INPUTS : uint32_t dir - inode of the directory, FS_ROOT_INODE for the root
+ *           const uint8_t* name - the filename, need not be NUL terminated
+ *           uint32_t name_len - the length of the filename
+ *           dentry_t* dentry - the dentry to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - found
+ *                 -1 - the name does not exist in the directory
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+static int32_t dir_lookup (uint32_t dir, const uint8_t* name, uint32_t name_len, dentry_t* dentry)
+{
+    dentry_t* found = NULL;
+    uint32_t i;
+    if ((name_len == 0) || (name_len > MAX_FILENAME_LEN)) return -1;
+    if ((dir == FS_ROOT_INODE) && (name_len == 2) && (name[0] == '.') && (name[1] == '.')) {
+        name_len = 1;                                                                               // ".." of the root is the root itself
+    }
+
+    dcache_entry_t* entry = dcache_find(dir, name, name_len);
+    if (entry != NULL) {
+        if (entry->negative) return -1;                                                             // cached miss
+        memset(dentry, 0, sizeof(dentry_t));
+        strncpy((int8_t*)dentry->file_name, (int8_t*)entry->name, name_len);
+        dentry->file_type = entry->file_type;
+        dentry->inode = entry->inode;
+        return 0;
+    }
+
+    if (dir == FS_ROOT_INODE) {
+        int32_t index = dentry_index_find(name, name_len);
+        if (index != -1) found = dentry_ptr + index;
+    } else if (dir < boot_block_ptr->num_inodes) {
+        inode_t* node = inode_ptr + dir;
+        uint32_t num_entries = node->length / sizeof(dentry_t);
+        for (i = 0; i < num_entries; i++) {
+            dentry_t* cur = dir_entry_ptr(node, i);
+            if (cur == NULL) break;
+            uint32_t cur_len = fs_name_len(cur->file_name);
+            if (cur_len > MAX_FILENAME_LEN) cur_len = MAX_FILENAME_LEN;
+            if ((cur_len == name_len) && (!strncmp((int8_t*)cur->file_name, (int8_t*)name, name_len))) {
+                found = cur;
+                break;
+            }
+            if (cur_len > 0) dcache_warm(dir, cur, cur_len);                                        // later lookups of names passed hit
+        }
+    }
+
+    dcache_fill(dir, name, name_len, found);
+    if (found == NULL) return -1;
+
+    memset(dentry, 0, sizeof(dentry_t));
+    strncpy((int8_t*)dentry->file_name, (int8_t*)found->file_name, name_len);
+    dentry->file_type = found->file_type;
+    dentry->inode = found->inode;
+    return 0;
+}
+
+/**
+ * path_lookup
+ *  DESCRIPTION : resolve a '/' separated path starting from a directory.
+ *                Empty components are skipped, "." and ".." are ordinary dentries.
+ *  INPUTS : uint32_t dir - inode of the starting directory, FS_ROOT_INODE for the root
+ *           const uint8_t* path - the path
+ *           dentry_t* dentry - the dentry to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - found
+ *                 -1 - a component does not exist, is too long, or is not a directory
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+int32_t path_lookup (uint32_t dir, const uint8_t* path, dentry_t* dentry)
+{
+    dentry_t cur;
+    uint32_t len;
+    int32_t found = 0;
+    if ((path == NULL) || (dentry == NULL)) return -1;
+    cur.file_type = FILE_TYPE_DIR;
+    cur.inode = dir;
+
+    while (1) {
+        while (*path == '/') path++;                                                                // skip separators
+        if (*path == '\0') break;
+        for (len = 0; (path[len] != '\0') && (path[len] != '/'); len++) {
+            if (len >= FS_MAX_PATH_LEN) return -1;
+        }
+        if (cur.file_type != FILE_TYPE_DIR) return -1;                                              // only directories have children
+        if (-1 == dir_lookup(cur.inode, path, len, &cur)) return -1;
+        path += len;
+        found = 1;
+    }
+    if (!found) return -1;                                                                          // an empty path names nothing
+    *dentry = cur;
+    return 0;
+}
+
+/**
+ * dir_slot
+ *  DESCRIPTION : get a pointer to a dentry of any directory, the root included
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           uint32_t i - index of the dentry
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the dentry
+ *                 NULL - i is past the end of the directory
+ *  SIDE EFFECTS : none
+ *
+ */
+static dentry_t* dir_slot (uint32_t dir, uint32_t i)
+{
+    if (dir == FS_ROOT_INODE) {
+        if ((i >= boot_block_ptr->num_dir_entries) || (i >= MAX_FILES_NUMBER)) return NULL;
+        return dentry_ptr + i;
+    }
+    return dir_entry_ptr(inode_ptr + dir, i);
+}
+
+/**
+ * dir_find_index
+ *  DESCRIPTION : find the index of the dentry with the given name in a directory.
+ *                The root is searched through the name index, subdirectories by scanning.
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           const uint8_t* name - the filename, need not be NUL terminated
+ *           uint32_t name_len - the length of the filename
+ *  OUTPUTS : none
+ *  RETURN VALUE : the index of the dentry
+ *                 -1 - the name does not exist in the directory
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t dir_find_index (uint32_t dir, const uint8_t* name, uint32_t name_len)
+{
+    uint32_t i;
+    if (dir == FS_ROOT_INODE) return dentry_index_find(name, name_len);
+    if (dir >= boot_block_ptr->num_inodes) return -1;
+    for (i = 0; i < inode_ptr[dir].length / sizeof(dentry_t); i++) {
+        dentry_t* cur = dir_entry_ptr(inode_ptr + dir, i);
+        if (cur == NULL) break;
+        uint32_t cur_len = fs_name_len(cur->file_name);
+        if (cur_len > MAX_FILENAME_LEN) cur_len = MAX_FILENAME_LEN;
+        if ((cur_len == name_len) && (!strncmp((int8_t*)cur->file_name, (int8_t*)name, name_len))) return i;
+    }
+    return -1;
+}
+
+/**
+ * dir_free_link
+ *  DESCRIPTION : put a removed dentry (empty name) on the free-slot list of its directory.
+ *                The list is chained through the inode fields of the removed dentries.
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           uint32_t i - index of the removed dentry
+ *           dentry_t* tomb - the removed dentry itself
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify dir_free_head and the dentry in place
+ *
+ */
+static void dir_free_link (uint32_t dir, uint32_t i, dentry_t* tomb)
+{
+    if (dir >= FS_MAX_INODES) return;
+    tomb->inode = dir_free_head[dir];
+    dir_free_head[dir] = i + 1;
+}
+
+/**
+ * dir_free_push
+ *  DESCRIPTION : turn a dentry into a tombstone and put it on the free-slot list.
+ *                Subdirectories are written through inode_write so a shared block is copied first.
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           uint32_t i - index of the dentry
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - no block left to copy a shared directory block into
+ *  SIDE EFFECTS : modify the directory and dir_free_head
+ *
+ */
+static int32_t dir_free_push (uint32_t dir, uint32_t i)
+{
+    dentry_t tomb;
+    if (dir >= FS_MAX_INODES) return -1;
+    memset(&tomb, 0, sizeof(dentry_t));
+    tomb.inode = dir_free_head[dir];
+    if (dir == FS_ROOT_INODE) {
+        dentry_ptr[i] = tomb;
+        fs_dirty(dentry_ptr + i, sizeof(dentry_t));
+    } else if (inode_write(dir, i * sizeof(dentry_t), (uint8_t*)&tomb, sizeof(dentry_t), 1) != sizeof(dentry_t)) {
+        return -1;
+    }
+    dir_free_head[dir] = i + 1;
+    return 0;
+}
+
+/**
+ * dir_free_pop
+ *  DESCRIPTION : take a removed dentry slot off the free-slot list of a directory
+ *  INPUTS : uint32_t dir - inode of the directory
+ *  OUTPUTS : none
+ *  RETURN VALUE : the index of the free slot
+ *                 -1 - the directory has no removed dentry
+ *  SIDE EFFECTS : modify dir_free_head
+ *
+ */
+static int32_t dir_free_pop (uint32_t dir)
+{
+    uint32_t head;
+    dentry_t* tomb;
+    if (dir >= FS_MAX_INODES) return -1;
+    head = dir_free_head[dir];
+    if (head == 0) return -1;
+    tomb = dir_slot(dir, head - 1);
+    if ((tomb == NULL) || (tomb->file_name[0] != '\0')) {
+        dir_free_head[dir] = 0;                                                                     // the chain is broken, stop reusing slots
+        return -1;
+    }
+    dir_free_head[dir] = tomb->inode;
+    return head - 1;
+}
+
+/**
+ * dir_add_entry
+ *  DESCRIPTION : store a new dentry in a directory. The root keeps its dentries in the
+ *                boot block, subdirectories append them to their data blocks.
+ *  INPUTS : uint32_t dir - inode of the directory
+ *           dentry_t* dentry - the dentry to add
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - the root is full or there is no space left
+ *  SIDE EFFECTS : modify the directory, the name index and the dentry cache
+ *
+ */
+static int32_t dir_add_entry (uint32_t dir, dentry_t* dentry)
+{
+    int32_t index = dir_free_pop(dir);                                                              // reuse a removed dentry first
+    if (dir == FS_ROOT_INODE) {
+        if (index == -1) {
+            index = boot_block_ptr->num_dir_entries;
+            if (index >= MAX_FILES_NUMBER) return -1;                                               // the boot block is full
+            boot_block_ptr->num_dir_entries++;
+        }
+        dentry_ptr[index] = *dentry;
+        fs_dirty(boot_block_ptr, BLOCK_SIZE);                                                       // the dentry and maybe num_dir_entries
+        dentry_index_insert(index);                                                                 // Keep the name index up to date
+    } else if (index != -1) {
+        if (inode_write(dir, index * sizeof(dentry_t), (uint8_t*)dentry, sizeof(dentry_t), 1) != sizeof(dentry_t)) {
+            dir_free_head[dir] = index + 1;                                                         // the tombstone is untouched, keep it listed
+            return -1;
+        }
+    } else {
+        uint32_t end = inode_ptr[dir].length;
+        if (inode_write(dir, end, (uint8_t*)dentry, sizeof(dentry_t), 1) != sizeof(dentry_t)) {
+            inode_ptr[dir].length = end;                                                            // drop a partially written dentry
+            fs_dirty(inode_ptr + dir, sizeof(inode_t));
+            return -1;
+        }
+    }
+    dcache_invalidate(dir, dentry->file_name);                                                      // forget a cached miss for this name
+    return 0;
+}
+
+/**
+ * path_parent
+ *  DESCRIPTION : split a path into its parent directory and its last component.
+ *                "." and ".." cannot be the last component.
+ *  INPUTS : uint32_t dir - inode of the directory the path starts from
+ *           const uint8_t* path - the path
+ *           dentry_t* parent - filled in with the dentry of the parent directory
+ *           uint32_t* name_len - filled in with the length of the last component
+ *  OUTPUTS : none
+ *  RETURN VALUE : offset of the last component in path
+ *                 -1 - bad name, or the parent does not exist or is not a directory
+ *  SIDE EFFECTS : modify dcache
+ *
+ */
+static int32_t path_parent (uint32_t dir, const uint8_t* path, dentry_t* parent, uint32_t* name_len)
+{
+    uint8_t parent_path[FS_MAX_PATH_LEN + 1];
+    uint32_t path_len, name_start, i;
+    if (path == NULL) return -1;
+    for (path_len = 0; path[path_len] != '\0'; path_len++) {
+        if (path_len >= FS_MAX_PATH_LEN) return -1;                                                 // path too long
+    }
+    while ((path_len > 0) && (path[path_len - 1] == '/')) path_len--;                               // ignore trailing separators
+    for (name_start = path_len; (name_start > 0) && (path[name_start - 1] != '/'); name_start--);
+    *name_len = path_len - name_start;
+    if ((*name_len == 0) || (*name_len > MAX_FILENAME_LEN)) return -1;                              // bad filename
+    if ((path[name_start] == '.') && ((*name_len == 1) || ((*name_len == 2) && (path[name_start + 1] == '.')))) return -1;
+
+    /* find the parent directory, an empty parent path is the starting directory */
+    memcpy(parent_path, path, name_start);
+    parent_path[name_start] = '\0';
+    if (-1 == path_lookup(dir, parent_path, parent)) {
+        for (i = 0; (i < name_start) && (parent_path[i] == '/'); i++);
+        if (i < name_start) return -1;                                                              // parent does not exist
+        parent->file_type = FILE_TYPE_DIR;
+        parent->inode = dir;
+    }
+    if (parent->file_type != FILE_TYPE_DIR) return -1;
+    return name_start;
+}
+
+/**
+ * create_path
+ *  DESCRIPTION : create an empty regular file or directory at path. The last component
+ *                is the new name, everything before it must be an existing directory.
+ *                A new directory starts with "." and ".." dentries.
+ *  INPUTS : uint32_t dir - inode of the directory the path starts from
+ *           const uint8_t* path - path of the new file
+ *           uint32_t type - FILE_TYPE_REGULAR or FILE_TYPE_DIR
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the file was created
+ *                 -1 - bad name, the file already exists, or no dentry/inode/block is left
+ *  SIDE EFFECTS : allocate an inode, add a dentry
+ *
+ */
+static int32_t create_path (uint32_t dir, const uint8_t* path, uint32_t type)
+{
+    dentry_t parent, dentry;
+    uint32_t name_len;
+    int32_t name_start, inode;
+    name_start = path_parent(dir, path, &parent, &name_len);
+    if (name_start == -1) return -1;
+    if (0 == dir_lookup(parent.inode, path + name_start, name_len, &dentry)) return -1;             // the file already exists
+
+    inode = alloc_inode();
+    if (inode == -1) return -1;                                                                     // no inode left
+    memset(inode_ptr + inode, 0, BLOCK_SIZE);
+    inode_ptr[inode].flags = INODE_FLAG_INLINE;                                                     // new files start inline, no block until they outgrow the inode
+    fs_dirty(inode_ptr + inode, sizeof(inode_t));
+
+    if (type == FILE_TYPE_DIR) {
+        dentry_t self[2];
+        memset(self, 0, sizeof(self));
+        self[0].file_name[0] = '.';
+        self[0].file_type = FILE_TYPE_DIR;
+        self[0].inode = inode;
+        self[1].file_name[0] = '.';
+        self[1].file_name[1] = '.';
+        self[1].file_type = FILE_TYPE_DIR;
+        self[1].inode = parent.inode;
+        if (inode_write(inode, 0, (uint8_t*)self, sizeof(self), 1) != sizeof(self)) {
+            inode_free_blocks(inode_ptr + inode, 0, (inode_ptr[inode].length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            free_inode(inode);
+            return -1;
+        }
+    }
+
+    memset(&dentry, 0, sizeof(dentry_t));
+    strncpy((int8_t*)dentry.file_name, (const int8_t*)(path + name_start), name_len);
+    dentry.file_type = type;
+    dentry.inode = inode;
+    if (-1 == dir_add_entry(parent.inode, &dentry)) {
+        inode_free_blocks(inode_ptr + inode, 0, (inode_ptr[inode].length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        free_inode(inode);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * fs_create
+ *  DESCRIPTION : create an empty regular file or directory at path, see create_path.
+ *                The flusher waits until the file and its dentry are both in place.
+ *  INPUTS : uint32_t dir - inode of the directory the path starts from
+ *           const uint8_t* path - path of the new file
+ *           uint32_t type - FILE_TYPE_REGULAR or FILE_TYPE_DIR
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the file was created
+ *                 -1 - bad name, the file already exists, or no dentry/inode/block is left
+ *  SIDE EFFECTS : allocate an inode, add a dentry
+ *
+ */
+int32_t fs_create (uint32_t dir, const uint8_t* path, uint32_t type)
+{
+    int32_t ret;
+    fs_op_begin();
+    ret = create_path(dir, path, type);
+    fs_op_end();
+    return ret;
+}
+
+/**
+ * fs_reflink
+ *  DESCRIPTION : make file dst a copy of file src without copying any data. Both inodes
+ *                point at the same blocks, each block is copied on the first write to it.
+ *  INPUTS : uint32_t src - inode of the file to copy
+ *           uint32_t dst - inode of the file to overwrite
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - bad inode number
+ *  SIDE EFFECTS : release the old blocks of dst, take a reference on the blocks of src
+ *
+ */
+int32_t fs_reflink (uint32_t src, uint32_t dst)
+{
+    inode_t* from = inode_ptr + src;
+    inode_t* to = inode_ptr + dst;
+    uint32_t num_blocks, i;
+    if ((src >= boot_block_ptr->num_inodes) || (dst >= boot_block_ptr->num_inodes)) return -1;
+    if (src == dst) return 0;                                                                       // already a copy of itself
+
+    fs_op_begin();
+    inode_release(to);
+    zcache_invalidate(dst);                                                                         // the old contents may still be cached
+    ecache_invalidate(dst);
+    memcpy(to, from, BLOCK_SIZE);
+    fs_dirty(to, sizeof(inode_t));
+
+    /* the top of the block map is now reachable from two inodes, the tables below it are shared as a whole */
+    num_blocks = inode_num_blocks(from);
+    if (num_blocks > INODE_MAX_BLOCKS) num_blocks = INODE_MAX_BLOCKS;
+    for (i = 0; (i < num_blocks) && (i < INODE_DIRECT_BLOCKS); i++) block_get(from->data_blocks[i]);
+    if (num_blocks > INODE_DIRECT_BLOCKS) block_get(from->indirect_block);
+    if (num_blocks > INODE_DIRECT_BLOCKS + BLOCK_PTRS) block_get(from->double_indirect_block);
+    block_map_cache.node = NULL;
+    fs_op_end();
+    return 0;
+}
+
+/**
+ * fs_stat
+ *  DESCRIPTION : fill in the size, type and inode of a file from its inode alone.
+ *                The root directory has no inode of its own, its size comes from the boot block.
+ *  INPUTS : uint32_t inode - inode of the file
+ *           uint32_t file_type - FILE_TYPE_* from its dentry
+ *           fs_stat_t* st - the structure to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - bad inode number or NULL st
+ *  SIDE EFFECTS : none
+ *
+ */
+int32_t fs_stat (uint32_t inode, uint32_t file_type, fs_stat_t* st)
+{
+    if (st == NULL) return -1;
+    st->file_type = file_type;
+    st->inode = inode;
+    if (file_type == FILE_TYPE_RTC) {
+        st->length = 0;                                                                             // a device, no data
+    } else if ((file_type == FILE_TYPE_DIR) && (inode == FS_ROOT_INODE)) {
+        st->length = boot_block_ptr->num_dir_entries * sizeof(dentry_t);
+    } else {
+        if (inode >= boot_block_ptr->num_inodes) return -1;
+        st->length = inode_ptr[inode].length;
+    }
+    return 0;
+}
+
+/**
+ * ecache_invalidate
+ *  DESCRIPTION : forget what the executable cache knows about a file, called whenever
+ *                the file is written, overwritten or freed
+ *  INPUTS : uint32_t inode - the inode number of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify ecache
+ *
+ */
+static void ecache_invalidate (uint32_t inode)
+{
+    ecache_entry_t* slot = &ecache[inode & (ECACHE_SIZE - 1)];
+    if (slot->inode == inode) slot->valid = 0;
+}
+
+/**
+ * fs_exec_info
+ *  DESCRIPTION : tell whether a file is an executable and where it starts. The first
+ *                call reads the magic number and the entry point in one read, later
+ *                calls are answered from the executable cache until the file changes.
+ *                Only a complete header is cached, a file too short for one or a failed
+ *                read is looked at again next time.
+ *  INPUTS : uint32_t inode - inode of the file
+ *           uint32_t* entry - set to the entry point
+ *           uint32_t* length - set to the length of the program image
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the file is an executable
+ *                 -1 - bad inode, the header cannot be read, or the file does not start
+ *                      with EXE_MAGIC
+ *  SIDE EFFECTS : modify ecache
+ *
+ */
+int32_t fs_exec_info (uint32_t inode, uint32_t* entry, uint32_t* length)
+{
+    uint32_t header[EIP_START / 4 + 1];                                                             // the magic number up to the entry point
+    ecache_entry_t* slot;
+    if ((inode == 0) || (inode >= boot_block_ptr->num_inodes)) return -1;
+    slot = &ecache[inode & (ECACHE_SIZE - 1)];
+    if (!slot->valid || (slot->inode != inode)) {
+        if (read_data(inode, 0, (uint8_t*)header, sizeof(header)) != sizeof(header)) return -1;
+        slot->valid = 0;
+        slot->inode = inode;
+        slot->executable = (header[0] == EXE_MAGIC);
+        slot->entry = header[EIP_START / 4];
+        slot->length = inode_ptr[inode].length;
+        slot->valid = 1;
+    }
+    if (!slot->executable) return -1;
+    *entry = slot->entry;
+    *length = slot->length;
+    return 0;
+}
+
+/**
+ * fs_data_page
+ *  DESCRIPTION : find where a page of a file lies in the in-memory image, so that it
+ *                can be mapped without copying. Data blocks are page aligned, the data
+ *                of an inline file starts inside its inode block.
+ *  INPUTS : uint32_t inode - inode of the file
+ *           uint32_t idx - index of the page in the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the start of that page of data
+ *                 NULL - bad inode, page past the end, a corrupt block, or a compressed file (its blocks are not file pages)
+ *  SIDE EFFECTS : none
+ *
+ */
+uint8_t* fs_data_page (uint32_t inode, uint32_t idx)
+{
+    inode_t* node;
+    int32_t block;
+    if ((inode == 0) || (inode >= boot_block_ptr->num_inodes)) return NULL;
+    node = inode_ptr + inode;
+    if (idx >= (node->length + BLOCK_SIZE - 1) / BLOCK_SIZE) return NULL;
+    if (node->flags & INODE_FLAG_COMPRESSED) return NULL;
+    if (node->flags & INODE_FLAG_INLINE) return inode_inline_data(node);                           // only page 0 exists
+    block = inode_get_block(node, idx);
+    if ((block == -1) || (block >= boot_block_ptr->num_data_blocks)) return NULL;
+    if (block_check(block) != 0) return NULL;
+    return data_block_ptr + BLOCK_SIZE*block;
+}
+
+/**
+ * fs_page_get, fs_page_put
+ *  DESCRIPTION : take or drop a reference to the data block holding a page fs_data_page
+ *                returned, so that the block is not freed and reused while the page is
+ *                mapped. A referenced block counts as shared: a write to the file copies
+ *                it first and the mapping keeps the old contents. The put frees the
+ *                block when the file let go of it in the meantime.
+ *  INPUTS : const uint8_t* page - a page returned by fs_data_page
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the reference is taken
+ *                 -1 - the page is not a data block (the data of an inline file)
+ *  SIDE EFFECTS : modify block_refcount, fs_page_put may free the block
+ *
+ */
+int32_t fs_page_get (const uint8_t* page)
+{
+    if ((page < data_block_ptr) || ((page - data_block_ptr) % BLOCK_SIZE)) return -1;
+    if ((page - data_block_ptr) / BLOCK_SIZE >= boot_block_ptr->num_data_blocks) return -1;
+    block_get((page - data_block_ptr) / BLOCK_SIZE);
+    return 0;
+}
+
+void fs_page_put (const uint8_t* page)
+{
+    if ((page < data_block_ptr) || ((page - data_block_ptr) % BLOCK_SIZE)) return;
+    if ((page - data_block_ptr) / BLOCK_SIZE >= boot_block_ptr->num_data_blocks) return;
+    free_data_block((page - data_block_ptr) / BLOCK_SIZE);
+}
+
+/**
+ * dir_is_empty
+ *  DESCRIPTION : check that a directory holds nothing but "." and ".."
+ *  INPUTS : uint32_t dir - inode of the directory
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - empty, 0 - not empty
+ *  SIDE EFFECTS : none
+ *
+ */
+static int32_t dir_is_empty (uint32_t dir)
+{
+    uint32_t i;
+    for (i = 0; i < inode_ptr[dir].length / sizeof(dentry_t); i++) {
+        dentry_t* cur = dir_entry_ptr(inode_ptr + dir, i);
+        if (cur == NULL) break;
+        if ((cur->file_name[0] == '\0') || (cur->file_name[0] == '.' && (cur->file_name[1] == '\0' ||
+            (cur->file_name[1] == '.' && cur->file_name[2] == '\0')))) continue;                  // skip removed, "." and ".."
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * remove_path
+ *  DESCRIPTION : remove a regular file or an empty directory. Its dentry becomes a
+ *                tombstone on the free-slot list of the parent (the last root dentry is
+ *                dropped instead), then its inode and blocks go back to the allocators.
+ *  INPUTS : uint32_t dir - inode of the directory the path starts from
+ *           const uint8_t* path - path of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the file was removed
+ *                 -1 - bad name, the file does not exist, or the directory is not empty
+ *  SIDE EFFECTS : modify the parent directory, the name index and the dentry cache,
+ *                 free the inode and its data blocks
+ *
+ */
+static int32_t remove_path (uint32_t dir, const uint8_t* path)
+{
+    dentry_t parent, removed;
+    dentry_t* victim;
+    uint32_t name_len;
+    int32_t name_start, index;
+    name_start = path_parent(dir, path, &parent, &name_len);
+    if (name_start == -1) return -1;
+    index = dir_find_index(parent.inode, path + name_start, name_len);
+    if (index == -1) return -1;                                                                     // no such file
+    victim = dir_slot(parent.inode, index);
+    if (victim == NULL) return -1;
+    removed = *victim;
+    if ((removed.file_type == FILE_TYPE_DIR) &&
+        ((removed.inode == FS_ROOT_INODE) || (removed.inode >= boot_block_ptr->num_inodes) || !dir_is_empty(removed.inode))) return -1;
+
+    /* drop the dentry */
+    if (parent.inode == FS_ROOT_INODE) {
+        dentry_index_remove(index);
+        if (index + 1 == boot_block_ptr->num_dir_entries) {
+            memset(victim, 0, sizeof(dentry_t));
+            boot_block_ptr->num_dir_entries--;                                                      // the last dentry needs no tombstone
+            fs_dirty(boot_block_ptr, BLOCK_SIZE);
+        } else {
+            dir_free_push(FS_ROOT_INODE, index);
+        }
+    } else if (-1 == dir_free_push(parent.inode, index)) {
+        return -1;
+    }
+    dcache_invalidate(parent.inode, removed.file_name);
+
+    /* reclaim the inode and its blocks */
+    if (((removed.file_type == FILE_TYPE_REGULAR) || (removed.file_type == FILE_TYPE_DIR)) &&
+        (removed.inode != FS_ROOT_INODE) && (removed.inode < boot_block_ptr->num_inodes)) {
+        if (removed.file_type == FILE_TYPE_DIR) {
+            dcache_invalidate(removed.inode, (uint8_t*)".");                                        // the inode may come back as another directory
+            dcache_invalidate(removed.inode, (uint8_t*)"..");
+            if (removed.inode < FS_MAX_INODES) dir_free_head[removed.inode] = 0;
+        }
+        inode_release(inode_ptr + removed.inode);
+        inode_ptr[removed.inode].length = 0;
+        fs_dirty(inode_ptr + removed.inode, sizeof(inode_t));
+        free_inode(removed.inode);
+    }
+    return 0;
+}
+
+/**
+ * fs_remove
+ *  DESCRIPTION : remove a regular file or an empty directory, see remove_path. The
+ *                flusher waits until the dentry and the inode are both gone.
+ *  INPUTS : uint32_t dir - inode of the directory the path starts from
+ *           const uint8_t* path - path of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the file was removed
+ *                 -1 - bad name, the file does not exist, or the directory is not empty
+ *  SIDE EFFECTS : modify the parent directory, the name index and the dentry cache,
+ *                 free the inode and its data blocks
+ *
+ */
+int32_t fs_remove (uint32_t dir, const uint8_t* path)
+{
+    int32_t ret;
+    fs_op_begin();
+    ret = remove_path(dir, path);
+    fs_op_end();
+    return ret;
+}
+
+/**
+ * mark_dir_tree
+ *  DESCRIPTION : mark the inodes and blocks of everything below a subdirectory busy
+ *  INPUTS : uint32_t dir - inode of the subdirectory
+ *           uint32_t depth - nesting level, bounds the recursion
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify inode_bitmap and block_bitmap
+ *
+ */
+static void mark_dir_tree (uint32_t dir, uint32_t depth)
+{
+    inode_t* node = inode_ptr + dir;
+    uint32_t i;
+    uint32_t num_entries = node->length / sizeof(dentry_t);
+    for (i = 0; i < num_entries; i++) {
+        dentry_t* cur = dir_entry_ptr(node, i);
+        if (cur == NULL) break;
+        if (cur->file_name[0] == '\0') {
+            dir_free_link(dir, i, cur);                                                             // a removed dentry, free for reuse
+            continue;
+        }
+        if ((cur->file_name[0] == '.') && ((cur->file_name[1] == '\0') ||
+            ((cur->file_name[1] == '.') && (cur->file_name[2] == '\0')))) continue;               // skip "." and ".."
+        mark_dentry(cur, depth + 1);
+    }
+}
+
+/**
+ * mark_dentry
+ *  DESCRIPTION : mark the inode and blocks a dentry refers to busy, descending into
+ *                subdirectories. An inode that is already busy is not visited again.
+ *  INPUTS : dentry_t* dentry - the dentry
+ *           uint32_t depth - nesting level, bounds the recursion
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify inode_bitmap and block_bitmap
+ *
+ */
+static void mark_dentry (dentry_t* dentry, uint32_t depth)
+{
+    uint32_t inode = dentry->inode;
+    if ((dentry->file_type != FILE_TYPE_REGULAR) && (dentry->file_type != FILE_TYPE_DIR)) return;
+    if ((inode == FS_ROOT_INODE) || (inode >= boot_block_ptr->num_inodes) || (inode >= FS_MAX_INODES)) return;
+    if (inode_bitmap[inode / 32] & (1 << (inode % 32))) return;                                     // already visited
+    inode_bitmap[inode / 32] |= (1 << (inode % 32));                                                // Set it to be busy status
+    mark_inode_blocks(inode_ptr + inode);                                                           // Blocks owned by a file are busy
+    if ((dentry->file_type == FILE_TYPE_DIR) && (depth < FS_MAX_DEPTH)) mark_dir_tree(inode, depth);
+}
+
+/**
+ * journal_csum
+ *  DESCRIPTION : compute the checksum of the transaction in journal_buf
+ *  INPUTS : journal_desc_t* desc - its descriptor, count below FS_JOURNAL_BLOCKS
+ *  OUTPUTS : none
+ *  RETURN VALUE : CRC32C of the sequence, the count, the block list and the logged blocks
+ *  SIDE EFFECTS : none
+ *
+ */
+static uint32_t journal_csum (journal_desc_t* desc)
+{
+    uint32_t crc = crc32c(0, (uint8_t*)&desc->sequence, 2 * sizeof(uint32_t) + desc->count * sizeof(uint32_t));
+    return crc32c(crc, journal_buf + BLOCK_SIZE, desc->count * BLOCK_SIZE);
+}
+
+/**
+ * journal_checkpoint
+ *  DESCRIPTION : write the blocks of the committed transaction in journal_buf to their
+ *                places in the image on the disk, adjacent blocks in one transfer
+ *  INPUTS : journal_desc_t* desc - its descriptor, the blocks are listed in ascending order
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - a write failed, the journal still holds the transaction
+ *  SIDE EFFECTS : write to the disk
+ *
+ */
+static int32_t journal_checkpoint (journal_desc_t* desc)
+{
+    uint32_t i, start;
+    for (i = 0; i < desc->count; ) {
+        for (start = i++; (i < desc->count) && (desc->blocks[i] == desc->blocks[i - 1] + 1); i++);
+        if (ata_write(desc->blocks[start] * FS_SECTORS_PER_BLOCK, (i - start) * FS_SECTORS_PER_BLOCK, journal_buf + BLOCK_SIZE*(1 + start)) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * journal_clear
+ *  DESCRIPTION : mark the journal on the disk empty once its transaction is in place, so
+ *                that no later boot replays it over blocks written since
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - the write failed, the journal may still be replayed
+ *  SIDE EFFECTS : write to the disk
+ *
+ */
+static int32_t journal_clear (void)
+{
+    uint8_t sector[ATA_SECTOR_SIZE];                                                                // the magic is in the first sector
+    memset(sector, 0, sizeof(sector));
+    return ata_write(journal_start * FS_SECTORS_PER_BLOCK, 1, sector);
+}
+
+/**
+ * journal_replay
+ *  DESCRIPTION : redo the last transaction in the journal. A crash may have left its
+ *                blocks half written in the image on the disk, so they are copied into
+ *                the image in memory and written back again, then the journal is cleared.
+ *                A transaction whose checksum does not match was never committed and is
+ *                ignored.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the image, block_present and journal_sequence, read and write the disk
+ *
+ */
+static void journal_replay (void)
+{
+    journal_desc_t* desc = (journal_desc_t*)journal_buf;
+    uint32_t data_start = 1 + boot_block_ptr->num_inodes;
+    uint32_t num_blocks = data_start + boot_block_ptr->num_data_blocks;
+    uint32_t i, block;
+    crc32c_init();
+    if (ata_read(journal_start * FS_SECTORS_PER_BLOCK, FS_SECTORS_PER_BLOCK, journal_buf) != 0) return;
+    if ((desc->magic != FS_JOURNAL_MAGIC) || (desc->count == 0) || (desc->count >= FS_JOURNAL_BLOCKS)) return;
+    if (ata_read((journal_start + 1) * FS_SECTORS_PER_BLOCK, desc->count * FS_SECTORS_PER_BLOCK, journal_buf + BLOCK_SIZE) != 0) return;
+    if (journal_csum(desc) != desc->csum) return;                                                   // torn write, the transaction never happened
+    for (i = 0; i < desc->count; i++) {
+        if (desc->blocks[i] >= num_blocks) return;                                                  // not a journal of this image
+    }
+    for (i = 0; i < desc->count; i++) {
+        memcpy((uint8_t*)boot_block_ptr + BLOCK_SIZE*desc->blocks[i], journal_buf + BLOCK_SIZE*(1 + i), BLOCK_SIZE);
+        if (desc->blocks[i] < data_start) continue;
+        block = desc->blocks[i] - data_start;
+        block_present[block / 32] |= (1 << (block % 32));
+    }
+    journal_sequence = desc->sequence;
+    if ((journal_checkpoint(desc) != 0) || (journal_clear() != 0)) printf("filesys: replaying the journal failed\n");
+}
+
+/**
+ * layout_convert
+ *  DESCRIPTION : bring an image from createfs to the current inode layout. createfs gives
+ *                an inode FS_OLD_DIRECT_BLOCKS direct block numbers, where the last three
+ *                words of an inode now hold the indirect blocks and the flags. A file
+ *                using those three entries gets an indirect block holding them, taken
+ *                from the blocks no inode refers to; the others have the words cleared.
+ *                A file that finds no free block is cut to INODE_DIRECT_BLOCKS blocks.
+ *                An image with a checksum table comes from mkfs, which always used the
+ *                current layout, and is only marked.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the inodes and the boot block, use block_bitmap as scratch space
+ *
+ */
+static void layout_convert (void)
+{
+    uint32_t num_blocks = boot_block_ptr->num_data_blocks;
+    uint32_t i, j, n, free_block = 0;
+    uint32_t* old;
+    uint32_t* table;
+    boot_block_ptr->layout_magic = FS_LAYOUT_MAGIC;
+    fs_dirty(boot_block_ptr, BLOCK_SIZE);
+    if ((boot_block_ptr->csum_magic == FS_CSUM_MAGIC) || (num_blocks > FS_MAX_DATA_BLOCKS)) return;
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+    for (i = 0; i < boot_block_ptr->num_inodes; i++) {
+        old = (uint32_t*)(inode_ptr + i) + 1;                                                       // the block numbers follow the length
+        n = (inode_ptr[i].length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (j = 0; (j < n) && (j < FS_OLD_DIRECT_BLOCKS); j++) {
+            if (old[j] < num_blocks) block_bitmap[old[j] / 32] |= (1 << (old[j] % 32));
+        }
+    }
+    for (i = 0; i < boot_block_ptr->num_inodes; i++) {
+        old = (uint32_t*)(inode_ptr + i) + 1;
+        n = (inode_ptr[i].length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (n > FS_OLD_DIRECT_BLOCKS) n = FS_OLD_DIRECT_BLOCKS;
+        if (n > INODE_DIRECT_BLOCKS) {
+            while ((free_block < num_blocks) && (block_bitmap[free_block / 32] & (1 << (free_block % 32)))) free_block++;
+            if (free_block < num_blocks) {
+                block_bitmap[free_block / 32] |= (1 << (free_block % 32));
+                block_present[free_block / 32] |= (1 << (free_block % 32));                         // filled here, never read from the disk
+                table = (uint32_t*)(data_block_ptr + BLOCK_SIZE*free_block);
+                memset(table, 0, BLOCK_SIZE);
+                memcpy(table, &old[INODE_DIRECT_BLOCKS], (n - INODE_DIRECT_BLOCKS) * sizeof(uint32_t));
+                fs_dirty(table, BLOCK_SIZE);
+            } else {
+                printf("filesys: no free block to convert inode %d, cut to %d blocks\n", i, INODE_DIRECT_BLOCKS);
+                inode_ptr[i].length = INODE_DIRECT_BLOCKS * BLOCK_SIZE;
+            }
+        }
+        inode_ptr[i].indirect_block = (n > INODE_DIRECT_BLOCKS) && (free_block < num_blocks) ? free_block : 0;
+        inode_ptr[i].double_indirect_block = 0;
+        inode_ptr[i].flags = 0;
+        fs_dirty(inode_ptr + i, sizeof(inode_t));
+    }
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+}
 
 /**
  * filesys_init
@@ -16,22 +2181,299 @@ int inode_array[64];
  */
 void filesys_init (uint32_t filesys_addr)
 {
-    int i;
+    uint32_t i;
     boot_block_ptr = (boot_block_t*)filesys_addr;                                                   // cast filesys_addr to boot_block_t
     inode_ptr = (inode_t*) (boot_block_ptr + 1);                                                    // Pointing to the first inode block, 1 means the next block of boot block
     dentry_ptr = (dentry_t*) boot_block_ptr->dir_entries;                                           // Pointing to the first dentry
     data_block_ptr = (uint8_t*) (inode_ptr + boot_block_ptr->num_inodes);                           // Pointing to the first data block
-    memset(&inode_array[0], 0, sizeof(inode_array[0]));
-    for(i = 0; i < (boot_block_ptr->num_dir_entries); i++)
+    memset(inode_bitmap, 0, sizeof(inode_bitmap));
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+    memset(block_refcount, 0, sizeof(block_refcount));
+    block_alloc_cursor = 0;
+    block_map_cache.node = NULL;
+    if (!disk_attached) memset(block_present, 0xFF, sizeof(block_present));                        // GRUB loaded the whole image
+    if (disk_attached && (journal_start != 0)) journal_replay();                                    // before anything reads the metadata
+    if (boot_block_ptr->layout_magic != FS_LAYOUT_MAGIC) layout_convert();                          // a createfs image
+    block_csum_init();                                                                              // before anything reads a data block
+    inode_bitmap[0] |= 1;                                                                           // inode 0 is used by "." and rtc
+    memset(dcache, 0, sizeof(dcache));
+    memset(ecache, 0, sizeof(ecache));
+    memset(dir_free_head, 0, sizeof(dir_free_head));
+    for(i = 0; i < ZCACHE_SLOTS; i++) zcache[i].valid = 0;
+    for(i = 0; (i < (boot_block_ptr->num_dir_entries)) && (i < MAX_FILES_NUMBER); i++)
     {
-        inode_array[dentry_ptr[i].inode] = 1;                                                       // Set it to be busy status
+        if (dentry_ptr[i].file_name[0] == '\0') dir_free_link(FS_ROOT_INODE, i, &dentry_ptr[i]);  // Removed dentries can be reused
+        mark_dentry(&dentry_ptr[i], 0);                                                             // Files and subdirectory trees are busy
+    }
+    dentry_index_build();                                                                           // Index every filename once so lookups are O(1)
+}
+
+/**
+ * sync_in_place
+ *  DESCRIPTION : write dirty blocks to their places on the disk, adjacent blocks in one
+ *                transfer. With a journal that is file contents only, without one every
+ *                dirty block.
+ *  INPUTS : uint32_t num_blocks - blocks in the image
+ *           uint32_t skip - 1 if metadata is left to the journal, 0 to write it too
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - a write failed, its blocks are dirty again
+ *  SIDE EFFECTS : modify image_dirty, image_meta and image_meta_count, write to the disk
+ *
+ */
+static int32_t sync_in_place (uint32_t num_blocks, uint32_t skip)
+{
+    uint32_t i, j, start, bit;
+    int32_t ret = 0;
+    for (i = 0; i < num_blocks; ) {
+        bit = 1 << (i % 32);
+        if (!(image_dirty[i / 32] & bit) || (skip && (image_meta[i / 32] & bit))) {
+            i++;
+            continue;
+        }
+        for (start = i; i < num_blocks; i++) {
+            bit = 1 << (i % 32);
+            if (!(image_dirty[i / 32] & bit) || (skip && (image_meta[i / 32] & bit))) break;
+            if (__sync_fetch_and_and(&image_meta[i / 32], ~bit) & bit) __sync_fetch_and_sub(&image_meta_count, 1);
+            if (__sync_fetch_and_and(&image_dirty[i / 32], ~bit) & bit) {                          // a store during the write marks it again
+                __sync_fetch_and_sub(&image_dirty_count, 1);
+            }
+        }
+        if (ata_write(start * FS_SECTORS_PER_BLOCK, (i - start) * FS_SECTORS_PER_BLOCK, (uint8_t*)boot_block_ptr + BLOCK_SIZE*start) != 0) {
+            for (j = start; j < i; j++) fs_dirty_range((uint8_t*)boot_block_ptr + BLOCK_SIZE*j, BLOCK_SIZE, !skip);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * journal_commit
+ *  DESCRIPTION : commit the dirty metadata blocks as one transaction. They are copied
+ *                into journal_buf behind a descriptor and go to the journal in one
+ *                sequential write, whose checksum makes it all or nothing. Then they are
+ *                written to their places in the image from the copies, and the journal is
+ *                cleared so it is never replayed over later writes. fs_op_begin keeps
+ *                the metadata of the operations since the last commit within one
+ *                transaction; should a single operation still change more, it cannot be
+ *                made atomic and is written in place like without a journal, after the
+ *                journal is cleared. The sync may run in a process that is preempted
+ *                while it copies; when an operation started meanwhile the copies are
+ *                dropped and the blocks stay dirty.
+ *  INPUTS : uint32_t num_blocks - blocks in the image
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - success
+ *                 -1 - a write failed or an operation ran during the copy, the blocks not
+ *                      committed are dirty again
+ *  SIDE EFFECTS : modify image_dirty, image_meta, image_meta_count, block_freed and
+ *                 journal_sequence, write to the disk
+ *
+ */
+static int32_t journal_commit (uint32_t num_blocks)
+{
+    journal_desc_t* desc = (journal_desc_t*)journal_buf;
+    uint32_t i, j, bit, count, gen, torn;
+    int32_t ret = 0;
+    for (i = 0; i < FS_MAX_DATA_BLOCKS / 32; i++) block_committing[i] = __sync_fetch_and_and(&block_freed[i], 0);
+    if (image_meta_count > FS_JOURNAL_BLOCKS - 1) {
+        printf("filesys: %d metadata blocks do not fit in the journal, writing them in place\n", image_meta_count);
+        ret = (journal_clear() == 0) ? sync_in_place(num_blocks, 0) : -1;                           // an older transaction must not be replayed over them
+    } else {
+        crc32c_init();
+        gen = fs_op_gen;
+        torn = (fs_op_depth != 0);                                                                  // an operation that began after this read changes gen
+        for (i = 0, count = 0; !torn && (i < num_blocks) && (count < FS_JOURNAL_BLOCKS - 1); i++) {
+            bit = 1 << (i % 32);
+            if (!(image_dirty[i / 32] & bit) || !(image_meta[i / 32] & bit)) continue;
+            if (__sync_fetch_and_and(&image_meta[i / 32], ~bit) & bit) __sync_fetch_and_sub(&image_meta_count, 1);
+            if (__sync_fetch_and_and(&image_dirty[i / 32], ~bit) & bit) __sync_fetch_and_sub(&image_dirty_count, 1);
+            desc->blocks[count] = i;
+            memcpy(journal_buf + BLOCK_SIZE*(1 + count), (uint8_t*)boot_block_ptr + BLOCK_SIZE*i, BLOCK_SIZE);
+            count++;
+        }
+        if (torn || (fs_op_gen != gen)) {
+            ret = -1;                                                                               // commit the operation whole next time
+        } else if (count > 0) {
+            desc->magic = FS_JOURNAL_MAGIC;
+            desc->sequence = journal_sequence + 1;
+            desc->count = count;
+            desc->csum = journal_csum(desc);
+            if (ata_write(journal_start * FS_SECTORS_PER_BLOCK, (1 + count) * FS_SECTORS_PER_BLOCK, journal_buf) != 0) {
+                ret = -1;
+            } else {
+                journal_sequence++;                                                                 // committed, the checkpoint can be redone from the journal
+                if ((journal_checkpoint(desc) != 0) || (journal_clear() != 0)) ret = -1;            // a failed clear commits the blocks again
+            }
+        }
+        if (ret == -1) {
+            for (j = 0; j < count; j++) fs_dirty((uint8_t*)boot_block_ptr + BLOCK_SIZE*desc->blocks[j], BLOCK_SIZE);
+        }
+    }
+    if (ret == -1) {
+        for (j = 0; j < FS_MAX_DATA_BLOCKS / 32; j++) __sync_fetch_and_or(&block_freed[j], block_committing[j]);
+    }
+    memset(block_committing, 0, sizeof(block_committing));                                          // the frees are on the disk, the blocks can be reused in place
+    return ret;
+}
+
+/**
+ * fs_sync
+ *  DESCRIPTION : write every block of the image changed since the last sync to the disk.
+ *                The checksum of each rewritten data block is updated first. File
+ *                contents go first, in place, then the metadata that may point at them
+ *                is committed through the journal as one transaction, so a crash leaves
+ *                either the old or the new metadata on the disk. Without room for a
+ *                journal every block is written in place. Only one sync runs at a time,
+ *                and none while an operation is half done.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the disk matches the image (or there is no disk)
+ *                 -1 - a write failed, another sync is running or an operation is not
+ *                      finished, the blocks left dirty go out with the next sync
+ *  SIDE EFFECTS : modify image_dirty and the checksum table, write to the disk
+ *
+ */
+int32_t fs_sync (void)
+{
+    uint32_t data_start = 1 + boot_block_ptr->num_inodes;                                           // image block of data block 0
+    uint32_t num_blocks = data_start + boot_block_ptr->num_data_blocks;
+    uint32_t csum_blocks = (boot_block_ptr->num_data_blocks + BLOCK_PTRS - 1) / BLOCK_PTRS;
+    uint32_t i, block;
+    int32_t ret;
+    if (!disk_attached || (image_dirty_count == 0)) return 0;
+    if (__sync_lock_test_and_set(&fs_syncing, 1)) return -1;                                        // a preempted process or the flusher is at it
+    if (fs_op_depth != 0) {
+        __sync_lock_release(&fs_syncing);
+        return -1;                                                                                  // commit the operation whole next time
+    }
+
+    if (block_csum != NULL) {
+        for (i = data_start; i < num_blocks; i++) {
+            if (!(image_dirty[i / 32] & (1 << (i % 32)))) continue;
+            block = i - data_start;
+            if ((block >= boot_block_ptr->csum_block) && (block < boot_block_ptr->csum_block + csum_blocks)) continue;   // the table does not cover itself
+            block_csum[block] = crc32c(0, data_block_ptr + BLOCK_SIZE*block, BLOCK_SIZE);
+            fs_dirty(block_csum + block, sizeof(uint32_t));
+        }
+    }
+
+    ret = sync_in_place(num_blocks, journal_start != 0);
+    if ((ret == 0) && (journal_start != 0)) ret = journal_commit(num_blocks);                      // never commit metadata ahead of its data
+    __sync_lock_release(&fs_syncing);
+    return ret;
+}
+
+/**
+ * fs_flush_tick
+ *  DESCRIPTION : the write-back timer, called on every PIT tick. Every FS_FLUSH_TICKS
+ *                ticks it asks fs_flush for a write-back; the disk is not touched from
+ *                the interrupt handler.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify fs_flush_due
+ *
+ */
+void fs_flush_tick (void)
+{
+    if (++fs_flush_ticks < FS_FLUSH_TICKS) return;
+    fs_flush_ticks = 0;
+    fs_flush_due = 1;
+}
+
+/**
+ * fs_flush
+ *  DESCRIPTION : the write-back flusher, run in process context with interrupts on, on
+ *                the way out of every system call and while a process waits for input.
+ *                Once fs_flush_tick asked for it the blocks dirtied since the last flush
+ *                go to the disk together, so a burst of writes costs one sync instead of
+ *                one per call and all metadata updates of the interval share one journal
+ *                write. A flush that finds a sync or an unfinished operation is retried
+ *                on the next call.
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : may write to the disk
+ *
+ */
+void fs_flush (void)
+{
+    if (!fs_flush_due || fs_syncing || (fs_op_depth != 0)) return;                                  // try again on the next call
+    fs_flush_due = 0;
+    if (!disk_attached || (image_dirty_count == 0)) return;
+    fs_sync();
+}
+
+/**
+ * fs_disk_attach
+ *  DESCRIPTION : back the image with the ATA disk. A disk holding a filesystem replaces
+ *                the image loaded by GRUB, so changes made in earlier runs come back;
+ *                any other disk is formatted with the GRUB image. Only the boot block
+ *                and the inodes are read here, data blocks follow on first use. The
+ *                journal takes FS_JOURNAL_BLOCKS blocks after the image when the disk
+ *                has room for them. From then on fs_flush_tick keeps the disk up to
+ *                date. Called once, after filesys_init.
+ *  INPUTS : uint32_t mem_end - end of the memory the image may grow into
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the disk is attached
+ *                 -1 - no disk, or the disk or memory is too small, the image stays in memory only
+ *  SIDE EFFECTS : may replace the image and reinitialize the filesystem, write to the disk
+ *
+ */
+int32_t fs_disk_attach (uint32_t mem_end)
+{
+    uint8_t sector[ATA_SECTOR_SIZE];
+    boot_block_t* disk_boot = (boot_block_t*)sector;                                                // the counts come first, one sector holds them
+    uint32_t disk_sectors = ata_sectors();
+    uint32_t mem_size = mem_end - (uint32_t)boot_block_ptr;
+    uint32_t size, image_blocks;
+    if (disk_sectors == 0) return -1;
+    if (ata_read(0, 1, sector) != 0) return -1;
+
+    size = (1 + disk_boot->num_inodes + disk_boot->num_data_blocks) * BLOCK_SIZE;
+    if ((disk_boot->num_inodes > 0) && (disk_boot->num_inodes <= FS_MAX_INODES) &&
+        (disk_boot->num_data_blocks <= FS_MAX_DATA_BLOCKS) && (disk_boot->num_dir_entries <= MAX_FILES_NUMBER) &&
+        (disk_boot->dir_entries[0].file_name[0] == '.') && (disk_boot->dir_entries[0].file_name[1] == '\0') &&
+        (size / ATA_SECTOR_SIZE <= disk_sectors)) {
+        if (size > mem_size) {
+            printf("filesys: the disk image does not fit in memory\n");
+            return -1;
+        }
+        if (ata_read(0, (1 + disk_boot->num_inodes) * FS_SECTORS_PER_BLOCK, boot_block_ptr) != 0) {
+            printf("filesys: reading the disk failed\n");                                          // the GRUB image is partly overwritten
+            return -1;
+        }
+        image_blocks = size / BLOCK_SIZE;
+        journal_start = ((image_blocks + FS_JOURNAL_BLOCKS) * FS_SECTORS_PER_BLOCK <= disk_sectors) ? image_blocks : 0;
+        disk_attached = 1;
+        memset(block_present, 0, sizeof(block_present));                                           // data blocks are read on first use
+        readahead_next = 0;
+        readahead_window = 0;
+        filesys_init((uint32_t)boot_block_ptr);                                                     // replays the journal
+    } else {
+        size = (1 + boot_block_ptr->num_inodes + boot_block_ptr->num_data_blocks) * BLOCK_SIZE;
+        if ((size / ATA_SECTOR_SIZE > disk_sectors) || (ata_write(0, size / ATA_SECTOR_SIZE, boot_block_ptr) != 0)) {
+            printf("filesys: formatting the disk failed\n");
+            return -1;
+        }
+        image_blocks = size / BLOCK_SIZE;
+        journal_start = ((image_blocks + FS_JOURNAL_BLOCKS) * FS_SECTORS_PER_BLOCK <= disk_sectors) ? image_blocks : 0;
+        if ((journal_start != 0) && (journal_clear() != 0)) journal_start = 0;                      // a journal left on the disk must never be replayed
+        disk_attached = 1;
     }
+    if (journal_start == 0) printf("filesys: no room for a journal, metadata is written in place\n");
+    memset(image_dirty, 0, sizeof(image_dirty));
+    memset(image_meta, 0, sizeof(image_meta));
+    image_meta_count = 0;
+    image_dirty_count = 0;
+    return 0;
 }
 
 /**
  * read_dentry_by_name
  *  DESCRIPTION : read the corresponding file dentry to the given
- *                dentry based on the given filename
+ *                dentry based on the given filename. The filename may be a
+ *                '/' separated path starting from the root directory.
  *  INPUTS : const uint8_t* fname - given filename
  *           dentry_t* dentry - given dentry
  *  OUTPUTS : none
@@ -42,24 +2484,7 @@ void filesys_init (uint32_t filesys_addr)
  */
 int32_t read_dentry_by_name (const uint8_t* fname, dentry_t* dentry)
 {
-    /* non-existent file */
-    uint32_t name_len = strlen((char *)fname);
-
-    if(fname == NULL) return -1;                                                                    // If the filename is NULL, return -1
-
-    if (name_len > MAX_FILENAME_LEN) return -1;                                                                   // If the filename length is out of range, return -1
-
-    int i;
-    for(i = 0; i < (boot_block_ptr->num_dir_entries); i++){                                         // Traverse the dentries
-        dentry_t* cur_dentry = &(dentry_ptr[i]);
-        uint32_t dentry_len = strlen((int8_t*)(cur_dentry->file_name));
-        if(dentry_len > MAX_FILENAME_LEN) dentry_len = MAX_FILENAME_LEN;
-        if((name_len == dentry_len) && (!strncmp((int8_t*)fname, (int8_t*)(cur_dentry->file_name), name_len))){      // If we find the corresponding file, call read_dentry_by_index to write to the buffer
-            read_dentry_by_index(i, dentry);
-            return 0;                                                                               // Successfully find the file: return 0
-        }
-    }
-    return -1;                                                                                      // Cannot find the corresponding file after traversing: return -1
+    return path_lookup(FS_ROOT_INODE, fname, dentry);                                               // Hashed and cached, no walk over every dentry
 }
 
 /**
@@ -86,11 +2511,196 @@ int32_t read_dentry_by_index (uint32_t index, dentry_t* dentry)
     return 0;
 }
 
+/**
+ * inode_raw_ptr
+ *  DESCRIPTION : get a direct pointer to a range of the stored data of a file when
+ *                the range lies in physically adjacent data blocks
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t offset - the offset in the stored data
+ *           uint32_t length - the size of the range
+ *  OUTPUTS : none
+ *  RETURN VALUE : pointer to the range
+ *                 NULL - the range is scattered, the block map is bad or a block is corrupt
+ *  SIDE EFFECTS : none
+ *
+ */
+static const uint8_t* inode_raw_ptr (inode_t* node, uint32_t offset, uint32_t length)
+{
+    uint32_t block_idx = offset / BLOCK_SIZE;
+    uint32_t last_idx = (offset + length - 1) / BLOCK_SIZE;
+    uint32_t i;
+    int32_t D = inode_get_block(node, block_idx);
+    if ((D == -1) || (D >= boot_block_ptr->num_data_blocks)) return NULL;
+    for (i = 1; block_idx + i <= last_idx; i++) {
+        if (inode_get_block(node, block_idx + i) != D + i) return NULL;
+    }
+    if (D + i > boot_block_ptr->num_data_blocks) return NULL;
+    for (i = 0; block_idx + i <= last_idx; i++) {
+        if (block_check(D + i) != 0) return NULL;
+    }
+    return data_block_ptr + BLOCK_SIZE*D + offset % BLOCK_SIZE;
+}
+
+/**
+ * zblock_decode
+ *  DESCRIPTION : decompress block idx of a compressed file. The stored data starts with
+ *                an offset table of (blocks + 1) words, block i occupies the bytes
+ *                [table[i], table[i+1]) of the stored data. A block whose stored size
+ *                equals its decompressed size is kept uncompressed.
+ *  INPUTS : inode_t* node - the inode of the file
+ *           uint32_t idx - block index within the decompressed file
+ *           uint8_t* dst - BLOCK_SIZE bytes to decompress to
+ *  OUTPUTS : the block in dst
+ *  RETURN VALUE : the number of bytes decompressed
+ *                 -1 - idx is past the end of the file or the block is corrupt
+ *  SIDE EFFECTS : may overwrite zcache_stage
+ *
+ */
+static int32_t zblock_decode (inode_t* node, uint32_t idx, uint8_t* dst)
+{
+    uint32_t extent[2];
+    uint32_t raw_len, size;
+    const uint8_t* src;
+    if (idx >= (node->length + BLOCK_SIZE - 1) / BLOCK_SIZE) return -1;
+    raw_len = node->length - idx * BLOCK_SIZE;
+    if (raw_len > BLOCK_SIZE) raw_len = BLOCK_SIZE;
+
+    if (inode_read_raw(node, idx * sizeof(uint32_t), (uint8_t*)extent, sizeof(extent)) != sizeof(extent)) return -1;
+    if ((extent[1] <= extent[0]) || (extent[1] - extent[0] > raw_len)) return -1;               // never larger than the block itself
+    size = extent[1] - extent[0];
+
+    src = inode_raw_ptr(node, extent[0], size);
+    if (src == NULL) {
+        if (inode_read_raw(node, extent[0], zcache_stage, size) != size) return -1;
+        src = zcache_stage;
+    }
+    if (size == raw_len) {
+        memcpy(dst, src, raw_len);                                                                  // stored uncompressed
+        return raw_len;
+    }
+    if (lz4_decode_block(src, size, dst, raw_len) != raw_len) return -1;
+    return raw_len;
+}
+
+/**
+ * zcache_lookup
+ *  DESCRIPTION : find a decompressed block in the LRU cache
+ *  INPUTS : uint32_t inode - the inode number of the file
+ *           uint32_t idx - block index within the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the decompressed data
+ *                 NULL - the block is not cached
+ *  SIDE EFFECTS : mark the slot most recently used
+ *
+ */
+static uint8_t* zcache_lookup (uint32_t inode, uint32_t idx)
+{
+    uint32_t i;
+    for (i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache[i].valid && (zcache[i].inode == inode) && (zcache[i].block_idx == idx)) {
+            zcache[i].last_use = ++zcache_clock;
+            return zcache[i].data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * zcache_fill
+ *  DESCRIPTION : decompress a block into the least recently used cache slot
+ *  INPUTS : uint32_t inode - the inode number of the file
+ *           uint32_t idx - block index within the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the decompressed data
+ *                 NULL - the block is corrupt
+ *  SIDE EFFECTS : evict a slot
+ *
+ */
+static uint8_t* zcache_fill (uint32_t inode, uint32_t idx)
+{
+    uint32_t i, victim = 0;
+    for (i = 0; i < ZCACHE_SLOTS; i++) {
+        if (!zcache[i].valid) {
+            victim = i;
+            break;
+        }
+        if (zcache[i].last_use < zcache[victim].last_use) victim = i;
+    }
+    zcache[victim].valid = 0;
+    if (-1 == zblock_decode(inode_ptr + inode, idx, zcache[victim].data)) return NULL;
+    zcache[victim].valid = 1;
+    zcache[victim].inode = inode;
+    zcache[victim].block_idx = idx;
+    zcache[victim].last_use = ++zcache_clock;
+    return zcache[victim].data;
+}
+
+/**
+ * zcache_invalidate
+ *  DESCRIPTION : drop every decompressed block cached for a file, called whenever
+ *                the inode is freed or overwritten
+ *  INPUTS : uint32_t inode - the inode number of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify zcache
+ *
+ */
+void zcache_invalidate (uint32_t inode)
+{
+    uint32_t i;
+    for (i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zcache[i].inode == inode) zcache[i].valid = 0;
+    }
+}
+
+/**
+ * read_compressed
+ *  DESCRIPTION : read a range of a compressed file block by block. Whole blocks that
+ *                are not cached are decompressed straight into buf, partial blocks go
+ *                through the LRU cache so small sequential reads decompress once.
+ *  INPUTS : uint32_t inode - the inode number of the file
+ *           uint32_t offset - the offset in the file
+ *           uint8_t* buf - the buffer to copy to
+ *           uint32_t length - the number of bytes, within the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes copied
+ *                 -1 - a block is corrupt
+ *  SIDE EFFECTS : modify zcache
+ *
+ */
+static int32_t read_compressed (uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t length)
+{
+    inode_t* node = inode_ptr + inode;
+    uint32_t block_idx = offset / BLOCK_SIZE;
+    uint32_t block_offset = offset % BLOCK_SIZE;
+    uint32_t bytes_copied = 0;
+    while (length > 0) {
+        uint32_t block_len = node->length - block_idx * BLOCK_SIZE;
+        if (block_len > BLOCK_SIZE) block_len = BLOCK_SIZE;
+        uint32_t chunk = block_len - block_offset;
+        if (chunk > length) chunk = length;
+
+        uint8_t* data = zcache_lookup(inode, block_idx);
+        if ((data == NULL) && (block_offset == 0) && (chunk == block_len)) {
+            if (-1 == zblock_decode(node, block_idx, buf)) return -1;                              // whole block, skip the cache
+        } else {
+            if ((data == NULL) && (NULL == (data = zcache_fill(inode, block_idx)))) return -1;
+            memcpy(buf, data + block_offset, chunk);
+        }
+        buf += chunk;
+        bytes_copied += chunk;
+        length -= chunk;
+        block_idx++;
+        block_offset = 0;
+    }
+    return bytes_copied;
+}
+
 /* read up to "length" bytes starting from position "offset" in the file with number inode*/
 /**
  * read_data
  *  DESCRIPTION : read the data with "length" into buffer based on "inode"
-                  and "offset" in that file 
+                  and "offset" in that file, straight from the inode for inline files
  *  INPUTS : uint32_t inode - given inode: find the index node
              uint32_t offset - the offset in the file
              uint8_t* buf - the buffer we want to write data to
@@ -115,38 +2725,155 @@ int32_t read_data (uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t lengt
     /* tricky length */
     if (length == 0) return 0;                                                               // if reading 0 bytes                 
 
-    uint32_t start_block_idx = offset / BLOCK_SIZE;                                          // each data block takes 4kB
-    uint32_t start_block_offset = offset % BLOCK_SIZE;                                       // offset in given data block
-    uint32_t bytes_copied = 0;                                                               // holding total bytes being copied
+    /* inline file: the data sits right in the inode */
+    if (target_inode->flags & INODE_FLAG_INLINE) {
+        if (offset + length > INODE_INLINE_MAX) return -1;                                   // corrupt length
+        memcpy(buf, inode_inline_data(target_inode) + offset, length);
+        return length;
+    }
 
-    uint32_t D = target_inode->data_blocks[start_block_idx];                                 // index within data block array
-    
-    /* The start address of reading*/
-    uint8_t* read_ptr = data_block_ptr + BLOCK_SIZE*D + start_block_offset;                  // start reading data from this address
-    uint32_t left_len = BLOCK_SIZE - start_block_offset;                                     // how many bytes still need to copy in given data block
+    if (target_inode->flags & INODE_FLAG_COMPRESSED) return read_compressed(inode, offset, buf, length);
+    return inode_read_raw(target_inode, offset, buf, length);
+}
 
-    while (length > left_len) {
+/**
+ * inode_write
+ *  DESCRIPTION : write "length" bytes from buffer into the file with number "inode"
+ *                starting at "offset". Blocks past the end of the file are allocated
+ *                (zero filled) right after the previous block when possible. An inline
+ *                file is written in place until it outgrows the inode. A block shared
+ *                with another file is copied first, the other file keeps the original.
+ *  INPUTS : uint32_t inode - given inode: find the index node
+ *           uint32_t offset - the offset in the file
+ *           const uint8_t* buf - the buffer we want to read data from
+ *           uint32_t length - the length of the data we want to write
+ *           uint32_t meta - 1 for a directory, its blocks go through the journal
+ *  OUTPUTS : none
+ *  RETURN VALUE : bytes_written - the number of bytes written to the file
+ *                 -1 - fail to write data (bad inode, compressed file or no space left)
+ *  SIDE EFFECTS : modify the inode and its data blocks, allocate data blocks
+ *
+ */
+static int32_t inode_write (uint32_t inode, uint32_t offset, const uint8_t* buf, uint32_t length, uint32_t meta)
+{
+    /* invalid inode number, inode 0 belongs to "." and rtc */
+    if ((inode == 0) || (inode >= boot_block_ptr->num_inodes)) return -1;
+    if (buf == NULL) return -1;
+    if (length == 0) return 0;
 
-        length -= left_len;                                                                  // update length
-        memcpy(buf, read_ptr, left_len);                                                     // copy left bytes into buf
-        buf += left_len;                                                                     // update buf pointer
-        bytes_copied += left_len;                                                            // accumulate copied bytes
-        
-        start_block_idx++;                                                                   // update index to data block
-        D = target_inode->data_blocks[start_block_idx];                                      // update D
-        read_ptr = data_block_ptr + BLOCK_SIZE*D;                                            // update read_ptr
-        left_len = BLOCK_SIZE;
+    inode_t* target_inode = inode_ptr + inode;
+    if (target_inode->flags & INODE_FLAG_COMPRESSED) return -1;                              // compressed files are read only
+    ecache_invalidate(inode);                                                                // the header or the length may change
+    if (offset / BLOCK_SIZE >= INODE_MAX_BLOCKS) return -1;                                  // no room for even one byte
+    if (length > 0xFFFFFFFF - offset) length = 0xFFFFFFFF - offset;                          // keep the end inside 32 bits
+    uint32_t end = offset + length;
 
+    /* inline file: write in place while it fits, otherwise move the data into a block first */
+    if (target_inode->flags & INODE_FLAG_INLINE) {
+        if (end <= INODE_INLINE_MAX) {
+            if (offset > target_inode->length) {
+                memset(inode_inline_data(target_inode) + target_inode->length, 0, offset - target_inode->length);
+            }
+            memcpy(inode_inline_data(target_inode) + offset, buf, length);
+            if (end > target_inode->length) target_inode->length = end;
+            fs_dirty(target_inode, sizeof(inode_t));
+            return length;
+        }
+        if (-1 == inode_spill_inline(target_inode, (end + BLOCK_SIZE - 1) / BLOCK_SIZE, meta)) return -1;
     }
 
-    /* last block of data to read */
-    memcpy(buf, read_ptr, length);                                          
-    buf += length;
-    bytes_copied += length;                                                                  // length is less than BLOCK_SIZE
+    /* allocate the blocks between the current end of file and the end of this write */
+    uint32_t old_blocks = (target_inode->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t have = old_blocks;
+    uint32_t need = (end / BLOCK_SIZE) + ((end % BLOCK_SIZE) ? 1 : 0);
+    if (need > INODE_MAX_BLOCKS) need = INODE_MAX_BLOCKS;
+    while (have < need) {
+        uint32_t hint = (have > 0) ? inode_get_block(target_inode, have - 1) + 1 : block_alloc_cursor;
+        int32_t block = alloc_data_block(hint, need - have);
+        if (block == -1) break;                                                              // out of space
+        memset(data_block_ptr + BLOCK_SIZE*block, 0, BLOCK_SIZE);
+        fs_dirty_range(data_block_ptr + BLOCK_SIZE*block, BLOCK_SIZE, meta);
+        if (-1 == inode_append_block(target_inode, have, block)) {
+            free_data_block(block);                                                          // no room for its indirect block
+            break;
+        }
+        have++;
+    }
+    if (have < need) {
+        if (have * BLOCK_SIZE <= offset) {
+            inode_free_blocks(target_inode, old_blocks, have);                               // nothing can be written, roll back
+            return -1;
+        }
+        end = have * BLOCK_SIZE;                                                             // write as much as fits
+        length = end - offset;
+    }
 
-    return bytes_copied;
+    uint32_t block_idx = offset / BLOCK_SIZE;
+    uint32_t block_offset = offset % BLOCK_SIZE;
+    uint32_t bytes_written = 0;
+    while (length > 0) {
+        uint32_t chunk = BLOCK_SIZE - block_offset;
+        if (chunk > length) chunk = length;
+        uint32_t* slot = inode_block_slot_private(target_inode, block_idx, have);
+        if (slot == NULL) break;                                                             // bad block map or no room to copy a shared table
+        if (block_is_shared(*slot) && (-1 == block_unshare(slot, meta))) break;             // no block left for a private copy
+        if (block_check(*slot) != 0) break;                                                  // keep a corrupt block from being trusted after the write
+        memcpy(data_block_ptr + BLOCK_SIZE*(*slot) + block_offset, buf, chunk);
+        fs_dirty_range(data_block_ptr + BLOCK_SIZE*(*slot) + block_offset, chunk, meta);
+        buf += chunk;
+        bytes_written += chunk;
+        length -= chunk;
+        block_idx++;
+        block_offset = 0;
+    }
 
+    if (length > 0) {
+        end = offset + bytes_written;                                                        // stopped early, drop the new blocks past the data written
+        uint32_t keep = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (keep < old_blocks) keep = old_blocks;
+        inode_free_blocks(target_inode, keep, have);
+        if (bytes_written == 0) return -1;
+    }
+    if (end > target_inode->length) {
+        target_inode->length = end;                                                          // appending grows the file
+        fs_dirty(target_inode, sizeof(inode_t));
+    }
+    return bytes_written;
+}
 
+/**
+ * write_data
+ *  DESCRIPTION : write "length" bytes from buffer into the regular file with number
+ *                "inode" starting at "offset", see inode_write. A long write is made of
+ *                operations of at most FS_WRITE_OP_BLOCKS blocks, so its metadata can
+ *                be committed in between and a crash keeps a prefix of it.
+ *  INPUTS : uint32_t inode - given inode: find the index node
+ *           uint32_t offset - the offset in the file
+ *           const uint8_t* buf - the buffer we want to read data from
+ *           uint32_t length - the length of the data we want to write
+ *  OUTPUTS : none
+ *  RETURN VALUE : bytes_written - the number of bytes written to the file
+ *                 -1 - fail to write data (bad inode, compressed file or no space left)
+ *  SIDE EFFECTS : modify the inode and its data blocks, allocate data blocks
+ *
+ */
+int32_t write_data (uint32_t inode, uint32_t offset, const uint8_t* buf, uint32_t length)
+{
+    int32_t ret, total = 0;
+    uint32_t chunk;
+    do {
+        chunk = FS_WRITE_OP_BLOCKS*BLOCK_SIZE - offset % (FS_WRITE_OP_BLOCKS*BLOCK_SIZE);           // up to the next boundary, the blocks of one operation
+        if (chunk > length) chunk = length;
+        fs_op_begin();
+        ret = inode_write(inode, offset, buf, chunk, 0);
+        fs_op_end();
+        if (ret <= 0) break;
+        total += ret;
+        offset += ret;
+        buf += ret;
+        length -= ret;
+    } while ((length > 0) && ((uint32_t)ret == chunk));                                             // a short write ran out of space
+    return (total > 0) ? total : ret;
 }
 
 /**
@@ -163,28 +2890,104 @@ int32_t read_data (uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t lengt
  */
 int32_t file_read (int32_t fd, void* buf, int32_t nbytes)                                               
 {
-    pcb_t* cur_pcb_ptr = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));
-    file_desc_t file_desc = cur_pcb_ptr->file_array[fd];
-    
-    int32_t bytes_copied = read_data(file_desc.inode, file_desc.file_position, buf, nbytes);                                                       // fd refers to inode index here, 0 means read from the start of file. **for cp2 only**
-    cur_pcb_ptr->file_array[fd].file_position += bytes_copied;
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (nbytes < 0) || (buf == NULL)) return -1;
+
+    int32_t bytes_copied = read_data(file_desc->inode, file_desc->file_position, buf, nbytes);                                                       // fd refers to inode index here, 0 means read from the start of file. **for cp2 only**
+    if (bytes_copied > 0) file_desc->file_position += bytes_copied;                           // a failed read must not move the position back
     return bytes_copied;
 }
 
 /**
- * file_write
- *  DESCRIPTION : do nothing and return -1
+ * file_pread
+ *  DESCRIPTION : load n bytes data starting at the given offset, leaving the file position alone
  *  INPUTS : int32_t fd - file descriptor
              void* buf - the buffer that we are going to write to
+             int32_t nbytes - the number of bytes that need to read
+             uint32_t offset - where to start reading
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes read, 0 at or past the end of the file
+                   -1 - bad arguments
+ *  SIDE EFFECTS : none
+ *
+ */
+int32_t file_pread (int32_t fd, void* buf, int32_t nbytes, uint32_t offset)
+{
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (nbytes < 0) || (buf == NULL)) return -1;
+    return read_data(file_desc->inode, offset, buf, nbytes);
+}
+
+/**
+ * file_pwrite
+ *  DESCRIPTION : write n bytes from the given buffer starting at the given offset,
+ *                leaving the file position alone
+ *  INPUTS : int32_t fd - file descriptor
+             void* buf - the buffer that we are going to read from
              int32_t nbytes - the number of bytes that need to write
+             uint32_t offset - where to start writing, past the end grows the file
  *  OUTPUTS : none
- *  RETURN VALUE : -1 - always (for read-only)
+ *  RETURN VALUE : the number of bytes written
+ *                 -1 - fail to write (bad arguments or no space left)
  *  SIDE EFFECTS : none
+ *
+ */
+int32_t file_pwrite (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset)
+{
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (nbytes < 0) || (buf == NULL)) return -1;
+    return write_data(file_desc->inode, offset, buf, nbytes);
+}
+
+/**
+ * file_lseek
+ *  DESCRIPTION : move the file position. It may go past the end of the file, a write
+ *                there fills the gap with zeros.
+ *  INPUTS : int32_t fd - file descriptor
+             int32_t offset - where to move, relative to whence
+             int32_t whence - SEEK_SET, SEEK_CUR or SEEK_END
+ *  OUTPUTS : none
+ *  RETURN VALUE : the new file position
+ *                 -1 - bad whence, or the position would be negative or above 2GB
+ *  SIDE EFFECTS : modify the file position
+ *
+ */
+int32_t file_lseek (int32_t fd, int32_t offset, int32_t whence)
+{
+    file_desc_t* file_desc = fd_lookup(fd);
+    uint32_t base;
+    if (file_desc == NULL) return -1;
+    if (whence == SEEK_SET) base = 0;
+    else if (whence == SEEK_CUR) base = file_desc->file_position;
+    else if (whence == SEEK_END) base = inode_ptr[file_desc->inode].length;
+    else return -1;
+    if ((offset < 0) && (0 - (uint32_t)offset > base)) return -1;                                  // before the start of the file
+    if ((offset > 0) && ((uint32_t)offset > 0x7FFFFFFF - base)) return -1;                        // the result must fit the return value
+    file_desc->file_position = base + offset;
+    return file_desc->file_position;
+}
+
+/**
+ * file_write
+ *  DESCRIPTION : write n bytes from the given buffer into the file at the current
+ *                file position, overwriting in place and appending past the end
+ *  INPUTS : int32_t fd - file descriptor
+             void* buf - the buffer that we are going to read from
+             int32_t nbytes - the number of bytes that need to write
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes written
+ *                 -1 - fail to write (bad arguments or no space left)
+ *  SIDE EFFECTS : advance the file position
  * 
  */
 int32_t file_write(int32_t fd, const void* buf, int32_t nbytes)
 {
-    return -1;                                                                                  // always return -1(read only)
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (nbytes < 0) || (buf == NULL)) return -1;
+
+    int32_t bytes_written = write_data(file_desc->inode, file_desc->file_position, buf, nbytes);
+    if (bytes_written > 0) file_desc->file_position += bytes_written;                          // next write continues after this one
+    return bytes_written;
 }
 
 /**
@@ -217,6 +3020,41 @@ int32_t file_close (int32_t fd)
     return 0;                                                                                  // Always return 0
 }
 
+/**
+ * dir_next
+ *  DESCRIPTION : fetch the dentry at the position of an open directory and move past it,
+ *                skipping removed dentries
+ *  INPUTS : file_desc_t* file_desc - the open directory
+ *           dentry_t* dentry - the dentry to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 1 - a dentry was read
+ *                 0 - the end of the directory was reached
+ *                 -1 - the directory could not be read
+ *  SIDE EFFECTS : advance the file position
+ *
+ */
+static int32_t dir_next (file_desc_t* file_desc, dentry_t* dentry)
+{
+    int ret;
+    do {
+        if (file_desc->inode != FS_ROOT_INODE) {
+            /* subdirectory: dentries live in its data blocks */
+            if (file_desc->file_position >= inode_ptr[file_desc->inode].length / sizeof(dentry_t)) return 0;
+            ret = read_data(file_desc->inode, file_desc->file_position * sizeof(dentry_t), (uint8_t*)dentry, sizeof(dentry_t));
+            if (ret != sizeof(dentry_t)) return -1;
+        } else {
+            /* subsequent reads until the last is reached, at which point read should repeatedly return 0.*/
+            if ((file_desc->file_position >= boot_block_ptr->num_dir_entries) || (file_desc->file_position >= MAX_FILES_NUMBER)){
+                return 0;
+            }
+            ret = read_dentry_by_index(file_desc->file_position, dentry);
+            if (ret == -1) return -1;
+        }
+        file_desc->file_position += 1;
+    } while (dentry->file_name[0] == '\0');                                                      // skip removed dentries
+    return 1;
+}
+
 /**
  * dir_read
  *  DESCRIPTION : load n bytes data to the given buffer based on given fd
@@ -232,52 +3070,75 @@ int32_t file_close (int32_t fd)
 int32_t dir_read (int32_t fd, void* buf, int32_t nbytes)
 {
     int ret;
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));
+    file_desc_t* file_desc = fd_lookup(fd);
     dentry_t dentry;
-    /* subsequent reads until the last is reached, at which point read should repeatedly return 0.*/
-    if ((cur_pcb->file_array[fd].file_position == boot_block_ptr->num_dir_entries) || (cur_pcb->file_array[fd].file_position == MAX_FILES_NUMBER)){
-        return 0;
-    }
-    ret = read_dentry_by_index(cur_pcb->file_array[fd].file_position, &dentry);
-    if (ret == -1) return -1;                                                 
-    cur_pcb->file_array[fd].file_position += 1;
-    uint32_t len = MAX_FILENAME_LEN;
-    if(strlen((const int8_t*)dentry.file_name) < len) len = strlen((const int8_t*)dentry.file_name);
+    if (file_desc == NULL) return -1;
+    ret = dir_next(file_desc, &dentry);
+    if (ret != 1) return ret;                                                                   // 0 at the end, -1 on a bad directory
+    uint32_t len = fs_name_len(dentry.file_name);
+    if (len > MAX_FILENAME_LEN) len = MAX_FILENAME_LEN;
     strncpy((int8_t*)buf, (int8_t*)dentry.file_name, len);
     return len;
 }
 
+/**
+ * dir_getdents
+ *  DESCRIPTION : fill the buffer with as many directory records as fit, each holding
+ *                the name, type, inode and size of one file
+ *  INPUTS : int32_t fd - file descriptor of an open directory
+             void* buf - the buffer of fs_dirent_t records to fill
+             int32_t nbytes - the size of the buffer
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes filled, a multiple of sizeof(fs_dirent_t),
+ *                 0 at the end of the directory
+ *                 -1 - the buffer cannot hold one record or the directory cannot be read
+ *  SIDE EFFECTS : advance the file position past the records returned
+ *
+ */
+int32_t dir_getdents (int32_t fd, void* buf, int32_t nbytes)
+{
+    file_desc_t* file_desc = fd_lookup(fd);
+    fs_dirent_t* record = (fs_dirent_t*)buf;
+    uint32_t count = 0;
+    dentry_t dentry;
+    fs_stat_t st;
+    int32_t ret;
+    if ((file_desc == NULL) || (buf == NULL) || (nbytes < (int32_t)sizeof(fs_dirent_t))) return -1;
+
+    while ((count + 1) * sizeof(fs_dirent_t) <= (uint32_t)nbytes) {
+        ret = dir_next(file_desc, &dentry);
+        if (ret == 0) break;
+        if (ret == -1) return (count > 0) ? (int32_t)(count * sizeof(fs_dirent_t)) : -1;       // hand out what was read so far
+        uint32_t len = fs_name_len(dentry.file_name);
+        if (len > MAX_FILENAME_LEN) len = MAX_FILENAME_LEN;
+        memset(record, 0, sizeof(fs_dirent_t));
+        memcpy(record->name, dentry.file_name, len);                                            // always NUL terminated
+        record->file_type = dentry.file_type;
+        record->inode = dentry.inode;
+        if (0 == fs_stat(dentry.inode, dentry.file_type, &st)) record->length = st.length;
+        record++;
+        count++;
+    }
+    return count * sizeof(fs_dirent_t);
+}
+
 /**
  * dir_write
- *  DESCRIPTION : do nothing and return -1
- *  INPUTS : int32_t fd - file descriptor
-             void* buf - the buffer that we are going to write to
-             int32_t nbytes - the number of bytes that need to write
+ *  DESCRIPTION : create an empty regular file with the given name
+ *  INPUTS : int32_t fd - file descriptor of the directory the name is relative to
+             void* buf - the name (or path) of the new file
+             int32_t nbytes - ignored
  *  OUTPUTS : none
- *  RETURN VALUE : -1 - always (for read-only)
- *  SIDE EFFECTS : none
+ *  RETURN VALUE : 0 - the file was created
+ *                 -1 - bad name, the file already exists, or no dentry/inode is left
+ *  SIDE EFFECTS : add a dentry, allocate an inode
  * 
  */
 int32_t dir_write (int32_t fd, const void* buf, int32_t nbytes)
 {
-    int i;
-    strcpy((int8_t*)dentry_ptr[boot_block_ptr->num_dir_entries].file_name, (int8_t*)buf);
-    dentry_ptr[boot_block_ptr->num_dir_entries].file_type = 2;
-    for(i = 0; i < (boot_block_ptr->num_dir_entries); i++)
-    {
-        if(inode_array[i] == 0)
-        {
-            dentry_ptr[boot_block_ptr->num_dir_entries].inode = i;
-            inode_array[i] = 1;
-            break;
-        }
-    }
-    if(i == boot_block_ptr->num_dir_entries)
-    {
-        return -1;
-    }
-    boot_block_ptr->num_dir_entries++;
-    return 0;                                                                                  // Always return -1 (read-only)
+    file_desc_t* file_desc = fd_lookup(fd);
+    if (file_desc == NULL) return -1;
+    return fs_create(file_desc->inode, (const uint8_t*)buf, FILE_TYPE_REGULAR);
 }
 
 /**
@@ -285,7 +3146,7 @@ int32_t dir_write (int32_t fd, const void* buf, int32_t nbytes)
  *  DESCRIPTION : check whether we can open a directory
  *  INPUTS : const uint8_t* filename - the name of the file we want to open
  *  OUTPUTS : none
- *  RETURN VALUE : 0 - there exists the directory that we want to open (we only use this since there is only one directory)
+ *  RETURN VALUE : 0 - there exists the directory that we want to open
                    -1 - there is no corresponding directory
  *  SIDE EFFECTS : none
  * 
@@ -293,7 +3154,8 @@ int32_t dir_write (int32_t fd, const void* buf, int32_t nbytes)
 int32_t dir_open (const uint8_t* filename)
 {
     dentry_t dentry;
-    return read_dentry_by_name(filename, &dentry);                                              // Call read_dentry_by_name and use its return value
+    if (-1 == read_dentry_by_name(filename, &dentry)) return -1;                                // Resolve the path
+    return (dentry.file_type == FILE_TYPE_DIR) ? 0 : -1;                                        // It must name a directory
 }
 
 /**
@@ -6,9 +6,51 @@
 /* Macro numbers */
 #define MAX_FILES_NUMBER     63
 #define MAX_FILENAME_LEN     32
-#define RESERVED_BOOT_BLOCK  52
+#define RESERVED_BOOT_BLOCK  40
 #define RESERVED_DIR_ENTRY   24
 #define BLOCK_SIZE           4096
+#define DENTRY_HASH_SIZE     128                     // power of 2, at least twice MAX_FILES_NUMBER
+#define DENTRY_HASH_EMPTY    0xFF                    // marks an unused slot in the name index
+#define DENTRY_HASH_DELETED  0xFE                    // marks a slot whose dentry was removed, probing goes on past it
+#define FS_MAX_INODES        4096                    // size of the inode allocator bitmap
+#define FS_MAX_DATA_BLOCKS   32768                   // size of the free-block bitmap (128MB of data)
+#define BLOCK_PTRS           (BLOCK_SIZE/4)          // block numbers held by one indirect block
+#define INODE_DIRECT_BLOCKS  ((BLOCK_SIZE/4)-4)      // block numbers held directly in an inode
+#define INODE_MAX_BLOCKS     (INODE_DIRECT_BLOCKS + BLOCK_PTRS + BLOCK_PTRS*BLOCK_PTRS)
+#define INODE_INLINE_MAX     (BLOCK_SIZE-8)          // bytes an inline inode holds between length and flags
+#define INODE_FLAG_INLINE    0x1                     // the file data is stored in the inode itself
+#define INODE_FLAG_COMPRESSED 0x2                    // the data blocks hold LZ4 blocks behind an offset table, read only
+#define REFCOUNT_STICKY      0xFFFF                  // a block referenced this often is never freed
+#define ZCACHE_SLOTS         8                       // decompressed blocks kept in the LRU cache
+#define FS_ROOT_INODE        0                       // the root directory (the "." dentry of the boot block)
+#define FS_MAX_PATH_LEN      128                     // longest path accepted by path_lookup
+#define FS_MAX_DEPTH         32                      // deepest directory nesting walked by filesys_init
+#define DENTRIES_PER_BLOCK   (BLOCK_SIZE/64)         // dentries stored in one data block of a subdirectory
+#define DCACHE_SIZE          8192                    // power of 2, slots in the dentry cache
+#define DCACHE_WAYS          8                       // slots per set, DCACHE_SIZE / DCACHE_WAYS sets
+#define ECACHE_SIZE          64                      // power of 2, slots in the executable cache, indexed by inode
+#define EXE_MAGIC            0x464C457F              // "\177ELF", the first 4 bytes of an executable read as a word
+#define FS_CSUM_MAGIC        0x43524333              // boot_block.csum_magic of an image that carries block checksums
+#define FS_LAYOUT_MAGIC      0x494E4433              // boot_block.layout_magic of an image whose inodes end in indirect blocks and flags
+#define FS_OLD_DIRECT_BLOCKS ((BLOCK_SIZE/4)-1)      // block numbers in an inode of a createfs image, all direct
+#define FS_MAX_IMAGE_BLOCKS  (1 + FS_MAX_INODES + FS_MAX_DATA_BLOCKS)   // boot block, inodes and data blocks
+#define FS_SECTORS_PER_BLOCK (BLOCK_SIZE/512)        // disk sectors holding one block of the image
+#define FS_READAHEAD_MAX     32                      // most data blocks one read from the disk brings in (128KB)
+#define FS_FLUSH_TICKS       100                     // PIT ticks between write-backs of dirty blocks (1s)
+#define FS_JOURNAL_MAGIC     0x4A524E4C              // journal_desc.magic of a committed transaction
+#define FS_JOURNAL_BLOCKS    128                     // disk blocks after the image: a descriptor and up to 127 logged blocks
+#define FS_OP_META_MAX       48                      // most metadata blocks one operation changes, a transaction keeps room for them
+#define FS_WRITE_OP_BLOCKS   32                      // write_data changes the file in operations of at most this many blocks
+
+/* file types stored in dentry.file_type */
+#define FILE_TYPE_RTC        0
+#define FILE_TYPE_DIR        1
+#define FILE_TYPE_REGULAR    2
+
+/* whence values of lseek */
+#define SEEK_SET             0                       // from the start of the file
+#define SEEK_CUR             1                       // from the current position
+#define SEEK_END             2                       // from the end of the file
 
 
 
@@ -23,12 +65,57 @@ typedef struct dentry
 
 } dentry_t;
 
+/* one slot of the dentry cache, remembers the result of looking a name up in a directory */
+typedef struct dcache_entry
+{
+    uint32_t parent;                                    // inode of the directory searched
+    uint8_t  name[MAX_FILENAME_LEN];
+    uint8_t  name_len;                                  // 0 means the slot is unused
+    uint8_t  negative;                                  // 1 means the name does not exist
+    uint32_t file_type;
+    uint32_t inode;
+
+} dcache_entry_t;
+
+/* one slot of the executable cache, remembers what execute found at the start of a file */
+typedef struct ecache_entry
+{
+    uint32_t inode;
+    uint8_t  valid;                                     // 0 means the slot is unused
+    uint8_t  executable;                                // 1 means the file starts with EXE_MAGIC
+    uint32_t entry;                                     // the entry point, bytes EIP_START to EIP_START+3
+    uint32_t length;                                    // bytes of the program image
+
+} ecache_entry_t;
+
+/* what stat and fstat report about a file, nothing in it needs a data block to be read */
+typedef struct fs_stat
+{
+    uint32_t length;                                    // size in bytes, dentries * 64 for a directory
+    uint32_t file_type;                                 // FILE_TYPE_*
+    uint32_t inode;                                     // 0 for the root directory and rtc
+
+} fs_stat_t;
+
+/* one record filled in by getdents, the records are packed back to back */
+typedef struct fs_dirent
+{
+    uint8_t  name[MAX_FILENAME_LEN + 4];                // NUL terminated, padded to a word
+    uint32_t file_type;                                 // FILE_TYPE_*
+    uint32_t inode;
+    uint32_t length;                                    // as reported by stat
+
+} fs_dirent_t;
+
 typedef struct boot_block
 {
     uint32_t num_dir_entries;
     uint32_t num_inodes;
     uint32_t num_data_blocks;
-    uint32_t reserved[RESERVED_BOOT_BLOCK/4];          // 52B = 4B * 13
+    uint32_t csum_magic;                                // FS_CSUM_MAGIC, anything else means no checksums
+    uint32_t csum_block;                                // first data block of the CRC32C table, one word per data block
+    uint32_t layout_magic;                              // FS_LAYOUT_MAGIC, anything else means the createfs inode layout
+    uint32_t reserved[RESERVED_BOOT_BLOCK/4];          // 40B = 4B * 10
     dentry_t dir_entries[MAX_FILES_NUMBER];
 
 } boot_block_t;
@@ -36,10 +123,24 @@ typedef struct boot_block
 typedef struct inode
 {
     uint32_t length;
-    uint32_t data_blocks[(BLOCK_SIZE/4)-1];             // (4KB / 4B) - 1
+    uint32_t data_blocks[INODE_DIRECT_BLOCKS];          // (4KB / 4B) - 4, the start of the data itself when inline
+    uint32_t indirect_block;                            // data block holding the next BLOCK_PTRS block numbers
+    uint32_t double_indirect_block;                     // data block holding BLOCK_PTRS indirect blocks
+    uint32_t flags;                                     // INODE_FLAG_*, 0 for plain block-mapped files
 
 } inode_t;
 
+/* first block of the journal, the logged blocks follow it on the disk */
+typedef struct journal_desc
+{
+    uint32_t magic;                                     // FS_JOURNAL_MAGIC, anything else means an empty journal
+    uint32_t csum;                                      // CRC32C of the fields below, the block list and the logged blocks
+    uint32_t sequence;                                  // number of the transaction
+    uint32_t count;                                     // logged blocks
+    uint32_t blocks[FS_JOURNAL_BLOCKS - 1];             // image block each logged block goes back to
+
+} journal_desc_t;
+
 /* Define the pointer to above structure*/
 boot_block_t* boot_block_ptr;
 inode_t*      inode_ptr;
@@ -55,28 +156,87 @@ int32_t read_dentry_by_index (uint32_t index, dentry_t* dentry);
 /* read up to length bytes starting from position offset in the file with number inode*/
 int32_t read_data (uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t length);
 
+/* resolve a '/' separated path starting from directory dir */
+int32_t path_lookup (uint32_t dir, const uint8_t* path, dentry_t* dentry);
+/* create an empty regular file or directory at path */
+int32_t fs_create (uint32_t dir, const uint8_t* path, uint32_t type);
+/* make file dst a copy-on-write copy of file src */
+int32_t fs_reflink (uint32_t src, uint32_t dst);
+/* remove the file or empty directory at path and reclaim its inode and blocks */
+int32_t fs_remove (uint32_t dir, const uint8_t* path);
+/* fill in the size, type and inode of a file */
+int32_t fs_stat (uint32_t inode, uint32_t file_type, fs_stat_t* st);
+/* where page idx of a file lies in memory, NULL if it cannot be mapped */
+uint8_t* fs_data_page (uint32_t inode, uint32_t idx);
+/* keep the data block behind a page from fs_data_page allocated while it is mapped, -1 for inline data */
+int32_t fs_page_get (const uint8_t* page);
+/* drop the reference fs_page_get took */
+void fs_page_put (const uint8_t* page);
+/* whether a file is executable, with its entry point and length, cached per inode */
+int32_t fs_exec_info (uint32_t inode, uint32_t* entry, uint32_t* length);
+/* forget the cached lookup of name in directory parent */
+void dcache_invalidate (uint32_t parent, const uint8_t* name);
+/* forget the decompressed blocks cached for inode */
+void zcache_invalidate (uint32_t inode);
+/* back the image with the ATA disk: load it from the disk, or format the disk with it */
+int32_t fs_disk_attach (uint32_t mem_end);
+/* write the blocks of the image changed since the last sync to the disk, metadata through the journal */
+int32_t fs_sync (void);
+/* ask for a write-back every FS_FLUSH_TICKS calls, called by the PIT handler */
+void fs_flush_tick (void);
+/* write dirty blocks back when a write-back is due, called in process context */
+void fs_flush (void);
+
+/* write length bytes starting from position offset in the file with number inode, growing it if needed */
+int32_t write_data (uint32_t inode, uint32_t offset, const uint8_t* buf, uint32_t length);
+
+/* inode and data block allocator */
+/* allocate a free inode, -1 if there is none */
+int32_t alloc_inode (void);
+/* return an inode to the allocator */
+void free_inode (uint32_t inode);
+/* allocate a free data block, preferring hint and runs of want free blocks */
+int32_t alloc_data_block (uint32_t hint, uint32_t want);
+/* return a data block to the allocator */
+void free_data_block (uint32_t block);
+
+/* name index over the dentries in the boot block */
+/* rebuild the whole name index from the boot block */
+void dentry_index_build (void);
+/* add the dentry at index to the name index */
+void dentry_index_insert (uint32_t index);
+/* drop the dentry at index from the name index */
+void dentry_index_remove (uint32_t index);
+/* find the dentry index of the filename, -1 if it does not exist */
+int32_t dentry_index_lookup (const uint8_t* fname);
+
 
 /* file operation functions */
 void filesys_init (uint32_t filesys_addr);
 /* read count bytes of data from file into buf */
 int32_t file_read (int32_t fd, void* buf, int32_t nbytes);
-/* do nothing and return -1 */
+/* write count bytes of buf into the file at the current position */
 int32_t file_write(int32_t fd, const void* buf, int32_t nbytes);
+/* read count bytes of data from file at offset, the file position does not move */
+int32_t file_pread (int32_t fd, void* buf, int32_t nbytes, uint32_t offset);
+/* write count bytes of buf into the file at offset, the file position does not move */
+int32_t file_pwrite (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset);
+/* move the file position, return the new one */
+int32_t file_lseek (int32_t fd, int32_t offset, int32_t whence);
 /* initialize any temporary sturctures, return 0 */
 int32_t file_open (const uint8_t* filename);
 /* undo what was done in the open function, return 0 */
 int32_t file_close (int32_t fd);
 
-/* read files filename by filename, including "." */
+/* read files filename by filename, including "." (any directory, not only the root) */
 int32_t dir_read (int32_t fd, void* buf, int32_t nbytes);
-/* do nothing and return -1 */
+/* fill buf with as many fs_dirent_t records as fit */
+int32_t dir_getdents (int32_t fd, void* buf, int32_t nbytes);
+/* create an empty regular file named buf in the directory */
 int32_t dir_write (int32_t fd, const void* buf, int32_t nbytes);
-/* open a directory file, return 0 */
+/* open a directory file given its path, return 0 */
 int32_t dir_open (const uint8_t* filename);
 /* do nothing and return 0 */
 int32_t dir_close (int32_t fd);
 
-extern int inode_array[64];
-
-
 #endif
@@ -6,6 +6,7 @@
 #include "system_call.h"
 #include "rtc.h"
 #include "scheduler.h"
+#include "ata.h"
 
 /* All the handlers below are implentmented in the "handler.S".*/
 
@@ -13,6 +14,7 @@
 extern void PIT_HANDLER_link(void);
 extern void KEYBOARD_HANDLER_link(void); 
 extern void RTC_HANDLER_link(void);
+extern void ATA_HANDLER_link(void);
 
 /* Handler for exception */
 extern void Divide_Error(void);
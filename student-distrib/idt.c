@@ -1,6 +1,7 @@
 #include "idt.h"
 #include "handler.h"
 #include "system_call.h"
+#include "paging.h"
 
 /* gate types */
 uint32_t trap_gate = 0xF;
@@ -74,7 +75,7 @@ init_idt(void){
             write_gate_entry(i, trap_gate, dpl);
         }
         /* intr_gate */
-        if (i == 2 || i == 14 || i == KB_VEC || i == RTC_VEC || i == PIT_VEC){
+        if (i == 2 || i == 14 || i == KB_VEC || i == RTC_VEC || i == PIT_VEC || i == ATA_VEC){
             dpl = DPL_KERNEL;
             write_gate_entry(i, intr_gate, dpl);
         }
@@ -121,6 +122,7 @@ init_idt(void){
     SET_IDT_ENTRY(idt[PIT_VEC], PIT_HANDLER_link);
     SET_IDT_ENTRY(idt[KB_VEC], KEYBOARD_HANDLER_link);
     SET_IDT_ENTRY(idt[RTC_VEC], RTC_HANDLER_link);
+    SET_IDT_ENTRY(idt[ATA_VEC], ATA_HANDLER_link);
 
     /* system call */
     SET_IDT_ENTRY(idt[SYS_VEC], SYS_CALL_link);
@@ -134,6 +136,8 @@ init_idt(void){
  *  DESCRIPTION : Printing a prompt as to which Exception was raised, 
  *                and then squash any user-level program that produces an exception, returning control to the shell.
  *                Here, we use a while loop to freeze the program. 
+ *                A page fault on a page of the program window that has no frame yet is not an exception
+ *                to the program: the page is mapped and the access retried.
  *  INPUTS : vec -- the index of exception.
  *           regs -- all the status of registers.
  *           flags -- flag register.
@@ -144,6 +148,7 @@ init_idt(void){
  */
 void
 exception_handler(reg_t regs, uint32_t excep_num, uint32_t error){
+    if((excep_num == PF_VEC) && (0 == user_page_fault(error))) return;     // the first touch of a page of the program, not an error
     clear();
     printf("EXCEPTION(%d): %s\n", excep_num, EXCEPTION_NAME[excep_num]);
     if(error != NULL) printf("error: %s", error);
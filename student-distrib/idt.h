@@ -10,6 +10,8 @@
 #define PIT_VEC         0x20
 #define KB_VEC          0x21
 #define RTC_VEC         0x28
+#define ATA_VEC         0x2E
+#define PF_VEC          14
 #define SYS_VEC         0x80
 
 /* Initalize the IDT */
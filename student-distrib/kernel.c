@@ -15,6 +15,9 @@
 #include "paging.h"
 #include "filesys.h"
 #include "pit.h"
+#include "ata.h"
+#include "palloc.h"
+#include "system_call.h"
 
 #define RUN_TESTS
 
@@ -155,9 +158,11 @@ void entry(unsigned long magic, unsigned long addr) {
     /* Initialize devices, memory, filesystem, enable device interrupts on the
      * PIC, any other initialization stuff... */
     filesys_init(filesys_addr);
+    if (0 == ata_init()) fs_disk_attach(KERNEL_STACK_START - BOOT_STACK_SIZE);             // a disk image may reach up to the boot stack
     keyboard_init();
     rtc_init();
     pit_init();
+    palloc_init(mbi);                                                                   // memory for processes, from the mmap above
     paging_init();
     terminal_open(NULL);
 
@@ -219,6 +219,20 @@ int32_t puts(int8_t* s) {
 void putc(uint8_t c) {
     uint32_t flags;
     cli_and_save(flags);                                    // avoid being interrupted by pit and executing scheduling
+    putc_nolock(c);
+    restore_flags(flags);
+}
+
+/**
+ * putc_nolock
+ *  DESCRIPTION : Output a character to the console, the caller already has interrupts disabled.
+ *                Lets a whole buffer be printed under one cli_and_save.
+ *  INPUTS : a character to print.
+ *  OUTPUTS : the input character.
+ *  RETURN VALUE : none.
+ *  SIDE EFFECTS : print the char on the terminal screen.
+ */
+void putc_nolock(uint8_t c) {
     uint8_t term_id = sche_term;
 
     screen_x = multi_terms[term_id].x;
@@ -284,8 +298,6 @@ void putc(uint8_t c) {
     if(sche_term == cur_terminal){
         update_cursor(screen_x ,screen_y);
     }
-
-    restore_flags(flags);
 }
 
 /**
@@ -0,0 +1,73 @@
+#include "lz4.h"
+
+/*
+ * lz4_read_len
+ *  DESCRIPTION : finish reading a length field: a 4-bit field of 15 is followed by
+ *                bytes that are added on, ending with the first byte below 255
+ *  INPUTS : const uint8_t** ip - position in the block, advanced past the extra bytes
+ *           const uint8_t* iend - end of the block
+ *           uint32_t len - the 4-bit field
+ *  OUTPUTS : none
+ *  RETURN VALUE : the full length
+ *                 -1 - the block ends inside the length
+ *  SIDE EFFECTS : none
+ */
+static int32_t lz4_read_len(const uint8_t** ip, const uint8_t* iend, uint32_t len)
+{
+    uint8_t b;
+    if (len != LZ4_LEN_MASK) return len;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == LZ4_LEN_MORE);
+    return len;
+}
+
+/*
+ * lz4_decode_block
+ *  DESCRIPTION : decode one block in the LZ4 block format. Each sequence is a token
+ *                (literal length in the high nibble, match length - 4 in the low one),
+ *                the literals, then a 2-byte little endian match offset. The last
+ *                sequence has literals only. Every copy is bounds checked.
+ *  INPUTS : const uint8_t* src - the compressed block
+ *           uint32_t src_len - its size in bytes
+ *           uint8_t* dst - where to decode to
+ *           uint32_t dst_len - the size of dst
+ *  OUTPUTS : the decoded bytes in dst
+ *  RETURN VALUE : the number of bytes decoded
+ *                 -1 - the block is malformed or does not fit in dst
+ *  SIDE EFFECTS : none
+ */
+int32_t lz4_decode_block(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_len;
+    const uint8_t* match;
+    int32_t len;
+    uint32_t token, offset;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        /* literals */
+        if (-1 == (len = lz4_read_len(&ip, iend, token >> 4))) return -1;
+        if (((uint32_t)len > (uint32_t)(iend - ip)) || ((uint32_t)len > (uint32_t)(oend - op))) return -1;
+        while (len--) *op++ = *ip++;
+        if (ip == iend) break;                                                  // the last sequence stops after its literals
+
+        /* match */
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (uint32_t)(op - dst))) return -1;       // points before the start of the output
+        if (-1 == (len = lz4_read_len(&ip, iend, token & LZ4_LEN_MASK))) return -1;
+        len += LZ4_MIN_MATCH;
+        if ((uint32_t)len > (uint32_t)(oend - op)) return -1;
+        match = op - offset;
+        while (len--) *op++ = *match++;                                         // byte by byte, the match may overlap the output
+    }
+    return op - dst;
+}
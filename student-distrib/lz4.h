@@ -0,0 +1,13 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "types.h"
+
+#define LZ4_MIN_MATCH        4                       // shortest match a sequence can encode
+#define LZ4_LEN_MASK         0x0F                    // 4-bit length fields of the token
+#define LZ4_LEN_MORE         255                     // an extra length byte of 255 means another one follows
+
+/* decode one LZ4 block of src_len bytes into at most dst_len bytes, -1 if it is malformed */
+extern int32_t lz4_decode_block(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len);
+
+#endif
@@ -1,5 +1,6 @@
 #include "paging.h"
 #include "system_call.h"
+#include "palloc.h"
 #include "lib.h"
 
 /**
@@ -37,6 +38,13 @@ void paging_init(void)
         page_dir[i].page_size = 1; 
     }
 
+    // Map physical memory at PHYS_MAP_ADDR, the kernel reaches the frames palloc hands out there
+    for(i = 0; i < PHYS_MAP_SIZE / PAGE_SIZE_4M; i++)
+    {
+        page_dir[PHYS_MAP_ADDR / PAGE_SIZE_4M + i].present = 1;                // supervisor only
+        page_dir[PHYS_MAP_ADDR / PAGE_SIZE_4M + i].base_addr = i * (PAGE_SIZE_4M / PAGE_SIZE);
+    }
+
     //Initialize table entries for 0-4M 
     for(i = 0; i < DIR_TBL_SIZE; i++)
     {
@@ -53,3 +61,116 @@ void paging_init(void)
     load_page_directory((uint32_t)page_dir);
     enable_paging();
 }
+
+/**
+ * mmap_paging
+ *  DESCRIPTION : map the mmap window (4M at USER_MMAP_ADDR) through the page table of
+ *                the given process, so each process only sees the files it mapped.
+ *                The table is a frame from palloc, recorded in the pcb.
+ *                The caller flushes the TLB.
+ *  INPUTS : int32_t pid - the process
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify page_dir
+ *
+ */
+void mmap_paging(int32_t pid)
+{
+    uint32_t idx = USER_MMAP_ADDR / PAGE_SIZE_4M;
+    memset(&page_dir[idx], 0, sizeof(page_dir[idx]));
+    if ((pid < 0) || (pid >= MAX_PROCESS) || (pcb_array[pid] == NULL)) return;  // no process, nothing mapped
+    page_dir[idx].present = 1;
+    page_dir[idx].read_write = 1;                                           // the PTEs decide, they are read only
+    page_dir[idx].user_sup = 1;
+    page_dir[idx].base_addr = pcb_array[pid]->mmap_tbl / PAGE_SIZE;
+}
+
+/**
+ * user_paging
+ *  DESCRIPTION : map the program window (4M at user_virt_addr) through the page table of
+ *                the given process. Only the pages the program used have frames behind
+ *                them. The caller flushes the TLB.
+ *  INPUTS : int32_t pid - the process
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify page_dir
+ *
+ */
+void user_paging(int32_t pid)
+{
+    uint32_t idx = user_virt_addr / PAGE_SIZE_4M;
+    memset(&page_dir[idx], 0, sizeof(page_dir[idx]));
+    if ((pid < 0) || (pid >= MAX_PROCESS) || (pcb_array[pid] == NULL)) return;  // no process, nothing mapped
+    page_dir[idx].present = 1;
+    page_dir[idx].read_write = 1;
+    page_dir[idx].user_sup = 1;
+    page_dir[idx].base_addr = pcb_array[pid]->user_tbl / PAGE_SIZE;
+}
+
+/**
+ * user_paging_map
+ *  DESCRIPTION : give the page at addr of a program window a zeroed frame from palloc,
+ *                writable by the program. A page that is mapped already is left alone.
+ *  INPUTS : uint32_t tbl - physical address of the page table of the window
+ *           uint32_t addr - an address in the window
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the page is mapped
+ *                 -1 - palloc ran out of frames
+ *  SIDE EFFECTS : modify the page table
+ *
+ */
+int32_t user_paging_map(uint32_t tbl, uint32_t addr)
+{
+    page_table_entry_t* pte = (page_table_entry_t*)PHYS_TO_VIRT(tbl) + (addr % PAGE_SIZE_4M) / PAGE_SIZE;
+    uint32_t frame;
+    if (pte->present) return 0;
+    frame = palloc(PALLOC_ORDER_4KB);
+    if (frame == 0) return -1;
+    memset(PHYS_TO_VIRT(frame), 0, PAGE_SIZE);                             // nothing of an earlier process shows through
+    memset(pte, 0, sizeof(page_table_entry_t));
+    pte->present = 1;
+    pte->read_write = 1;
+    pte->user_sup = 1;
+    pte->base_addr = frame / PAGE_SIZE;
+    return 0;
+}
+
+/**
+ * user_paging_free
+ *  DESCRIPTION : give back every frame a program page table maps, and the table itself
+ *  INPUTS : uint32_t tbl - physical address of the page table
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : the frames go back to palloc
+ *
+ */
+void user_paging_free(uint32_t tbl)
+{
+    page_table_entry_t* table = PHYS_TO_VIRT(tbl);
+    uint32_t i;
+    for (i = 0; i < DIR_TBL_SIZE; i++) {
+        if (table[i].present) pfree(table[i].base_addr * PAGE_SIZE, PALLOC_ORDER_4KB);
+    }
+    pfree(tbl, PALLOC_ORDER_4KB);
+}
+
+/**
+ * user_page_fault
+ *  DESCRIPTION : execute maps only the image and the top page of the stack. Any other page
+ *                of the program window (the bss, a deeper stack) gets a frame here the first
+ *                time the program, or the kernel on its behalf, touches it.
+ *  INPUTS : uint32_t error - the error code of the page fault
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 - the page is mapped now, the access can be retried
+ *                 -1 - not a missing page of the window, or no frame was left
+ *  SIDE EFFECTS : modify the page table of the current process
+ *
+ */
+int32_t user_page_fault(uint32_t error)
+{
+    uint32_t addr;
+    asm volatile ("movl %%cr2, %0" : "=r"(addr));                          // the address that faulted
+    if ((error & PF_PRESENT) || (cur_process < 0)) return -1;
+    if ((addr < user_virt_addr) || (addr >= user_virt_addr + PAGE_SIZE_4M)) return -1;
+    return user_paging_map(pcb_array[(uint8_t)cur_process]->user_tbl, addr);  // a missing entry is never cached, no flush needed
+}
@@ -9,8 +9,14 @@
 #define PAGE_SIZE_4M    0x400000
 #define VMEM_START_ADDR 0xB8000                             // The address of video memory
 #define KERNEL_START_ADDR 0x400000                          // The start address of kenel
-#define USER_START_ADDR 0x800000                            // The start address of user-space
-#define PROGRAM_SIZE    0x400000                            // A user program occupies 4M physical mem.
+#define USER_MMAP_ADDR  0x08800000                          // 136M, mmap places file pages here (4K pages)
+#define PHYS_MAP_ADDR   0xC0000000                          // 3G, physical memory is mapped here for the kernel (4M pages)
+#define PHYS_MAP_SIZE   0x40000000                          // 1G of physical memory is reachable through the map
+#define PF_PRESENT      0x1                                 // page fault error code, the page was present (a protection fault)
+
+/* where the kernel sees a physical address below PHYS_MAP_SIZE, and back */
+#define PHYS_TO_VIRT(addr)  ((void*)((uint32_t)(addr) + PHYS_MAP_ADDR))
+#define VIRT_TO_PHYS(addr)  ((uint32_t)(addr) - PHYS_MAP_ADDR)
 
 /* define a structure for page directory entriy */
 struct page_directory_entry
@@ -56,6 +62,16 @@ extern void enable_paging(void);
 extern void load_page_directory(int dir);
 /* Flush TLB after swapping page */
 extern void flush_TLB(void);
+/* point the mmap window at the page table of a process */
+extern void mmap_paging(int32_t pid);
+/* point the program window (4M at user_virt_addr) at the page table of a process */
+extern void user_paging(int32_t pid);
+/* back the page at addr in a program page table with a zeroed frame */
+extern int32_t user_paging_map(uint32_t tbl, uint32_t addr);
+/* free every frame a program page table maps, then the table */
+extern void user_paging_free(uint32_t tbl);
+/* map the page of the program window a page fault touched, 0 if it was mapped */
+extern int32_t user_page_fault(uint32_t error);
 
 /* define the page directory and page table */
 page_directory_entry_t page_dir[DIR_TBL_SIZE] __attribute__((aligned (PAGE_SIZE)));
@@ -0,0 +1,196 @@
+#include "palloc.h"
+#include "lib.h"
+
+static uint32_t free_map[PALLOC_MAP_WORDS];                                                         // per order, 1 bit per block, 1 means a free block of that order starts there
+static uint32_t free_count[PALLOC_MAX_ORDER + 1];                                                   // free blocks of each order
+static uint32_t free_hint[PALLOC_MAX_ORDER + 1];                                                    // no free block of the order lies before this word of its map
+static uint32_t frames_free;                                                                        // 4KB frames in all the free blocks
+
+/*
+ * map_of
+ *  DESCRIPTION : the free map of one order. The maps are laid out one after the other,
+ *                order 0 first with a bit per frame, each next one half as long.
+ *  INPUTS : uint32_t order - the block order
+ *  OUTPUTS : none
+ *  RETURN VALUE : the first word of the map
+ *  SIDE EFFECTS : none
+ */
+static uint32_t* map_of(uint32_t order)
+{
+    return free_map + (PALLOC_FRAMES - (PALLOC_FRAMES >> order)) / 16;
+}
+
+/*
+ * block_insert
+ *  DESCRIPTION : put a block on the free map of its order
+ *  INPUTS : uint32_t idx - the block number, its first frame >> order
+ *           uint32_t order - the block order
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify free_map, free_count and free_hint
+ */
+static void block_insert(uint32_t idx, uint32_t order)
+{
+    map_of(order)[idx / 32] |= 1 << (idx % 32);
+    free_count[order]++;
+    if (free_hint[order] > idx / 32) free_hint[order] = idx / 32;
+}
+
+/*
+ * block_remove
+ *  DESCRIPTION : take a block off the free map of its order
+ *  INPUTS : uint32_t idx - the block number
+ *           uint32_t order - the block order
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify free_map and free_count
+ */
+static void block_remove(uint32_t idx, uint32_t order)
+{
+    map_of(order)[idx / 32] &= ~(1 << (idx % 32));
+    free_count[order]--;
+}
+
+/*
+ * palloc
+ *  DESCRIPTION : allocate a block of 2^order frames. The lowest free block of the
+ *                smallest order that fits is split in halves until it has the size
+ *                asked for; the upper halves go back on the free maps.
+ *  INPUTS : uint32_t order - PALLOC_ORDER_4KB up to PALLOC_ORDER_4MB
+ *  OUTPUTS : none
+ *  RETURN VALUE : the physical address of the block, aligned to its size
+ *                 0 if no block is large enough or order is too big
+ *  SIDE EFFECTS : modify the free maps
+ */
+uint32_t palloc(uint32_t order)
+{
+    uint32_t flags, k, w, idx;
+    uint32_t* map;
+    if (order > PALLOC_MAX_ORDER) return 0;
+    cli_and_save(flags);
+    for (k = order; (k <= PALLOC_MAX_ORDER) && (free_count[k] == 0); k++);
+    if (k > PALLOC_MAX_ORDER) {
+        restore_flags(flags);
+        return 0;
+    }
+    map = map_of(k);
+    for (w = free_hint[k]; map[w] == 0; w++);                                                       // free_count says there is one
+    free_hint[k] = w;
+    idx = w * 32 + __builtin_ctz(map[w]);
+    block_remove(idx, k);
+    while (k > order) {
+        k--;
+        idx <<= 1;
+        block_insert(idx + 1, k);                                                                   // keep the lower half
+    }
+    frames_free -= 1 << order;
+    restore_flags(flags);
+    return (idx << order) * PAGE_SIZE;
+}
+
+/*
+ * pfree
+ *  DESCRIPTION : give a block back, merging it with its buddy for as long as the
+ *                buddy is free as a whole
+ *  INPUTS : uint32_t addr - the physical address palloc returned
+ *           uint32_t order - the order it was allocated with
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the free maps, blocks outside the managed range are ignored
+ */
+void pfree(uint32_t addr, uint32_t order)
+{
+    uint32_t flags, idx;
+    if ((order > PALLOC_MAX_ORDER) || (addr % (PAGE_SIZE << order))) return;
+    if ((addr < PALLOC_MIN_ADDR) || (addr >= PALLOC_MAX_ADDR)) return;
+    cli_and_save(flags);
+    frames_free += 1 << order;
+    idx = addr / PAGE_SIZE >> order;
+    while ((order < PALLOC_MAX_ORDER) && (map_of(order)[(idx ^ 1) / 32] & (1 << ((idx ^ 1) % 32)))) {
+        block_remove(idx ^ 1, order);
+        idx >>= 1;
+        order++;
+    }
+    block_insert(idx, order);
+    restore_flags(flags);
+}
+
+/*
+ * palloc_free_frames
+ *  DESCRIPTION : how much memory is left
+ *  INPUTS : none
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of free 4KB frames
+ *  SIDE EFFECTS : none
+ */
+uint32_t palloc_free_frames(void)
+{
+    return frames_free;
+}
+
+/*
+ * palloc_add_range
+ *  DESCRIPTION : free the frames of [start, end) in the largest aligned blocks that fit,
+ *                leaving out the modules GRUB loaded there
+ *  INPUTS : multiboot_info_t* mbi - the multiboot information, for the modules
+ *           uint32_t start - physical address, rounded up to a frame
+ *           uint32_t end - physical address, rounded down to a frame
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the free maps
+ */
+static void palloc_add_range(multiboot_info_t* mbi, uint32_t start, uint32_t end)
+{
+    module_t* mod = (module_t*)mbi->mods_addr;
+    uint32_t i, order;
+    if (start < PALLOC_MIN_ADDR) start = PALLOC_MIN_ADDR;
+    if (end > PALLOC_MAX_ADDR) end = PALLOC_MAX_ADDR;
+    start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    end &= ~(PAGE_SIZE - 1);
+    if (start >= end) return;
+    for (i = 0; (mbi->flags & (1 << MODS_FLAG)) && (i < mbi->mods_count); i++) {
+        if ((mod[i].mod_start < end) && (mod[i].mod_end > start)) {                                 // split around the module
+            palloc_add_range(mbi, start, mod[i].mod_start);
+            palloc_add_range(mbi, mod[i].mod_end, end);
+            return;
+        }
+    }
+    while (start < end) {
+        for (order = PALLOC_MAX_ORDER; (start % (PAGE_SIZE << order)) || (end - start < (PAGE_SIZE << order)); order--);
+        pfree(start, order);
+        start += PAGE_SIZE << order;
+    }
+}
+
+/*
+ * palloc_init
+ *  DESCRIPTION : seed the allocator with every usable range of the multiboot memory
+ *                map, or with mem_upper when GRUB gave no map
+ *  INPUTS : multiboot_info_t* mbi - the multiboot information
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : fill the free maps
+ */
+void palloc_init(multiboot_info_t* mbi)
+{
+    memory_map_t* mmap;
+    uint32_t end, upper;
+    memset(free_map, 0, sizeof(free_map));
+    memset(free_count, 0, sizeof(free_count));
+    memset(free_hint, 0, sizeof(free_hint));
+    frames_free = 0;
+
+    if (mbi->flags & (1 << MMAP_FLAG)) {
+        for (mmap = (memory_map_t*)mbi->mmap_addr;
+                (uint32_t)mmap < mbi->mmap_addr + mbi->mmap_length;
+                mmap = (memory_map_t*)((uint32_t)mmap + mmap->size + sizeof(mmap->size))) {
+            if ((mmap->type != MMAP_TYPE_RAM) || (mmap->base_addr_high != 0)) continue;
+            end = mmap->base_addr_low + mmap->length_low;
+            if ((mmap->length_high != 0) || (end < mmap->base_addr_low)) end = PALLOC_MAX_ADDR;  // reaches past 4G
+            palloc_add_range(mbi, mmap->base_addr_low, end);
+        }
+    } else if (mbi->flags & (1 << MEM_FLAG)) {
+        upper = (mbi->mem_upper < PALLOC_MAX_ADDR / 1024) ? mbi->mem_upper * 1024 : PALLOC_MAX_ADDR;  // mem_upper counts KB from 1M
+        palloc_add_range(mbi, MEM_UPPER_START, MEM_UPPER_START + upper);
+    }
+}
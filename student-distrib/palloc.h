@@ -0,0 +1,31 @@
+#ifndef PALLOC_H
+#define PALLOC_H
+
+#include "types.h"
+#include "multiboot.h"
+#include "paging.h"
+
+#define PALLOC_MIN_ADDR      0x800000                // below 8M are the BIOS, the video memory and the kernel page
+#define PALLOC_MAX_ADDR      PHYS_MAP_SIZE           // frames the kernel cannot reach through the physical map are left out
+#define PALLOC_FRAMES        (PALLOC_MAX_ADDR / PAGE_SIZE)
+#define PALLOC_MAX_ORDER     10                      // blocks of 2^10 frames, one 4MB page
+#define PALLOC_MAP_WORDS     (2 * PALLOC_FRAMES / 32)    // the free maps of all orders, PALLOC_FRAMES >> order bits each
+#define PALLOC_ORDER_4KB     0
+#define PALLOC_ORDER_8KB     1                       // a pcb and its kernel stack
+#define PALLOC_ORDER_4MB     PALLOC_MAX_ORDER
+#define MMAP_FLAG            6                       // multiboot flags bit, mmap_addr and mmap_length are valid
+#define MEM_FLAG             0                       // multiboot flags bit, mem_lower and mem_upper are valid
+#define MODS_FLAG            3                       // multiboot flags bit, mods_addr and mods_count are valid
+#define MEM_UPPER_START      0x100000                // mem_upper is the memory from 1M on
+#define MMAP_TYPE_RAM        1                       // memory map entries of usable RAM
+
+/* hand the usable RAM in the multiboot memory map to the allocator */
+extern void palloc_init(multiboot_info_t* mbi);
+/* allocate 2^order contiguous frames aligned to their size, return the physical address or 0 */
+extern uint32_t palloc(uint32_t order);
+/* give back a block palloc returned, with the same order */
+extern void pfree(uint32_t addr, uint32_t order);
+/* number of 4KB frames not allocated */
+extern uint32_t palloc_free_frames(void);
+
+#endif
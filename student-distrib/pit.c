@@ -2,6 +2,7 @@
 #include "lib.h"
 #include "i8259.h"
 #include "scheduler.h"
+#include "filesys.h"
 
 /*
  * pit_init
@@ -21,14 +22,16 @@ void pit_init(void)
 
 /*
  * pit_handler
- *  DESCRIPTION : When an interrupt of pit occurs, handle it by calling scheduler
+ *  DESCRIPTION : When an interrupt of pit occurs, handle it by ticking the filesystem
+ *                write-back timer and calling scheduler
  *  INPUTS : none
  *  OUTPUTS : none
  *  RETURN VALUE : none
- *  SIDE EFFECTS : calling scheduler
+ *  SIDE EFFECTS : calling scheduler, may mark a write-back as due
  */
 void pit_handler(void)
 {
     send_eoi(PIT_IRQ);
+    fs_flush_tick();
     scheduler();
 }
@@ -38,7 +38,7 @@ void update_video_mem_paging(uint8_t term_id){
  */
 void scheduler(void){
     /* store current scheduler ebp */
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (active_array[sche_term] + 1));
+    pcb_t* cur_pcb = pcb_array[(uint8_t)active_array[sche_term]];
     asm volatile(
         "movl   %%ebp, %0\n"                                                                        // store current ebp
         : "=r"(cur_pcb->sche_ebp)
@@ -55,18 +55,16 @@ void scheduler(void){
     if(cur_process == -1) execute((uint8_t*)"shell");                                               // Start up 3 base shells at the beginning
 
     /* remaping user paging */
-    uint32_t phys_addr = USER_START_ADDR + cur_process * PROGRAM_SIZE;
-    page_dir[user_virt_addr / PAGE_SIZE_4M].base_addr = phys_addr / PAGE_SIZE;                      // virtual mem. 128M -> phys mem. (8M + pid * 4M)
-    page_dir[user_virt_addr / PAGE_SIZE_4M].present = 1;                                            // Set the paging bits to be present and to user level
-    page_dir[user_virt_addr / PAGE_SIZE_4M].user_sup = 1;
+    pcb_t* next_pcb = pcb_array[(uint8_t)cur_process];                                              // Get the pcb of the next process
+    user_paging(cur_process);                                                                       // virtual mem. 128M -> its pages
+    mmap_paging(cur_process);                                                                       // files mapped by the next process
     flush_TLB();                                                                                    // Flush TLB after swapping page
 
     /* change tss */
     tss.ss0 = KERNEL_DS;
-    tss.esp0 = KERNEL_STACK_START - SIZE_8KB * cur_process - sizeof(uint32_t);
+    tss.esp0 = (uint32_t)next_pcb + SIZE_8KB - sizeof(uint32_t);
 
     /* get next scheduler ebp */
-    pcb_t* next_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (active_array[sche_term] + 1));      // Get the pcb of the next process
     asm volatile(
         "movl   %0, %%ebp\n"                                                                        // restore next ebp
         :
@@ -18,9 +18,9 @@ void send_signal(uint8_t sig_num){
     // if(sig_num < 0 || sig_num >= NUM_SIGNAL) return;
     pcb_t* cur_pcb;
     if(sig_num == INTERRUPT){
-        cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (active_array[cur_terminal] + 1));
+        cur_pcb = pcb_array[(uint8_t)active_array[cur_terminal]];
     }else{
-        cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process + 1));
+        cur_pcb = pcb_array[(uint8_t)cur_process];
     }
     cur_pcb->signal_array[sig_num] = 1;
     return;
@@ -29,7 +29,7 @@ void send_signal(uint8_t sig_num){
 void* dft_sig_handler[NUM_SIGNAL] = {&kill_the_task, &kill_the_task, &kill_the_task, &ignore, &ignore};
 
 void do_signal(void){
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process + 1));
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];
     uint8_t sig_num;
     for(sig_num = 0; sig_num < NUM_SIGNAL; sig_num++){
         if(cur_pcb->signal_array[sig_num]){
@@ -7,12 +7,18 @@
 #include "terminal.h"
 #include "scheduler.h"
 #include "signal.h"
+#include "palloc.h"
 
-uint8_t process_array[MAX_PROCESS] = {0,0,0,0,0,0};         // 1 means busy, 0 means free
+uint8_t process_array[MAX_PROCESS] = {0};                   // 1 means busy, 0 means free
 int8_t  cur_process = -1;                                   // Denote the process under execution
-int8_t  parent_pid[MAX_PROCESS] = {-1,-1,-1,-1,-1,-1};      // record parent pid of each process
+int8_t  parent_pid[MAX_PROCESS] = {[0 ... MAX_PROCESS - 1] = -1};   // record parent pid of each process
+pcb_t*  pcb_array[MAX_PROCESS];                             // pcb of each process, at the bottom of its 8K kernel stack
 uint8_t exception_flag = 0;                                 // Denote whether there is exception occur
 
+static file_desc_t open_files[MAX_OPEN_FILES];              // open-file objects, flags 0 means free
+static file_desc_t* fd_pool[FD_POOL_CHUNKS][FD_CHUNK];     // chunks of the fd tables that grew past the pcb
+static uint8_t fd_pool_used[FD_POOL_CHUNKS];                // 1 means an fd table holds the chunk
+
 /*
  * bad_call_open
  *  DESCRIPTION : bad system call for open
@@ -62,11 +68,297 @@ int32_t bad_call_write(int32_t fd, const void* buf, int32_t nbytes){
     return -1;
 }
 
-file_op_t stdin_op = {&bad_call_open, &bad_call_close, &terminal_read, &bad_call_write};            // Initialize the operation table for each file
-file_op_t stdout_op = {&bad_call_open, &bad_call_close, &bad_call_read, &terminal_write};
-file_op_t file_op = {&file_open, &file_close, &file_read, &file_write};
-file_op_t dir_op = {&dir_open, &dir_close, &dir_read, &dir_write};
-file_op_t rtc_op = {&rtc_open, &rtc_close, &rtc_read, &rtc_write};
+/*
+ * bad_call_pread
+ *  DESCRIPTION : bad system call for pread
+ *  INPUTS : ignore
+ *  OUTPUTS : none
+ *  RETURN VALUE : -1
+ *  SIDE EFFECTS : none.
+ */
+int32_t bad_call_pread(int32_t fd, void* buf, int32_t nbytes, uint32_t offset){
+    return -1;
+}
+
+/*
+ * bad_call_pwrite
+ *  DESCRIPTION : bad system call for pwrite
+ *  INPUTS : ignore
+ *  OUTPUTS : none
+ *  RETURN VALUE : -1
+ *  SIDE EFFECTS : none.
+ */
+int32_t bad_call_pwrite(int32_t fd, const void* buf, int32_t nbytes, uint32_t offset){
+    return -1;
+}
+
+/*
+ * bad_call_lseek
+ *  DESCRIPTION : bad system call for lseek, the file has no position to move
+ *  INPUTS : ignore
+ *  OUTPUTS : none
+ *  RETURN VALUE : -1
+ *  SIDE EFFECTS : none.
+ */
+int32_t bad_call_lseek(int32_t fd, int32_t offset, int32_t whence){
+    return -1;
+}
+
+file_op_t stdin_op = {&bad_call_open, &bad_call_close, &terminal_read, &bad_call_write,             // Initialize the operation table for each file
+                      &bad_call_pread, &bad_call_pwrite, &bad_call_lseek};
+file_op_t stdout_op = {&bad_call_open, &bad_call_close, &bad_call_read, &terminal_write,
+                       &bad_call_pread, &bad_call_pwrite, &bad_call_lseek};
+file_op_t file_op = {&file_open, &file_close, &file_read, &file_write,
+                     &file_pread, &file_pwrite, &file_lseek};
+file_op_t dir_op = {&dir_open, &dir_close, &dir_read, &dir_write,
+                    &bad_call_pread, &bad_call_pwrite, &bad_call_lseek};
+file_op_t rtc_op = {&rtc_open, &rtc_close, &rtc_read, &rtc_write,
+                    &bad_call_pread, &bad_call_pwrite, &bad_call_lseek};
+
+/*
+ * file_alloc
+ *  DESCRIPTION : take a free open-file object, held by one reference
+ *  INPUTS : ops -- the operation table of the file
+ *           inode -- inode number, 0 for the terminal and rtc
+ *  OUTPUTS : none
+ *  RETURN VALUE : the open file, positioned at the start
+ *                 NULL if every open-file object is in use
+ *  SIDE EFFECTS : modify open_files
+ */
+static file_desc_t* file_alloc(file_op_t* ops, uint32_t inode){
+    file_desc_t* file = NULL;
+    uint32_t flags, i;
+    cli_and_save(flags);                                                                            // shared by all processes
+    for(i = 0; i < MAX_OPEN_FILES; i++){
+        if(open_files[i].flags == 0){
+            file = &open_files[i];
+            file->file_op_ptr = ops;
+            file->inode = inode;
+            file->file_position = 0;
+            file->flags = 1;
+            file->refcount = 1;
+            break;
+        }
+    }
+    restore_flags(flags);
+    return file;
+}
+
+/*
+ * file_put
+ *  DESCRIPTION : drop one reference to an open file, the last one closes it
+ *  INPUTS : file -- the open file
+ *           fd -- the descriptor that referred to it, handed to the close function
+ *  OUTPUTS : none
+ *  RETURN VALUE : what the close function returns, 0 if other descriptors still refer to the file
+ *  SIDE EFFECTS : may close the file and free its object
+ */
+static int32_t file_put(file_desc_t* file, int32_t fd){
+    uint32_t flags, last;
+    cli_and_save(flags);
+    last = (--file->refcount == 0);
+    restore_flags(flags);
+    if(!last) return 0;
+    int32_t res = file->file_op_ptr->close(fd);                                                     // Call the corresponding close function
+    file->flags = 0;                                                                                // available (not busy)
+    return res;
+}
+
+/*
+ * fd_table_init
+ *  DESCRIPTION : start an empty fd table holding only the chunk inside the pcb
+ *  INPUTS : pcb -- the pcb at its final address, the table points into it
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the fd table of the pcb
+ */
+void fd_table_init(pcb_t* pcb){
+    memset(pcb->fd_inline, 0, sizeof(pcb->fd_inline));
+    memset(pcb->fd_chunks, 0, sizeof(pcb->fd_chunks));
+    memset(pcb->fd_bitmap, 0, sizeof(pcb->fd_bitmap));
+    pcb->fd_chunks[0] = pcb->fd_inline;
+}
+
+/*
+ * fd_install
+ *  DESCRIPTION : give an open file the lowest free descriptor of a process. The first
+ *                word of the bitmap with a clear bit holds it. A descriptor past the
+ *                chunks the table has takes one more chunk from fd_pool.
+ *  INPUTS : pcb -- the pcb of the process
+ *           file -- the open file, the caller's reference goes to the descriptor
+ *  OUTPUTS : none
+ *  RETURN VALUE : the descriptor
+ *                 -1 if the process has FD_MAX descriptors or no chunk is left
+ *  SIDE EFFECTS : modify the fd table of the pcb and fd_pool_used
+ */
+static int32_t fd_install(pcb_t* pcb, file_desc_t* file){
+    uint32_t flags, i, fd = FD_MAX;
+    cli_and_save(flags);
+    for(i = 0; i < FD_MAX / 32; i++){
+        if(pcb->fd_bitmap[i] != 0xFFFFFFFF){
+            for(fd = i * 32; pcb->fd_bitmap[i] & (1 << (fd % 32)); fd++);
+            break;
+        }
+    }
+    if((fd < FD_MAX) && (pcb->fd_chunks[fd / FD_CHUNK] == NULL)){
+        for(i = 0; (i < FD_POOL_CHUNKS) && fd_pool_used[i]; i++);
+        if(i < FD_POOL_CHUNKS){
+            fd_pool_used[i] = 1;
+            pcb->fd_chunks[fd / FD_CHUNK] = fd_pool[i];                                            // the table grows by one chunk
+        } else {
+            fd = FD_MAX;                                                                            // every chunk is taken
+        }
+    }
+    if(fd < FD_MAX){
+        pcb->fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK] = file;
+        pcb->fd_bitmap[fd / 32] |= (1 << (fd % 32));
+    }
+    restore_flags(flags);
+    return (fd < FD_MAX) ? (int32_t)fd : -1;
+}
+
+/*
+ * fd_table_release
+ *  DESCRIPTION : drop every descriptor of a process and give its chunks back to fd_pool
+ *  INPUTS : pcb -- the pcb of the process
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : may close open files, modify the fd table of the pcb and fd_pool_used
+ */
+void fd_table_release(pcb_t* pcb){
+    uint32_t fd;
+    for(fd = 0; fd < FD_MAX; fd++){
+        if(!(pcb->fd_bitmap[fd / 32] & (1 << (fd % 32)))) continue;
+        pcb->fd_bitmap[fd / 32] &= ~(1 << (fd % 32));
+        file_put(pcb->fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK], fd);
+    }
+    for(fd = 1; fd < FD_MAX / FD_CHUNK; fd++){
+        if(pcb->fd_chunks[fd] != NULL) fd_pool_used[(pcb->fd_chunks[fd] - fd_pool[0]) / FD_CHUNK] = 0;
+        pcb->fd_chunks[fd] = NULL;
+    }
+}
+
+/*
+ * fd_lookup
+ *  DESCRIPTION : find the open file behind a descriptor of the current process
+ *  INPUTS : fd -- file descriptor
+ *  OUTPUTS : none
+ *  RETURN VALUE : the open file
+ *                 NULL if fd is out of range or not open
+ *  SIDE EFFECTS : none
+ */
+file_desc_t* fd_lookup(int32_t fd){
+    if((fd < 0) || (fd >= FD_MAX) || (cur_process < 0)) return NULL;
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Get the current pcb based on cur_process
+    if(!(cur_pcb->fd_bitmap[fd / 32] & (1 << (fd % 32)))) return NULL;
+    return cur_pcb->fd_chunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+/*
+ * mmap_page_map
+ *  DESCRIPTION : map one page of a file into an entry of an mmap page table. A data block
+ *                is referenced so it stays allocated while it is mapped, even if the file
+ *                is removed. The data of an inline file lives in its inode, which has no
+ *                reference count, so its page is copied into a frame of its own.
+ *  INPUTS : entry -- a free entry of the mmap page table
+ *           page -- the page fs_data_page returned
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 on success
+ *                 -1 if no frame was left for the copy
+ *  SIDE EFFECTS : modify the entry, take a block reference or a frame from palloc
+ */
+static int32_t mmap_page_map(page_table_entry_t* entry, uint8_t* page){
+    uint32_t frame;
+    memset(entry, 0, sizeof(page_table_entry_t));
+    if(fs_page_get(page) == 0){
+        entry->base_addr = (uint32_t)page / PAGE_SIZE;
+    } else {
+        if((frame = palloc(PALLOC_ORDER_4KB)) == 0) return -1;
+        memcpy(PHYS_TO_VIRT(frame), (uint8_t*)((uint32_t)page & ~(PAGE_SIZE - 1)), PAGE_SIZE);      // the offset into the page stays the same
+        entry->base_addr = frame / PAGE_SIZE;
+        entry->available = MMAP_PAGE_COPY;
+    }
+    entry->present = 1;
+    entry->user_sup = 1;                                                                            // user accessible, read only
+    return 0;
+}
+
+/*
+ * mmap_page_unmap
+ *  DESCRIPTION : clear entries of an mmap page table, dropping the block reference or the
+ *                frame of each page mmap_page_map mapped
+ *  INPUTS : entry -- the first entry
+ *           count -- number of entries
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify the entries, may free data blocks and frames, the caller flushes the TLB
+ */
+static void mmap_page_unmap(page_table_entry_t* entry, uint32_t count){
+    uint32_t i;
+    for(i = 0; i < count; i++){
+        if(!entry[i].present) continue;
+        if(entry[i].available == MMAP_PAGE_COPY) pfree(entry[i].base_addr * PAGE_SIZE, PALLOC_ORDER_4KB);
+        else fs_page_put((uint8_t*)(entry[i].base_addr * PAGE_SIZE));
+        memset(&entry[i], 0, sizeof(page_table_entry_t));
+    }
+}
+
+/*
+ * process_alloc
+ *  DESCRIPTION : take the memory of a new process from palloc: 8K for the pcb and the kernel
+ *                stack, the page tables of the program and mmap windows, a frame for each
+ *                page of the image and one for the top of the stack. Other pages of the
+ *                program window are mapped when they are first touched.
+ *  INPUTS : pid -- the pid of the new process
+ *           exe_len -- bytes of the program image
+ *  OUTPUTS : none
+ *  RETURN VALUE : the pcb, with pid, user_tbl and mmap_tbl filled in
+ *                 NULL if memory ran out or the image does not fit the window
+ *  SIDE EFFECTS : modify pcb_array
+ */
+static pcb_t* process_alloc(uint8_t pid, uint32_t exe_len){
+    uint32_t pcb_frame = palloc(PALLOC_ORDER_8KB);
+    uint32_t user_tbl = palloc(PALLOC_ORDER_4KB);
+    uint32_t mmap_tbl = palloc(PALLOC_ORDER_4KB);
+    uint32_t stack_page = user_virt_addr + SIZE_4MB - SIZE_4KB;
+    uint32_t addr;
+    int32_t ret = ((pcb_frame == 0) || (user_tbl == 0) || (mmap_tbl == 0) || (exe_len > stack_page - user_img_addr)) ? -1 : 0;
+    if(user_tbl != 0) memset(PHYS_TO_VIRT(user_tbl), 0, PAGE_SIZE);
+    for(addr = user_img_addr; (ret == 0) && (addr < user_img_addr + exe_len); addr += SIZE_4KB){
+        ret = user_paging_map(user_tbl, addr);                                                      // the image
+    }
+    if(ret == 0) ret = user_paging_map(user_tbl, stack_page);
+    if(ret != 0){
+        if(pcb_frame != 0) pfree(pcb_frame, PALLOC_ORDER_8KB);
+        if(user_tbl != 0) user_paging_free(user_tbl);                                               // with the pages mapped so far
+        if(mmap_tbl != 0) pfree(mmap_tbl, PALLOC_ORDER_4KB);
+        return NULL;
+    }
+    pcb_t* pcb = (pcb_t*)PHYS_TO_VIRT(pcb_frame);
+    pcb->pid = pid;
+    pcb->user_tbl = user_tbl;
+    pcb->mmap_tbl = mmap_tbl;
+    memset(PHYS_TO_VIRT(mmap_tbl), 0, PAGE_SIZE);                                                   // a new process starts with no mapped files
+    pcb_array[pid] = pcb;
+    return pcb;
+}
+
+/*
+ * process_free
+ *  DESCRIPTION : give the memory of a process back to palloc. The pcb stays readable until
+ *                palloc hands the frames out again, which cannot happen with interrupts off.
+ *  INPUTS : pcb -- the pcb of the process
+ *  OUTPUTS : none
+ *  RETURN VALUE : none
+ *  SIDE EFFECTS : modify pcb_array
+ */
+static void process_free(pcb_t* pcb){
+    pcb_array[pcb->pid] = NULL;
+    mmap_page_unmap(PHYS_TO_VIRT(pcb->mmap_tbl), DIR_TBL_SIZE);                                     // the files it left mapped
+    pfree(pcb->mmap_tbl, PALLOC_ORDER_4KB);
+    user_paging_free(pcb->user_tbl);
+    pfree(VIRT_TO_PHYS(pcb), PALLOC_ORDER_8KB);
+}
 
 /*
  * sys_call_handler_temp
@@ -93,38 +385,34 @@ int32_t halt (uint8_t status){
     cli();
 
     /* Restore parent data */
-    pcb_t* halt_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process + 1));                  // Reserved for deleting relevant FDs; halt_pcb is the pcb of child process we will halt 
+    pcb_t* halt_pcb = pcb_array[(uint8_t)cur_process];                                              // Reserved for deleting relevant FDs; halt_pcb is the pcb of child process we will halt 
     cur_process = parent_pid[(uint8_t)cur_process];                                                 // Set cur_process to the parent process of the process going to be halted
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process + 1));                   // Set current pcb
 
     process_array[halt_pcb->pid] = 0;                                                               // Set the process going to be halted status to free
     if(parent_pid[halt_pcb->pid] == -1){
         printf("Can not halt base shell!\n");
         cur_process = -1;
+        fd_table_release(halt_pcb);                                                                 // stdin, stdout and the rest go back to the pools
+        process_free(halt_pcb);                                                                     // execute takes the memory again
         execute((const uint8_t*)"shell");
     }
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Set current pcb
 
     tss.ss0 = KERNEL_DS;                                                                            // Set ss0 and esp0 in tss
-    tss.esp0 = KERNEL_STACK_START - SIZE_8KB * (cur_pcb->pid) - sizeof(uint32_t);
+    tss.esp0 = (uint32_t)cur_pcb + SIZE_8KB - sizeof(uint32_t);
 
     /* update scheduling active array */
     active_array[sche_term] = cur_process;
     parent_pid[halt_pcb->pid] = -1;                                                                 // Set the parent of the halted process to -1
 
     /* Restore parent paging */
-    uint32_t phys_addr = USER_START_ADDR + cur_process * PROGRAM_SIZE;
-    page_dir[user_virt_addr / PAGE_SIZE_4M].base_addr = phys_addr / PAGE_SIZE;                      // virtual mem. 128M -> phys mem. (8M + pid * 4M)
+    user_paging(cur_process);                                                                       // virtual mem. 128M -> the parent's pages
+    mmap_paging(cur_process);                                                                       // the parent's mapped files
     flush_TLB();                                                                                    // Flush TLB after swapping page
 
     /* Close any relevant FDs */
-    uint8_t i;
-    for(i = 2; i < MAX_FILE_NUM; i++)
-    {
-        if(halt_pcb->file_array[i].flags == 1){
-            halt_pcb->file_array[i].file_op_ptr->close(i);
-            halt_pcb->file_array[i].flags = 0;                                                      // Set all flags to 0
-        }
-    }
+    fd_table_release(halt_pcb);                                                                     // files other processes share stay open
+    process_free(halt_pcb);                                                                         // its stack stays usable until the jump below
 
     /* Jump to execute return */
     uint32_t halt_ret = (uint32_t) status;                                                          // Return the value of status
@@ -161,12 +449,12 @@ int32_t execute (const uint8_t* command){
     /* Parse args */
     if(NULL == command) return -1;                                                                  // If command is NULL(invalid), return -1
     uint32_t cmd_len = strlen((int8_t*)command);
-    int8_t   exe_file[MAX_FILENAME_LEN + 1] = {'\0'};                                               // leave 1 place for "\0"
+    int8_t   exe_file[FS_MAX_PATH_LEN + 1] = {'\0'};                                                // leave 1 place for "\0"
     int8_t   args[BUFFER_SIZE + 1] = {'\0'};                                                        // leave 1 place for "\0"
     uint8_t i;
     for(i = 0; i <= cmd_len; i++){
         if(command[i] == '\0' || command[i] == ' '){
-            uint32_t exe_len = MAX_FILENAME_LEN;
+            uint32_t exe_len = FS_MAX_PATH_LEN;                                                     // the program may be given by its path
             if(exe_len > i) exe_len = i;
             strncpy(exe_file, (int8_t*)command, exe_len);                                           // Store the exe_file given by the command
             break;
@@ -181,17 +469,27 @@ int32_t execute (const uint8_t* command){
 
     /* Executable check */
     dentry_t exe_dentry;
-    uint8_t exe_check[4];                                                                           // Used to store the 4 bytes that denote the executable file
+    uint32_t eip;                                                                                   // the entry point, bytes 24-27 of the file
+    uint32_t exe_len;                                                                               // bytes of the program image
     if(-1 == read_dentry_by_name((uint8_t*)exe_file, &exe_dentry)){
         printf("cannot find file \"%s\"\n", (char*)exe_file);
         return -1;
     }
-    read_data(exe_dentry.inode, 0, exe_check, 4);                                                   // Read the 4 bytes that denote the executable file
-    if((exe_check[0] != 0x7f) || (exe_check[1] != 0x45) || (exe_check[2] != 0x4c) || (exe_check[3] != 0x46)){       // Compare with 4 bytes that denote executable file
+    if(-1 == fs_exec_info(exe_dentry.inode, &eip, &exe_len)){                                       // the magic number, remembered until the file changes
         printf("\"%s\" is not an executable file\n", (char*)exe_file);                              // Determine whether it is an executable file
         return -1;
     }
 
+    /* Open the terminal as stdin and stdout */
+    file_desc_t* std_in = file_alloc(&stdin_op, 0);
+    file_desc_t* std_out = file_alloc(&stdout_op, 0);
+    if((std_in == NULL) || (std_out == NULL)){
+        if(std_in != NULL) file_put(std_in, 0);
+        if(std_out != NULL) file_put(std_out, 1);
+        printf("Cannot open the terminal, too many open files!\n");
+        return -1;
+    }
+
     /* Obtain pid and update scheduling active array */
     uint8_t cur_pid;
     for(i = 0; i < MAX_PROCESS; i++){
@@ -201,61 +499,58 @@ int32_t execute (const uint8_t* command){
             break;
         }
     }
-    if(i == MAX_PROCESS){
-        printf("Cannot create new process!\n");                                                     // If it is full, we cannot create a new process
+    pcb_t* pcb_addr = (i < MAX_PROCESS) ? process_alloc(cur_pid, exe_len) : NULL;                   // the pcb, the kernel stack and the program pages
+    if(pcb_addr == NULL){
+        if(i < MAX_PROCESS) process_array[cur_pid] = 0;
+        printf("Cannot create new process!\n");                                                     // If pids or memory ran out, we cannot create a new process
+        file_put(std_in, 0);
+        file_put(std_out, 1);
         return -1;
     }
     active_array[sche_term] = cur_pid;
     parent_pid[cur_pid] = cur_process;
 
     /* Set up program paging */
-    uint32_t phys_addr = USER_START_ADDR + cur_pid * PROGRAM_SIZE;
-    page_dir[user_virt_addr / PAGE_SIZE_4M].base_addr = phys_addr / PAGE_SIZE;                      // virtual mem. 128M -> phys mem. (8M + pid * 4M)
-    page_dir[user_virt_addr / PAGE_SIZE_4M].present = 1;                                            // Set the paging bits to be present and to user level
-    page_dir[user_virt_addr / PAGE_SIZE_4M].user_sup = 1;
+    user_paging(cur_pid);                                                                           // virtual mem. 128M -> the pages from process_alloc
+    mmap_paging(cur_pid);
     flush_TLB();                                                                                    // Flush TLB after swapping page
 
     /* User-level Program loader */
-    read_data(exe_dentry.inode, 0, (uint8_t*)user_img_addr,(inode_ptr[exe_dentry.inode]).length);   // Load the program
-
-    /* Create PCB */
-    pcb_t cur_pcb;
-    cur_pcb.pid = cur_pid;
-    cur_process = cur_pid;
-
-    memset(cur_pcb.args, '\0', BUFFER_SIZE+1);
-    memcpy(cur_pcb.args, args, strlen(args));                                                       // Copy cmd args to pcb
-
-    for(i = 0; i < MAX_FILE_NUM; i++){
-        cur_pcb.file_array[i].flags = 0;                                                            // Initialize all the files to "not busy"
+    if((int32_t)exe_len != read_data(exe_dentry.inode, 0, (uint8_t*)user_img_addr, exe_len)){       // Load the program
+        active_array[sche_term] = cur_process;                                                      // Give the terminal back to the caller
+        parent_pid[cur_pid] = -1;
+        user_paging(cur_process);                                                                   // virtual mem. 128M -> the caller's pages
+        mmap_paging(cur_process);
+        flush_TLB();
+        process_free(pcb_addr);
+        process_array[cur_pid] = 0;
+        printf("Cannot load \"%s\"!\n", (char*)exe_file);
+        file_put(std_in, 0);
+        file_put(std_out, 1);
+        return -1;
     }
 
-    cur_pcb.file_array[0].file_op_ptr = &stdin_op;                                                  // Initialize the first two files (stdin and stdout)
-    cur_pcb.file_array[0].inode = 0;                                                                // Set its inode to 0 (not a data file)
-    cur_pcb.file_array[0].file_position = 0;                                                        // Initialize the position to the start (0)
-    cur_pcb.file_array[0].flags = 1;                                                                // Set it to be "busy"
+    /* Fill in PCB */
+    cur_process = cur_pid;
 
-    cur_pcb.file_array[1].file_op_ptr = &stdout_op;
-    cur_pcb.file_array[1].inode = 0;                                                                // Set its inode to 0 (not a data file)
-    cur_pcb.file_array[1].file_position = 0;                                                        // Initialize the position to the start (0)
-    cur_pcb.file_array[1].flags = 1;                                                                // Set it to be "busy"
+    memset(pcb_addr->args, '\0', BUFFER_SIZE+1);
+    memcpy(pcb_addr->args, args, strlen(args));                                                     // Copy cmd args to pcb
 
     for(i = 0; i < NUM_SIGNAL; i++){
-        cur_pcb.signal_array[i] = 0;                                                                // Initialize all the signal
-        cur_pcb.sig_mask[i] = 0;
-        cur_pcb.sig_handler[i] = dft_sig_handler[i];
+        pcb_addr->signal_array[i] = 0;                                                              // Initialize all the signal
+        pcb_addr->sig_mask[i] = 0;
+        pcb_addr->sig_handler[i] = dft_sig_handler[i];
     }
 
-    pcb_t* pcb_addr = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_pid + 1));                      // Find the pcb address of current process
-    *pcb_addr = cur_pcb; 
+    fd_table_init(pcb_addr);
+    fd_install(pcb_addr, std_in);                                                                   // descriptor 0, the chunk in the pcb always has room
+    fd_install(pcb_addr, std_out);                                                                  // descriptor 1
 
     /* Context Switch */
-    uint32_t eip;
-    read_data(exe_dentry.inode, EIP_START, (uint8_t*)&eip, 4);                                      // Set eip by the 24-27 bytes
     uint32_t cs = USER_CS;                                                                          // Get the arguments needed for IRET
     uint32_t ds = USER_DS;
     uint32_t esp = user_virt_addr + SIZE_4MB - sizeof(uint32_t);                                    
-    tss.esp0 = KERNEL_STACK_START - SIZE_8KB * cur_pid - sizeof(uint32_t);
+    tss.esp0 = (uint32_t)pcb_addr + SIZE_8KB - sizeof(uint32_t);                                    // the top of the 8K the pcb starts
     tss.ss0 = KERNEL_DS;
     asm volatile(                                                                        
         "movl   %%ebp, %0\n"                                                                        // Store execute's ebp
@@ -288,13 +583,13 @@ int32_t execute (const uint8_t* command){
  */
 int32_t read (int32_t fd, void* buf, int32_t nbytes){
     /* invalid fd */
-    if ((fd >= MAX_FILE_NUM) || (fd < 0)) {                                                          // If fd is invalid, return -1
+    if ((fd >= FD_MAX) || (fd < 0)) {                                                                // If fd is invalid, return -1
         printf("invalid file descriptor!\n");
         return -1;
     }
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));                     // Get the current pcb based on cur_process
-    if(cur_pcb->file_array[fd].flags == 0) return -1;
-    int32_t res = cur_pcb->file_array[fd].file_op_ptr->read(fd, buf, nbytes);                       // Call the corresponding read function
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;
+    int32_t res = file->file_op_ptr->read(fd, buf, nbytes);                       // Call the corresponding read function
     return res;
 }
 
@@ -311,16 +606,69 @@ int32_t read (int32_t fd, void* buf, int32_t nbytes){
  */
 int32_t write (int32_t fd, const void* buf, int32_t nbytes){
     /* invalid fd */
-    if ((fd >= MAX_FILE_NUM) || (fd < 0)) {                                                          // If fd is invalid, return -1
+    if ((fd >= FD_MAX) || (fd < 0)) {                                                                // If fd is invalid, return -1
         printf("invalid file descriptor!\n");
         return -1;
     }
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));                     // Get the current pcb based on cur_process
-    if(cur_pcb->file_array[fd].flags == 0) return -1;
-    int32_t res = cur_pcb->file_array[fd].file_op_ptr->write(fd, buf, nbytes);                      // Call the corresponding write function
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;
+    int32_t res = file->file_op_ptr->write(fd, buf, nbytes);                      // Call the corresponding write function
     return res;
 }
 
+/*
+ * lseek
+ *  DESCRIPTION : move the position of fd that the next read or write starts from.
+ *  INPUTS : fd -- file descriptor.
+ *           offset -- where to move, relative to whence.
+ *           whence -- SEEK_SET (start of file), SEEK_CUR (current position) or SEEK_END (end of file).
+ *  OUTPUTS : none
+ *  RETURN VALUE : the new position from the start of the file.
+ *                 -1 if the fd is not valid, the file cannot seek, or the position would be negative.
+ *  SIDE EFFECTS : modify the file position of fd
+ */
+int32_t lseek (int32_t fd, int32_t offset, int32_t whence){
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;                                                                     // If fd is invalid, return -1
+    return file->file_op_ptr->lseek(fd, offset, whence);                          // Call the corresponding lseek function
+}
+
+/*
+ * pread
+ *  DESCRIPTION : read nbytes from fd file at the given offset. The position of fd is neither used nor moved.
+ *  INPUTS : fd -- file descriptor. "source of reading"
+ *           buf -- buffer used to store message. "destination of reading"
+ *           nbytes -- number of bytes to be read.
+ *           offset -- where to start reading, from the start of the file.
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes read, 0 at or past the end of the file.
+ *                 -1 if the fd is not valid or the file cannot be read at an offset.
+ *  SIDE EFFECTS : modify the buf
+ */
+int32_t pread (int32_t fd, void* buf, int32_t nbytes, uint32_t offset){
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;                                                                     // If fd is invalid, return -1
+    return file->file_op_ptr->pread(fd, buf, nbytes, offset);                     // Call the corresponding pread function
+}
+
+/*
+ * pwrite
+ *  DESCRIPTION : write nbytes from buf into fd file at the given offset. The position of fd is neither used nor moved.
+ *  INPUTS : fd -- file descriptor. "destination of writing"
+ *           buf -- buffer used to store message. "source of writing"
+ *           nbytes -- number of bytes to be written.
+ *           offset -- where to start writing, from the start of the file.
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes written.
+ *                 -1 if the fd is not valid or the file cannot be written at an offset.
+ *  SIDE EFFECTS : modify the fd file
+ */
+int32_t pwrite (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset){
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;                                                                     // If fd is invalid, return -1
+    return file->file_op_ptr->pwrite(fd, buf, nbytes, offset);                    // Call the corresponding pwrite function
+}
+
 /*
  * open
  *  DESCRIPTION : find the directory entry corresponding to the named file, allocate an unused file descriptor. 
@@ -331,46 +679,30 @@ int32_t write (int32_t fd, const void* buf, int32_t nbytes){
  *  SIDE EFFECTS : none.
  */
 int32_t open (const uint8_t* filename){
-    int32_t fd = -1;
+    int32_t fd;
     dentry_t dentry;
-    int32_t i;
+    file_op_t* ops;
     if (-1 == read_dentry_by_name(filename, &dentry)){
         // printf("Can't find the filename %s\n", filename);                                             // Cannot find the file
         return -1;
     }
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));                     // Get the current pcb based on cur_process
-    for(i = 0; i < MAX_FILE_NUM; i++){
-        if(0 == cur_pcb->file_array[i].flags){
-            fd = i;                                                                                 // Traverse to get the "not busy" position
-            break;
-        }
+
+    if (dentry.file_type == 0) ops = &rtc_op;                                                       // rtc type file
+    else if (dentry.file_type == 1) ops = &dir_op;                                                  // directory type file, FS_ROOT_INODE for "."
+    else ops = &file_op;                                                                            // regular file
+    file_desc_t* file = file_alloc(ops, (dentry.file_type == 0) ? 0 : dentry.inode);                // rtc is not a data file
+    if (NULL == file){
+        printf("too many open files right now!\n");
+        return -1;
     }
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Get the current pcb based on cur_process
+    fd = fd_install(cur_pcb, file);
     if (-1 == fd){
-        printf("file descriptor array is full right now!\n");                                         // Cannot find the "not busy" position
+        printf("file descriptor table is full right now!\n");                                         // No descriptor left to grow into
+        file->flags = 0;                                                                            // never opened, nothing to close
         return -1;
     }
-
-    cur_pcb->file_array[fd].file_position = 0;                                                      // from the start of the file
-    cur_pcb->file_array[fd].flags = 1;             // busy
-    
-    if (dentry.file_type == 0) {
-        /* rtc type file */
-        cur_pcb->file_array[fd].inode = 0;                                                          // not a data file
-        cur_pcb->file_array[fd].file_op_ptr = &rtc_op;                                              // Set operation table
-    }
-
-    else if (dentry.file_type == 1) {
-        /* directory type file */
-        cur_pcb->file_array[fd].inode = 0;                                                          // not a data file
-        cur_pcb->file_array[fd].file_op_ptr = &dir_op;                                              // Set operation table
-    }
-
-    else {
-        /* regular file */ 
-        cur_pcb->file_array[fd].inode = dentry.inode;                                               // a data file, set inode based on dentry
-        cur_pcb->file_array[fd].file_op_ptr = &file_op;                                             // Set operation table
-    }
-    cur_pcb->file_array[fd].file_op_ptr->open(filename);                                            // Call the corresponding open function
+    file->file_op_ptr->open(filename);                                                              // Call the corresponding open function
 
     return fd;                                         
 }
@@ -385,17 +717,16 @@ int32_t open (const uint8_t* filename){
  *  SIDE EFFECTS : none.
  */
 int32_t close (int32_t fd){
-    if ((fd == 0) || (fd == 1) || (fd >= MAX_FILE_NUM) || (fd < 0)){                                   // If fd is invalid, return -1
+    if ((fd == 0) || (fd == 1) || (fd >= FD_MAX) || (fd < 0)){                                       // If fd is invalid, return -1
         printf("invalid file descriptor!\n");
         return -1;
     }              
     
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));                     // Get the current pcb based on cur_process
-    if(cur_pcb->file_array[fd].flags == 0) return -1;
-    cur_pcb->file_array[fd].flags = 0; // available (not busy)    
-    
-    int32_t res =  cur_pcb->file_array[fd].file_op_ptr->close(fd);                                  // Call the corresponding close function
-    return res;
+    file_desc_t* file = fd_lookup(fd);
+    if(file == NULL) return -1;
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Get the current pcb based on cur_process
+    cur_pcb->fd_bitmap[fd / 32] &= ~(1 << (fd % 32));                                               // available (not busy)
+    return file_put(file, fd);                                                                      // the file closes with its last descriptor
 }
 
 /*
@@ -409,7 +740,7 @@ int32_t close (int32_t fd){
  *  SIDE EFFECTS : modify the user-level buffer
  */
 int32_t getargs (uint8_t* buf, int32_t nbytes){
-    pcb_t* cur_pcb = (pcb_t*)(KERNEL_STACK_START - SIZE_8KB * (cur_process+1));                     // Get the current pcb based on cur_process
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Get the current pcb based on cur_process
     int8_t* args = cur_pcb->args;
     if(args[0] == '\0' || (strlen((int8_t*)args) > nbytes)) return -1;                              // check the existence of argument, or avoid not fitting in the buffer
     strncpy((int8_t*)buf, args, nbytes);
@@ -457,16 +788,14 @@ int32_t sigreturn (void){
 
 int32_t cp (uint8_t* buf)
 {
-    int8_t   src[32 + 1] = {'\0'};                                               // leave 1 place for "\0"
-    int8_t   dst[32 + 1] = {'\0'};                                               // leave 1 place for "\0"
+    int8_t   src[FS_MAX_PATH_LEN + 1] = {'\0'};                                  // leave 1 place for "\0"
+    int8_t   dst[FS_MAX_PATH_LEN + 1] = {'\0'};                                  // leave 1 place for "\0"
     uint8_t i;
-    int32_t fd_src, fd_dst, cnt;
-    uint8_t cp_buf[1024];
     /* try to split the two arguments */
     uint32_t args_len = strlen((int8_t*)buf);
     for(i = 0; i <= args_len; i++){
         if(buf[i] == '\0' || buf[i] == ' '){
-            uint32_t src_len = 32;
+            uint32_t src_len = FS_MAX_PATH_LEN;
             if(src_len > i) src_len = i;
             strncpy(src, (int8_t*)buf, src_len);                                           // Store the exe_file given by the buf
             break;
@@ -474,65 +803,327 @@ int32_t cp (uint8_t* buf)
     }
     for(; i < args_len; i++){
         if(buf[i] != '\0' && buf[i] != ' '){
-            strncpy(dst, (int8_t*)(buf + i), args_len - i);                                     // Store the argument given by the buf
+            uint32_t dst_len = args_len - i;
+            if(dst_len > FS_MAX_PATH_LEN) dst_len = FS_MAX_PATH_LEN;
+            strncpy(dst, (int8_t*)(buf + i), dst_len);                                          // Store the argument given by the buf
             break;
         }
     }
 
-    /* read dentries for two args*/
+    /* read dentries for two args, the copy is created when it does not exist yet */
     dentry_t src_dentry, dst_dentry;
-    if(-1 == read_dentry_by_name((uint8_t*)src, &src_dentry)){
+    if(-1 == path_lookup(FS_ROOT_INODE, (uint8_t*)src, &src_dentry) || src_dentry.file_type != FILE_TYPE_REGULAR){
         printf("cannot find file \"%s\"\n", (char*)src);
         return -1;
     }
-    if(-1 == read_dentry_by_name((uint8_t*)dst, &dst_dentry)){
-        printf("cannot find file \"%s\"\n", (char*)dst);
+    if(-1 == path_lookup(FS_ROOT_INODE, (uint8_t*)dst, &dst_dentry)){
+        if(-1 == fs_create(FS_ROOT_INODE, (uint8_t*)dst, FILE_TYPE_REGULAR) ||
+           -1 == path_lookup(FS_ROOT_INODE, (uint8_t*)dst, &dst_dentry)){
+            printf("cannot create file \"%s\"\n", (char*)dst);
+            return -1;
+        }
+    }
+    if(dst_dentry.file_type != FILE_TYPE_REGULAR){
+        printf("\"%s\" is not a regular file\n", (char*)dst);
         return -1;
     }
 
-    inode_t* src_inode_ptr = inode_ptr + src_dentry.inode;
-    inode_t* dst_inode_ptr = inode_ptr + dst_dentry.inode;
+    return fs_reflink(src_dentry.inode, dst_dentry.inode);                                      // share the blocks, copy them on write
+}
 
-    memcpy(dst_inode_ptr, src_inode_ptr, 4096);
+/*
+ * rm
+ *  DESCRIPTION : remove a regular file or an empty directory
+ *  INPUTS : buf -- path of the file, starting from the root
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 if the file was removed
+ *                 -1 if it does not exist or is a directory that is not empty
+ *  SIDE EFFECTS : free the dentry, the inode and the data blocks of the file
+ */
+int32_t rm(uint8_t* buf)
+{
+    return fs_remove(FS_ROOT_INODE, buf);                                                         // tombstone the dentry, no later dentry moves
+}
 
-    // fd_src = open(src);
-    // fd_dst = open(dst);
+/*
+ * mkdir
+ *  DESCRIPTION : create an empty directory
+ *  INPUTS : path -- path of the new directory, starting from the root
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 if the directory was created
+ *                 -1 if the parent does not exist, the name is taken, or there is no space left
+ *  SIDE EFFECTS : add a dentry to the parent directory
+ */
+int32_t mkdir(const uint8_t* path)
+{
+    return fs_create(FS_ROOT_INODE, path, FILE_TYPE_DIR);
+}
+
+/*
+ * stat
+ *  DESCRIPTION : report the size, type and inode of a file without opening it
+ *  INPUTS : filename -- path of the file, starting from the root
+ *           buf -- the fs_stat_t to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 if the file exists
+ *                 -1 if it does not or buf is NULL
+ *  SIDE EFFECTS : modify the buf
+ */
+int32_t stat(const uint8_t* filename, fs_stat_t* buf)
+{
+    dentry_t dentry;
+    if ((filename == NULL) || (buf == NULL)) return -1;
+    if (-1 == read_dentry_by_name(filename, &dentry)) return -1;
+    return fs_stat(dentry.inode, dentry.file_type, buf);
+}
 
-    // while (0 != (cnt = file_read (fd_src, cp_buf, 1024))) 
-    // {
-    //     if (-1 == cnt) {
-	//     printf("file read failed\n");
-	//     return -1;
-	// }
-	// if (-1 == file_write (fd_dst, cp_buf, cnt))
-	//     return -1;
-    // }
+/*
+ * fstat
+ *  DESCRIPTION : report the size, type and inode of an open file
+ *  INPUTS : fd -- file descriptor of the file
+ *           buf -- the fs_stat_t to fill in
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 if fd is an open file, directory or rtc
+ *                 -1 if fd is invalid, closed, the terminal, or buf is NULL
+ *  SIDE EFFECTS : modify the buf
+ */
+int32_t fstat(int32_t fd, fs_stat_t* buf)
+{
+    uint32_t file_type;
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (buf == NULL)) return -1;
+    if (file_desc->file_op_ptr == &file_op) file_type = FILE_TYPE_REGULAR;                          // the operation table tells the type
+    else if (file_desc->file_op_ptr == &dir_op) file_type = FILE_TYPE_DIR;
+    else if (file_desc->file_op_ptr == &rtc_op) file_type = FILE_TYPE_RTC;
+    else return -1;                                                                                 // stdin and stdout are not files
+    return fs_stat(file_desc->inode, file_type, buf);
+}
 
-    // return 0;
+/*
+ * getdents
+ *  DESCRIPTION : read as many directory records as fit in buf in one call
+ *  INPUTS : fd -- file descriptor of an open directory
+ *           buf -- buffer of fs_dirent_t records to fill
+ *           nbytes -- the size of buf
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes filled, 0 at the end of the directory
+ *                 -1 if fd is not an open directory or buf cannot hold one record
+ *  SIDE EFFECTS : modify the buf, advance the directory position
+ */
+int32_t getdents(int32_t fd, void* buf, int32_t nbytes)
+{
+    file_desc_t* file = fd_lookup(fd);
+    if ((file == NULL) || (file->file_op_ptr != &dir_op)) return -1;                                // If fd is invalid, return -1
+    return dir_getdents(fd, buf, nbytes);
 }
 
-int32_t rm(uint8_t* buf)
+/*
+ * mmap
+ *  DESCRIPTION : map pages of an open regular file read-only into the mmap window of the
+ *                current process. The pages are the data blocks of the file system image
+ *                themselves, nothing is copied, and each keeps its block allocated until it
+ *                is unmapped. A write to the file copies a mapped block first, so it is
+ *                not seen through the mapping. Inline files are mapped as a copy.
+ *  INPUTS : fd -- file descriptor of an open regular file
+ *           offset -- where the mapping starts in the file, a multiple of 4KB
+ *           length -- number of bytes to map, 0 maps up to the end of the file
+ *  OUTPUTS : none
+ *  RETURN VALUE : the user address of the byte at offset
+ *                 -1 if fd is not a regular file, the file is compressed, offset is bad,
+ *                 or the window has no room left
+ *  SIDE EFFECTS : modify the mmap page table of the current process, take a reference to
+ *                 each mapped block
+ */
+int32_t mmap(int32_t fd, uint32_t offset, uint32_t length)
 {
-    /* non-existent file */
-    uint32_t name_len = strlen((char *)buf);
+    uint32_t first, num_pages, slot, run, i;
+    uint8_t* page;
+    file_desc_t* file_desc = fd_lookup(fd);
+    if ((file_desc == NULL) || (file_desc->file_op_ptr != &file_op)) return -1;                     // If fd is invalid, return -1
+    uint32_t file_len = inode_ptr[file_desc->inode].length;
+    if ((offset % PAGE_SIZE) || (offset >= file_len)) return -1;
+    if ((length == 0) || (length > file_len - offset)) length = file_len - offset;
+    first = offset / PAGE_SIZE;
+    num_pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    if(buf == NULL) return -1;                                                                    // If the filename is NULL, return -1
+    /* first fit: find num_pages free entries in a row */
+    page_table_entry_t* table = PHYS_TO_VIRT(pcb_array[(uint8_t)cur_process]->mmap_tbl);
+    for (slot = 0, run = 0; (slot < DIR_TBL_SIZE) && (run < num_pages); slot++) {
+        run = table[slot].present ? 0 : run + 1;
+    }
+    if (run < num_pages) return -1;                                                                 // the 4M window is full
+    slot -= num_pages;
 
-    if (name_len > MAX_FILENAME_LEN) return -1;                                                                   // If the filename length is out of range, return -1
+    for (i = 0; i < num_pages; i++) {
+        page = fs_data_page(file_desc->inode, first + i);
+        if ((page == NULL) || (mmap_page_map(&table[slot + i], page) != 0)) {
+            mmap_page_unmap(table + slot, i);                                                       // undo the pages mapped so far
+            flush_TLB();
+            return -1;
+        }
+    }
+    flush_TLB();
+    page = fs_data_page(file_desc->inode, first);
+    return USER_MMAP_ADDR + slot * PAGE_SIZE + ((uint32_t)page % PAGE_SIZE);                        // inline data starts inside its page
+}
 
-    int i, j;
-    for(i = 0; i < (boot_block_ptr->num_dir_entries); i++){                                         // Traverse the dentries
-        dentry_t* cur_dentry = &(dentry_ptr[i]);
-        uint32_t dentry_len = strlen((int8_t*)(cur_dentry->file_name));
-        if(dentry_len > MAX_FILENAME_LEN) dentry_len = MAX_FILENAME_LEN;
-        if((name_len == dentry_len) && (!strncmp((int8_t*)buf, (int8_t*)(cur_dentry->file_name), name_len))){      // If we find the corresponding file, call read_dentry_by_index to write to the buffer
-            break;                                                                              // Successfully find the file: return 0
+/*
+ * munmap
+ *  DESCRIPTION : remove the pages covering [addr, addr + length) from the mmap window
+ *  INPUTS : addr -- an address returned by mmap
+ *           length -- the number of bytes mapped there
+ *  OUTPUTS : none
+ *  RETURN VALUE : 0 on success
+ *                 -1 if the range is outside the mmap window
+ *  SIDE EFFECTS : modify the mmap page table of the current process, drop the references
+ *                 mmap took, which may free blocks of removed files
+ */
+int32_t munmap(void* addr, uint32_t length)
+{
+    uint32_t start = (uint32_t)addr;
+    if ((cur_process < 0) || (start < USER_MMAP_ADDR) || (length == 0)) return -1;
+    if ((start - USER_MMAP_ADDR >= PAGE_SIZE_4M) || (length > PAGE_SIZE_4M - (start - USER_MMAP_ADDR))) return -1;
+    uint32_t first = (start - USER_MMAP_ADDR) / PAGE_SIZE;
+    uint32_t last = (start - USER_MMAP_ADDR + length - 1) / PAGE_SIZE;
+    page_table_entry_t* table = PHYS_TO_VIRT(pcb_array[(uint8_t)cur_process]->mmap_tbl);
+    mmap_page_unmap(&table[first], last - first + 1);
+    flush_TLB();
+    return 0;
+}
+
+/*
+ * sendfile
+ *  DESCRIPTION : copy up to count bytes from the position of in_fd to out_fd inside the kernel.
+ *                Each block of the file is handed to the write function of out_fd straight from
+ *                the file system image; only compressed files go through a bounce buffer.
+ *  INPUTS : out_fd -- file descriptor to write to, anything with a write function (the terminal, a file)
+ *           in_fd -- file descriptor of an open regular file
+ *           count -- the most bytes to copy
+ *  OUTPUTS : none
+ *  RETURN VALUE : the number of bytes copied, 0 at the end of the file
+ *                 -1 if either fd is invalid or in_fd is not a regular file
+ *  SIDE EFFECTS : advance the position of in_fd past the bytes copied
+ */
+int32_t sendfile(int32_t out_fd, int32_t in_fd, int32_t count)
+{
+    static uint8_t bounce[BLOCK_SIZE];                                                              // for blocks that are not stored as is
+    const uint8_t* data;
+    int32_t sent = 0, chunk, ret;
+    file_desc_t* in = fd_lookup(in_fd);
+    file_desc_t* out = fd_lookup(out_fd);
+    if ((in == NULL) || (out == NULL) || (in->file_op_ptr != &file_op) || (count < 0)) return -1;
+    uint32_t length = inode_ptr[in->inode].length;
+
+    while ((sent < count) && (in->file_position < length)) {
+        uint32_t in_block = in->file_position % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - in_block;                                                              // up to the end of the block
+        if (chunk > length - in->file_position) chunk = length - in->file_position;
+        if (chunk > count - sent) chunk = count - sent;
+        data = fs_data_page(in->inode, in->file_position / BLOCK_SIZE);
+        if (data != NULL) {
+            data += in_block;
+        } else {
+            chunk = read_data(in->inode, in->file_position, bounce, chunk);                          // compressed, decode into the bounce buffer
+            if (chunk <= 0) break;
+            data = bounce;
         }
+        ret = out->file_op_ptr->write(out_fd, data, chunk);
+        if (ret <= 0) break;
+        in->file_position += ret;
+        sent += ret;
+        if (ret < chunk) break;                                                                     // the writer is full
     }
-    if(i == (boot_block_ptr->num_dir_entries)) return -1;
-    for(j = i; j < (boot_block_ptr->num_dir_entries); j++)
-    {
-        memcpy(dentry_ptr + j, dentry_ptr + j + 1, 64);
+    return (sent == 0 && in->file_position < length && count > 0) ? -1 : sent;
+}
+
+/*
+ * readv
+ *  DESCRIPTION : scatter one read of fd over iovcnt buffers, filling each in turn.
+ *                The read function of fd is looked up once for the whole call.
+ *  INPUTS : fd -- file descriptor to read from
+ *           iov -- array of buffers
+ *           iovcnt -- number of buffers, at most IOV_MAX
+ *  OUTPUTS : the buffers of iov
+ *  RETURN VALUE : the total number of bytes read, stopping at the first buffer left short
+ *                 -1 if the fd or iov is invalid, or the very first read fails
+ *  SIDE EFFECTS : advance the position of fd like read does
+ */
+int32_t readv(int32_t fd, const iovec_t* iov, int32_t iovcnt)
+{
+    int32_t total = 0, ret, i;
+    file_desc_t* file = fd_lookup(fd);
+    if ((file == NULL) || (iov == NULL) || (iovcnt < 0) || (iovcnt > IOV_MAX)) return -1;
+    int32_t (*read_op)(int32_t, void*, int32_t) = file->file_op_ptr->read;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len < 0) return (total > 0) ? total : -1;
+        if (iov[i].iov_len == 0) continue;
+        ret = read_op(fd, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) return (total > 0) ? total : -1;
+        total += ret;
+        if (ret < iov[i].iov_len) break;                                                            // end of file or of the line typed
     }
-    return 0;                                                                                      // Cannot find the corresponding file after traversing: return -1
+    return total;
+}
+
+/*
+ * writev
+ *  DESCRIPTION : gather iovcnt buffers into one write of fd. For the terminal interrupts stay
+ *                off for the whole gather, so the pieces reach the screen together and the
+ *                terminal is locked once instead of once per piece; other files are written
+ *                with interrupts as the caller had them.
+ *  INPUTS : fd -- file descriptor to write to
+ *           iov -- array of buffers
+ *           iovcnt -- number of buffers, at most IOV_MAX
+ *  OUTPUTS : none
+ *  RETURN VALUE : the total number of bytes written, stopping at the first short write
+ *                 -1 if the fd or iov is invalid, or the very first write fails
+ *  SIDE EFFECTS : writes to the fd file
+ */
+int32_t writev(int32_t fd, const iovec_t* iov, int32_t iovcnt)
+{
+    int32_t total = 0, ret, i, terminal;
+    uint32_t flags;
+    file_desc_t* file = fd_lookup(fd);
+    if ((file == NULL) || (iov == NULL) || (iovcnt < 0) || (iovcnt > IOV_MAX)) return -1;
+    int32_t (*write_op)(int32_t, const void*, int32_t) = file->file_op_ptr->write;
+    terminal = (file->file_op_ptr == &stdout_op);
+    if (terminal) cli_and_save(flags);
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len < 0) break;
+        if (iov[i].iov_len == 0) continue;
+        ret = write_op(fd, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            if (total == 0) total = -1;
+            break;
+        }
+        total += ret;
+        if (ret < iov[i].iov_len) break;                                                            // the file is full
+    }
+    if (terminal) restore_flags(flags);
+    return total;
+}
+
+/*
+ * dup
+ *  DESCRIPTION : give the open file behind fd a second descriptor. Both share the
+ *                position, and the file is closed when the last of them is.
+ *  INPUTS : fd -- file descriptor to duplicate
+ *  OUTPUTS : none
+ *  RETURN VALUE : the lowest free descriptor, now referring to the same file
+ *                 -1 if fd is not open or the fd table cannot grow
+ *  SIDE EFFECTS : modify the fd table of the current process
+ */
+int32_t dup (int32_t fd)
+{
+    uint32_t flags;
+    int32_t new_fd;
+    file_desc_t* file = fd_lookup(fd);
+    if (file == NULL) return -1;
+    cli_and_save(flags);
+    file->refcount++;
+    restore_flags(flags);
+    pcb_t* cur_pcb = pcb_array[(uint8_t)cur_process];                                               // Get the current pcb based on cur_process
+    new_fd = fd_install(cur_pcb, file);
+    if (new_fd == -1) file_put(file, fd);                                                           // never the last reference, fd still holds one
+    return new_fd;
 }
@@ -4,14 +4,19 @@
 #include "lib.h"
 #include "terminal.h"
 #include "signal.h"
+#include "filesys.h"
 
-#define MAX_PROCESS     6
-#define MAX_FILE_NUM    8
+#define MAX_PROCESS     127                     // pids fit in int8_t, how many run at once is up to palloc
+#define FD_CHUNK        8                       // descriptors per chunk of an fd table, the first chunk is in the pcb
+#define FD_MAX          64                      // most descriptors one process can have
+#define FD_POOL_CHUNKS  24                      // chunks shared by the fd tables that grow past the pcb
+#define MAX_OPEN_FILES  128                     // open-file objects shared by all processes
 
 #define user_virt_addr      0x08000000          // 128M
 #define user_img_addr       0x08048000
 #define user_video_addr     (user_virt_addr + SIZE_4MB)
-#define KERNEL_STACK_START  0x800000            // 8M
+#define KERNEL_STACK_START  0x800000            // 8M, the stack entry runs on grows down from here
+#define BOOT_STACK_SIZE     0x8000              // 32K kept below KERNEL_STACK_START for that stack
 #define SIZE_4KB            0x1000              // 4K
 #define SIZE_8KB            0x2000              // 8K
 #define SIZE_4MB            0x400000            // 4M
@@ -22,6 +27,8 @@
 #define BACK_VID_1          (VMEM_START_ADDR + 1 * SIZE_4KB)
 #define BACK_VID_2          (VMEM_START_ADDR + 2 * SIZE_4KB)
 #define BACK_VID_3          (VMEM_START_ADDR + 3 * SIZE_4KB)
+#define IOV_MAX             16                  // most buffers readv and writev take in one call
+#define MMAP_PAGE_COPY      1                   // page_table_entry.available of an mmap page that is a private copy, not the image
 
 typedef struct file_operations                           // The struct for file operations
 {
@@ -29,20 +36,34 @@ typedef struct file_operations                           // The struct for file
     int32_t (*close) (int32_t fd);
     int32_t (*read) (int32_t fd, void* buf, int32_t nbytes);
     int32_t (*write) (int32_t fd, const void* buf, int32_t nbytes);
+    int32_t (*pread) (int32_t fd, void* buf, int32_t nbytes, uint32_t offset);
+    int32_t (*pwrite) (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset);
+    int32_t (*lseek) (int32_t fd, int32_t offset, int32_t whence);
 } file_op_t;
 
-typedef struct file_desc                                // The struct for files
+typedef struct iovec                                    // One buffer of readv and writev
+{
+    void*   iov_base;                                   // start of the buffer
+    int32_t iov_len;                                    // bytes in the buffer
+} iovec_t;
+
+typedef struct file_desc                                // An open file, shared by the descriptors that refer to it
 {
     file_op_t* file_op_ptr;                             // file operation table
     uint32_t inode;                                     // inode number for this file
     uint32_t file_position;                             // record where the user is currently reading
     uint32_t flags;                                     // denote whether it is in use
+    uint32_t refcount;                                  // descriptors referring to it, closed when the last one goes
 } file_desc_t;
 
 typedef struct pcb
 {
     uint8_t     pid;                                    // The pid of corresponding process  
-    file_desc_t file_array[MAX_FILE_NUM];               // Each task can have up to 8 open files                         
+    uint32_t    user_tbl;                               // physical address of the program window's page table, from palloc
+    uint32_t    mmap_tbl;                               // physical address of the mmap window's page table, from palloc
+    file_desc_t* fd_inline[FD_CHUNK];                   // The first chunk of the fd table
+    file_desc_t** fd_chunks[FD_MAX / FD_CHUNK];         // Chunk i holds descriptors i*FD_CHUNK on, NULL until the table grows that far
+    uint32_t    fd_bitmap[FD_MAX / 32];                 // 1 bit per descriptor, 1 means open
     uint32_t    exe_ebp;                                // Record execute's ebp
     uint32_t    sche_ebp;                               // Record scheduler's ebp
     int8_t      args[BUFFER_SIZE + 1];                  // Record cmd arguments
@@ -55,6 +76,7 @@ typedef struct pcb
 extern int8_t cur_process;
 extern uint8_t process_array[MAX_PROCESS];
 extern int8_t  parent_pid[MAX_PROCESS];
+extern pcb_t*  pcb_array[MAX_PROCESS];
 extern uint8_t exception_flag;
 extern file_op_t stdin_op;
 extern file_op_t stdout_op;
@@ -62,6 +84,13 @@ extern file_op_t file_op;
 extern file_op_t dir_op;
 extern file_op_t rtc_op;
 
+/* the open file behind descriptor fd of the current process, NULL if fd is not open */
+extern file_desc_t* fd_lookup(int32_t fd);
+/* start an empty fd table in a pcb */
+extern void fd_table_init(pcb_t* pcb);
+/* drop every descriptor of a pcb, closing the files no other descriptor refers to */
+extern void fd_table_release(pcb_t* pcb);
+
 /* temporary system call handler */
 extern void sys_call_handler_temp(void);
 
@@ -73,6 +102,12 @@ int32_t bad_call_read(int32_t fd, void* buf, int32_t nbytes);
 
 int32_t bad_call_write(int32_t fd, const void* buf, int32_t nbytes);
 
+int32_t bad_call_pread(int32_t fd, void* buf, int32_t nbytes, uint32_t offset);
+
+int32_t bad_call_pwrite(int32_t fd, const void* buf, int32_t nbytes, uint32_t offset);
+
+int32_t bad_call_lseek(int32_t fd, int32_t offset, int32_t whence);
+
 /* Handler for systerm call */
 extern void SYS_CALL_link(void);
 
@@ -100,4 +135,30 @@ extern int32_t cp (uint8_t* buf);
 
 extern int32_t rm (uint8_t* buf);
 
+extern int32_t mkdir (const uint8_t* path);
+
+extern int32_t stat (const uint8_t* filename, fs_stat_t* buf);
+
+extern int32_t fstat (int32_t fd, fs_stat_t* buf);
+
+extern int32_t lseek (int32_t fd, int32_t offset, int32_t whence);
+
+extern int32_t pread (int32_t fd, void* buf, int32_t nbytes, uint32_t offset);
+
+extern int32_t pwrite (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset);
+
+extern int32_t getdents (int32_t fd, void* buf, int32_t nbytes);
+
+extern int32_t mmap (int32_t fd, uint32_t offset, uint32_t length);
+
+extern int32_t munmap (void* addr, uint32_t length);
+
+extern int32_t sendfile (int32_t out_fd, int32_t in_fd, int32_t count);
+
+extern int32_t readv (int32_t fd, const iovec_t* iov, int32_t iovcnt);
+
+extern int32_t writev (int32_t fd, const iovec_t* iov, int32_t iovcnt);
+
+extern int32_t dup (int32_t fd);
+
 #endif
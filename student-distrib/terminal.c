@@ -52,9 +52,9 @@ int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes){
         return -1;
     }
     multi_terms[sche_term].read_open = 1;
-    /* user is input something, wait the enter pressed. */
+    /* user is input something, wait the enter pressed, doing the due write-back meanwhile. */
     while (!multi_terms[sche_term].enter_flag){
-
+        fs_flush();
     };
     /* the number to be copied should be min(nbytes, count) */
     if (multi_terms[sche_term].count < nbytes){                        
@@ -91,14 +91,17 @@ int32_t terminal_read(int32_t fd, void* buf, int32_t nbytes){
  */
 int32_t terminal_write(int32_t fd, const void* buf, int32_t nbytes){
     int i;
+    uint32_t flags;
     if (nbytes < 0 || buf == NULL){                         // check valid
         return -1;
     }
+    cli_and_save(flags);                                    // one critical section for the whole buffer
     for (i = 0; i < nbytes; i++){
         if (!((char*)buf)[i] == 0x0){                      // not print the NULL bytes.
-            putc(((char*)buf)[i]);
+            putc_nolock(((char*)buf)[i]);
         }
     }
+    restore_flags(flags);
     return nbytes;
 }
 
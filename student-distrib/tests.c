@@ -3,7 +3,12 @@
 #include "lib.h"
 #include "rtc.h"
 #include "filesys.h"
-#include "terminal.h" 
+#include "lz4.h"
+#include "crc32c.h"
+#include "ata.h"
+#include "terminal.h"
+#include "system_call.h" 
+#include "palloc.h"
 
 #define PASS 1
 #define FAIL 0
@@ -351,10 +356,6 @@ int file_test(const char* fname)
 	}
     printf("\nfilename \"%s\" \n", fname);
 
-	if(file_write(inode_idx, buf, length) != -1){
-		printf("Some miracles happened!\n");
-		return FAIL;
-	}
 	if(file_close(NULL) != 0) return FAIL;
 	return PASS;
 }
@@ -363,6 +364,669 @@ int file_test(const char* fname)
 /* Checkpoint 4 tests */
 /* Checkpoint 5 tests */
 
+/* write_data_test
+ * Asserts that a new file can be written in place and appended to
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file fname
+ * Coverage: dir_write, write_data, read_data, alloc_inode, alloc_data_block
+ * Files: filesys.c/h
+ */
+int write_data_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t out[BLOCK_SIZE + 16];
+	uint8_t in[BLOCK_SIZE + 16];
+	uint32_t i;
+
+	if(dir_write(0, fname, 0) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	for(i = 0; i < sizeof(out); i++) out[i] = (uint8_t)i;
+	if(write_data(dentry.inode, 0, out, BLOCK_SIZE) != BLOCK_SIZE) return FAIL;			// fill exactly one block
+	if(write_data(dentry.inode, BLOCK_SIZE, out + BLOCK_SIZE, 16) != 16) return FAIL;		// append into a second block
+	out[10] = 0xAA;
+	if(write_data(dentry.inode, 10, out + 10, 1) != 1) return FAIL;							// overwrite in place
+	if(inode_ptr[dentry.inode].length != sizeof(out)) return FAIL;
+	if(read_data(dentry.inode, 0, in, sizeof(in)) != sizeof(in)) return FAIL;
+	for(i = 0; i < sizeof(in); i++){
+		if(in[i] != out[i]) return FAIL;
+	}
+	return PASS;
+}
+
+/* path_lookup_test
+ * Asserts that nested directories can be created and resolved by path
+ * Inputs: const char* dname - name of a directory that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates dname and dname/sub/file
+ * Coverage: fs_create, path_lookup, dentry cache (including negative entries)
+ * Files: filesys.c/h
+ */
+int path_lookup_test(const char* dname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t path[FS_MAX_PATH_LEN];
+	uint32_t len = strlen((const int8_t*)dname);
+
+	if(len + 10 > FS_MAX_PATH_LEN) return FAIL;
+	strcpy((int8_t*)path, dname);
+	if(fs_create(FS_ROOT_INODE, path, FILE_TYPE_DIR) != 0) return FAIL;
+	if(fs_create(FS_ROOT_INODE, path, FILE_TYPE_DIR) != -1) return FAIL;				// duplicate name
+	strcpy((int8_t*)path + len, "/sub");
+	if(fs_create(FS_ROOT_INODE, path, FILE_TYPE_DIR) != 0) return FAIL;
+	strcpy((int8_t*)path + len, "/sub/file");
+	if(path_lookup(FS_ROOT_INODE, path, &dentry) != -1) return FAIL;					// cached as a miss
+	if(fs_create(FS_ROOT_INODE, path, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(path_lookup(FS_ROOT_INODE, path, &dentry) != 0) return FAIL;						// the miss was invalidated
+	if(dentry.file_type != FILE_TYPE_REGULAR) return FAIL;
+	strcpy((int8_t*)path + len, "/sub/../sub/./file");
+	if(read_dentry_by_name(path, &dentry) != 0) return FAIL;
+	strcpy((int8_t*)path + len, "/sub/file/x");
+	if(path_lookup(FS_ROOT_INODE, path, &dentry) != -1) return FAIL;					// a file is not a directory
+	return PASS;
+}
+
+/* inline_data_test
+ * Asserts that a small file is stored in its inode and moves to a data block when it grows
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file fname
+ * Coverage: fs_create, write_data, read_data on inline inodes
+ * Files: filesys.c/h
+ */
+int inline_data_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t out[INODE_INLINE_MAX + 16];
+	uint8_t in[INODE_INLINE_MAX + 16];
+	uint32_t i;
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	for(i = 0; i < sizeof(out); i++) out[i] = (uint8_t)(i * 7);
+	if(write_data(dentry.inode, 0, out, INODE_INLINE_MAX) != INODE_INLINE_MAX) return FAIL;	// exactly fills the inode
+	if(!(inode_ptr[dentry.inode].flags & INODE_FLAG_INLINE)) return FAIL;
+	if(read_data(dentry.inode, 0, in, INODE_INLINE_MAX) != INODE_INLINE_MAX) return FAIL;
+	for(i = 0; i < INODE_INLINE_MAX; i++){
+		if(in[i] != out[i]) return FAIL;
+	}
+	if(write_data(dentry.inode, INODE_INLINE_MAX, out + INODE_INLINE_MAX, 16) != 16) return FAIL;	// spills into a block
+	if(inode_ptr[dentry.inode].flags & INODE_FLAG_INLINE) return FAIL;
+	if(read_data(dentry.inode, 0, in, sizeof(in)) != sizeof(in)) return FAIL;
+	for(i = 0; i < sizeof(in); i++){
+		if(in[i] != out[i]) return FAIL;
+	}
+	return PASS;
+}
+
+/* compressed_read_test
+ * Asserts that a compressed file decompresses to the right data, through the cache and around it
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file fname
+ * Coverage: read_data on compressed inodes, lz4_decode_block, zcache
+ * Files: filesys.c/h, lz4.c/h
+ */
+int compressed_read_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t stream[3 * 4 + 20 + 100];
+	uint8_t in[BLOCK_SIZE + 100];
+	uint32_t* table = (uint32_t*)stream;
+	uint8_t* lz = stream + 12;
+	uint32_t i;
+
+	/* block 0: 4096 'a' as one literal and a 4095 byte match at offset 1, block 1: 100 bytes stored as is */
+	table[0] = 12;
+	table[1] = 12 + 20;
+	table[2] = 12 + 20 + 100;
+	lz[0] = 0x1F;
+	lz[1] = 'a';
+	lz[2] = 1;
+	lz[3] = 0;
+	for(i = 4; i < 19; i++) lz[i] = 255;
+	lz[19] = 4095 - LZ4_MIN_MATCH - 15 - 255 * 15;
+	for(i = 0; i < 100; i++) stream[32 + i] = (uint8_t)i;
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	if(write_data(dentry.inode, BLOCK_SIZE - 1, stream, 1) != 1) return FAIL;				// too big to stay inline
+	if(write_data(dentry.inode, 0, stream, sizeof(stream)) != sizeof(stream)) return FAIL;
+	inode_ptr[dentry.inode].length = BLOCK_SIZE + 100;
+	inode_ptr[dentry.inode].flags = INODE_FLAG_COMPRESSED;
+
+	if(read_data(dentry.inode, 0, in, sizeof(in)) != sizeof(in)) return FAIL;				// whole blocks
+	for(i = 0; i < sizeof(in); i++){
+		if(in[i] != ((i < BLOCK_SIZE) ? 'a' : (uint8_t)(i - BLOCK_SIZE))) return FAIL;
+	}
+	for(i = 0; i < sizeof(in); i += 97){
+		if(read_data(dentry.inode, i, in, 1) != 1) return FAIL;							// single bytes through the cache
+		if(in[0] != ((i < BLOCK_SIZE) ? 'a' : (uint8_t)(i - BLOCK_SIZE))) return FAIL;
+	}
+	if(write_data(dentry.inode, 0, in, 1) != -1) return FAIL;								// read only
+	return PASS;
+}
+
+
+/* reflink_test
+ * Asserts that a reflinked copy reads like the original and that writes to either side stay private
+ * Inputs: const char* src - name of a file that does not exist yet
+ *         const char* dst - name of another file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the files src and dst
+ * Coverage: fs_reflink, copy-on-write in write_data
+ * Files: filesys.c/h
+ */
+int reflink_test(const char* src, const char* dst){
+	TEST_HEADER;
+	dentry_t src_dentry, dst_dentry;
+	uint8_t out[2 * BLOCK_SIZE];
+	uint8_t in[2 * BLOCK_SIZE];
+	uint32_t i;
+
+	for(i = 0; i < sizeof(out); i++) out[i] = (uint8_t)(i * 13);
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)src, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)dst, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)src, &src_dentry) == -1) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)dst, &dst_dentry) == -1) return FAIL;
+	if(write_data(src_dentry.inode, 0, out, sizeof(out)) != sizeof(out)) return FAIL;
+	if(fs_reflink(src_dentry.inode, dst_dentry.inode) != 0) return FAIL;
+	if(inode_ptr[dst_dentry.inode].data_blocks[0] != inode_ptr[src_dentry.inode].data_blocks[0]) return FAIL;	// shared, not copied
+
+	if(write_data(dst_dentry.inode, 10, (const uint8_t*)"cow", 3) != 3) return FAIL;
+	if(inode_ptr[dst_dentry.inode].data_blocks[0] == inode_ptr[src_dentry.inode].data_blocks[0]) return FAIL;	// written block was copied
+	if(inode_ptr[dst_dentry.inode].data_blocks[1] != inode_ptr[src_dentry.inode].data_blocks[1]) return FAIL;	// the other one is still shared
+	if(read_data(src_dentry.inode, 0, in, sizeof(in)) != sizeof(in)) return FAIL;
+	for(i = 0; i < sizeof(in); i++){
+		if(in[i] != out[i]) return FAIL;
+	}
+	memcpy(out + 10, "cow", 3);
+	if(read_data(dst_dentry.inode, 0, in, sizeof(in)) != sizeof(in)) return FAIL;
+	for(i = 0; i < sizeof(in); i++){
+		if(in[i] != out[i]) return FAIL;
+	}
+	return PASS;
+}
+
+/* rm_test
+ * Asserts that removing a file frees its name, dentry slot and inode for the next file
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates and removes the file fname
+ * Coverage: fs_remove, dentry free-slot list, inode and block reclamation
+ * Files: filesys.c/h
+ */
+int rm_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t out[2 * BLOCK_SIZE];
+	uint32_t first_inode, num_entries;
+
+	memset(out, 'r', sizeof(out));
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	num_entries = boot_block_ptr->num_dir_entries;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	first_inode = dentry.inode;
+	if(write_data(dentry.inode, 0, out, sizeof(out)) != sizeof(out)) return FAIL;
+	if(fs_remove(FS_ROOT_INODE, (const uint8_t*)fname) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) != -1) return FAIL;			// the name is gone
+	if(fs_remove(FS_ROOT_INODE, (const uint8_t*)fname) != -1) return FAIL;
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(boot_block_ptr->num_dir_entries != num_entries) return FAIL;					// the dentry slot was reused
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	if(dentry.inode != first_inode) return FAIL;							// the inode was reclaimed
+	if(inode_ptr[dentry.inode].length != 0) return FAIL;
+	if(fs_remove(FS_ROOT_INODE, (const uint8_t*)fname) != 0) return FAIL;
+	return PASS;
+}
+
+/* stat_test
+ * Asserts that stat reports the size, type and inode of a file, a directory and a missing name
+ * Inputs: const char* fname - name of an existing regular file
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: stat, fs_stat
+ * Files: system_call.c/h, filesys.c/h
+ */
+int stat_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	fs_stat_t st;
+
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	if(stat((const uint8_t*)fname, &st) != 0) return FAIL;
+	if((st.file_type != FILE_TYPE_REGULAR) || (st.inode != dentry.inode)) return FAIL;
+	if(st.length != inode_ptr[dentry.inode].length) return FAIL;
+	if(stat((const uint8_t*)".", &st) != 0) return FAIL;
+	if((st.file_type != FILE_TYPE_DIR) || (st.length != boot_block_ptr->num_dir_entries * sizeof(dentry_t))) return FAIL;
+	if(stat((const uint8_t*)"non-exist-file", &st) != -1) return FAIL;
+	return PASS;
+}
+
+/* seek_test
+ * Asserts that lseek moves the file position and that pread/pwrite neither use nor move it
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file fname, opens and closes a file descriptor
+ * Coverage: lseek, pread, pwrite, file_lseek, file_pread, file_pwrite, file_read
+ * Files: system_call.c/h, filesys.c/h
+ */
+int seek_test(const char* fname){
+	TEST_HEADER;
+	uint8_t out[3 * BLOCK_SIZE];
+	uint8_t in[16];
+	int32_t fd, i;
+
+	for(i = 0; i < sizeof(out); i++) out[i] = (uint8_t)(i / 7);
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if((fd = open((const uint8_t*)fname)) == -1) return FAIL;
+	if(pwrite(fd, out, sizeof(out), 0) != sizeof(out)) return FAIL;
+	if(lseek(fd, 0, SEEK_CUR) != 0) return FAIL;							// pwrite left the position alone
+	if(pread(fd, in, 16, 2 * BLOCK_SIZE + 5) != 16) return FAIL;
+	for(i = 0; i < 16; i++){
+		if(in[i] != out[2 * BLOCK_SIZE + 5 + i]) return FAIL;
+	}
+	if(pread(fd, in, 16, sizeof(out)) != 0) return FAIL;					// at the end of the file
+	if(lseek(fd, -10, SEEK_END) != sizeof(out) - 10) return FAIL;
+	if(read(fd, in, 16) != 10) return FAIL;
+	if(lseek(fd, BLOCK_SIZE, SEEK_SET) != BLOCK_SIZE) return FAIL;
+	if(lseek(fd, 3, SEEK_CUR) != BLOCK_SIZE + 3) return FAIL;
+	if(read(fd, in, 1) != 1 || in[0] != out[BLOCK_SIZE + 3]) return FAIL;
+	if(lseek(fd, -1, SEEK_SET) != -1) return FAIL;
+	if(lseek(fd, 0, 3) != -1) return FAIL;
+	if(close(fd) != 0) return FAIL;
+	return PASS;
+}
+
+/* getdents_test
+ * Asserts that getdents returns every dentry of the root, with the sizes stat reports
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: opens and closes a file descriptor
+ * Coverage: getdents, dir_getdents
+ * Files: system_call.c/h, filesys.c/h
+ */
+int getdents_test(){
+	TEST_HEADER;
+	fs_dirent_t records[4];
+	fs_stat_t st;
+	int32_t fd, cnt, i, total = 0;
+
+	if((fd = open((const uint8_t*)".")) == -1) return FAIL;
+	if(getdents(fd, records, sizeof(fs_dirent_t) - 1) != -1) return FAIL;				// not even one record fits
+	while((cnt = getdents(fd, records, sizeof(records))) > 0){
+		if(cnt % sizeof(fs_dirent_t)) return FAIL;
+		for(i = 0; i < cnt / sizeof(fs_dirent_t); i++){
+			if(stat(records[i].name, &st) != 0) return FAIL;
+			if((st.length != records[i].length) || (st.file_type != records[i].file_type)) return FAIL;
+			total++;
+		}
+	}
+	if(cnt != 0) return FAIL;
+	if(total == 0 || total > boot_block_ptr->num_dir_entries) return FAIL;
+	if(close(fd) != 0) return FAIL;
+	return PASS;
+}
+
+/* mmap_test
+ * Asserts that the pages mmap would map hold the same bytes read_data returns
+ * Inputs: const char* fname - name of an existing regular file
+ * Outputs: PASS/FAIL
+ * Side Effects: None
+ * Coverage: fs_data_page
+ * Files: filesys.c/h
+ */
+int mmap_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t in[BLOCK_SIZE];
+	uint8_t* page;
+	uint32_t length, idx, i;
+	int32_t cnt;
+
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	length = inode_ptr[dentry.inode].length;
+	for(idx = 0; idx * BLOCK_SIZE < length; idx++){
+		if((page = fs_data_page(dentry.inode, idx)) == NULL) return FAIL;
+		cnt = read_data(dentry.inode, idx * BLOCK_SIZE, in, BLOCK_SIZE);
+		if(cnt <= 0) return FAIL;
+		for(i = 0; i < cnt; i++){
+			if(page[i] != in[i]) return FAIL;
+		}
+	}
+	if(fs_data_page(dentry.inode, idx) != NULL) return FAIL;				// past the end
+	return PASS;
+}
+
+/* mmap_ref_test
+ * Asserts that a page mmap would map stays allocated and unchanged after its file is
+ * removed, as long as a reference to it is held
+ * Inputs: const char* fname - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates and removes the file fname, allocates and frees a data block
+ * Coverage: fs_page_get, fs_page_put
+ * Files: filesys.c/h
+ */
+int mmap_ref_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t out[2 * BLOCK_SIZE];
+	uint8_t* page;
+	uint32_t block, i;
+	int32_t other;
+
+	memset(out, 'm', sizeof(out));
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)fname, &dentry) == -1) return FAIL;
+	if(write_data(dentry.inode, 0, out, sizeof(out)) != sizeof(out)) return FAIL;
+	if((page = fs_data_page(dentry.inode, 1)) == NULL) return FAIL;
+	if(fs_page_get(page) != 0) return FAIL;
+	if(fs_remove(FS_ROOT_INODE, (const uint8_t*)fname) != 0) return FAIL;
+	block = (page - data_block_ptr) / BLOCK_SIZE;
+	if((other = alloc_data_block(block, 1)) == -1) return FAIL;
+	free_data_block(other);
+	if(other == block) return FAIL;							// still referenced, not free
+	for(i = 0; i < BLOCK_SIZE; i++){
+		if(page[i] != 'm') return FAIL;
+	}
+	fs_page_put(page);
+	return PASS;
+}
+
+/* sendfile_test
+ * Asserts that sendfile copies a whole file into another one and moves only the source position
+ * Inputs: const char* src - name of an existing regular file
+ *         const char* dst - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file dst, opens and closes two file descriptors
+ * Coverage: sendfile, fs_data_page, file_write
+ * Files: system_call.c/h, filesys.c/h
+ */
+int sendfile_test(const char* src, const char* dst){
+	TEST_HEADER;
+	dentry_t src_dentry, dst_dentry;
+	uint8_t a[BLOCK_SIZE], b[BLOCK_SIZE];
+	int32_t in_fd, out_fd, cnt, i;
+	uint32_t offset, length;
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)dst, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)src, &src_dentry) == -1) return FAIL;
+	if(read_dentry_by_name((const uint8_t*)dst, &dst_dentry) == -1) return FAIL;
+	if((in_fd = open((const uint8_t*)src)) == -1) return FAIL;
+	if((out_fd = open((const uint8_t*)dst)) == -1) return FAIL;
+	length = inode_ptr[src_dentry.inode].length;
+	if(sendfile(out_fd, in_fd, 0x7FFFFFFF) != length) return FAIL;
+	if(sendfile(out_fd, in_fd, 0x7FFFFFFF) != 0) return FAIL;					// at the end of the file
+	if(inode_ptr[dst_dentry.inode].length != length) return FAIL;
+	for(offset = 0; offset < length; offset += cnt){
+		cnt = read_data(src_dentry.inode, offset, a, BLOCK_SIZE);
+		if((cnt <= 0) || (read_data(dst_dentry.inode, offset, b, BLOCK_SIZE) != cnt)) return FAIL;
+		for(i = 0; i < cnt; i++){
+			if(a[i] != b[i]) return FAIL;
+		}
+	}
+	if(close(in_fd) != 0 || close(out_fd) != 0) return FAIL;
+	return PASS;
+}
+
+/* iovec_test
+ * Asserts that writev gathers several buffers into a file and readv scatters them back
+ * Inputs: const char* name - name of a file that does not exist yet
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file name, opens and closes a file descriptor
+ * Coverage: readv, writev, file_read, file_write
+ * Files: system_call.c/h, filesys.c/h
+ */
+int iovec_test(const char* name){
+	TEST_HEADER;
+	int8_t a[4], b[8], c[16];
+	iovec_t iov[3];
+	int32_t fd;
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)name, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if((fd = open((const uint8_t*)name)) == -1) return FAIL;
+	iov[0].iov_base = "abc";
+	iov[0].iov_len = 3;
+	iov[1].iov_base = "";
+	iov[1].iov_len = 0;
+	iov[2].iov_base = "defghij";
+	iov[2].iov_len = 7;
+	if(writev(fd, iov, 3) != 10) return FAIL;
+	if(lseek(fd, 0, SEEK_SET) != 0) return FAIL;
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	iov[2].iov_base = c;
+	iov[2].iov_len = sizeof(c);
+	if(readv(fd, iov, 3) != 10) return FAIL;					// the second buffer is left short
+	if(strncmp(a, "abcd", 4) != 0 || strncmp(b, "efghij", 6) != 0) return FAIL;
+	if(readv(fd, iov, 3) != 0) return FAIL;					// at the end of the file
+	if(writev(fd, iov, IOV_MAX + 1) != -1) return FAIL;
+	if(close(fd) != 0) return FAIL;
+	return PASS;
+}
+
+/* crc32c_test
+ * Asserts that crc32c gives the standard check value and can be computed piece by piece
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: builds the crc32c tables
+ * Coverage: crc32c_init, crc32c
+ * Files: crc32c.c/h
+ */
+int crc32c_test(){
+	TEST_HEADER;
+	const uint8_t* check = (const uint8_t*)"123456789";
+	uint8_t buf[BLOCK_SIZE];
+	uint32_t i, whole;
+
+	crc32c_init();
+	if(crc32c(0, check, 9) != 0xE3069283) return FAIL;						// the CRC32C check value
+	if(crc32c(crc32c(0, check, 5), check + 5, 4) != 0xE3069283) return FAIL;
+	for(i = 0; i < BLOCK_SIZE; i++) buf[i] = (uint8_t)(i * 7);
+	whole = crc32c(0, buf, BLOCK_SIZE);
+	if(crc32c(crc32c(0, buf, 1001), buf + 1001, BLOCK_SIZE - 1001) != whole) return FAIL;
+	buf[100] ^= 1;
+	if(crc32c(0, buf, BLOCK_SIZE) == whole) return FAIL;						// a flipped bit is caught
+	return PASS;
+}
+
+/* disk_sync_test
+ * Asserts that a write reaches the disk: after fs_sync the sectors behind the first
+ * page of the file hold what was written
+ * Inputs: fname - name of a file to create and write
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file, writes to the disk
+ * Coverage: ata_read, ata_write, fs_sync
+ * Files: ata.c/h, filesys.c/h
+ */
+int disk_sync_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t data[BLOCK_SIZE], back[BLOCK_SIZE];
+	uint8_t* page;
+	uint32_t i, lba;
+
+	if(ata_sectors() == 0) return FAIL;										// boot with a disk attached as hdb
+	for(i = 0; i < BLOCK_SIZE; i++) data[i] = (uint8_t)(i * 13 + 1);
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(0 != read_dentry_by_name((const uint8_t*)fname, &dentry)) return FAIL;
+	if(write_data(dentry.inode, 0, data, BLOCK_SIZE) != BLOCK_SIZE) return FAIL;	// a whole block, the file leaves its inode
+	if(0 != fs_sync()) return FAIL;
+	page = fs_data_page(dentry.inode, 0);
+	if(page == NULL) return FAIL;
+	lba = (page - (uint8_t*)boot_block_ptr) / ATA_SECTOR_SIZE;
+	if(0 != ata_read(lba, BLOCK_SIZE / ATA_SECTOR_SIZE, back)) return FAIL;
+	for(i = 0; i < BLOCK_SIZE; i++){
+		if(back[i] != data[i]) return FAIL;
+	}
+	return PASS;
+}
+
+/* journal_test
+ * Asserts that a committed transaction is checkpointed and cleared: after fs_sync the
+ * inode block of a newly created file is in place on the disk and the journal is empty,
+ * so the next boot does not replay it
+ * Inputs: fname - name of a file to create
+ * Outputs: PASS/FAIL
+ * Side Effects: creates the file, writes to the disk
+ * Coverage: fs_sync, journal_commit, journal_clear
+ * Files: filesys.c/h
+ */
+int journal_test(const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint8_t sector[ATA_SECTOR_SIZE];
+	journal_desc_t* desc = (journal_desc_t*)sector;
+	uint32_t i, lba;
+
+	if(ata_sectors() == 0) return FAIL;										// boot with a disk attached as hdb
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(0 != read_dentry_by_name((const uint8_t*)fname, &dentry)) return FAIL;
+	if(0 != fs_sync()) return FAIL;
+	lba = (1 + boot_block_ptr->num_inodes + boot_block_ptr->num_data_blocks) * FS_SECTORS_PER_BLOCK;	// right after the image
+	if(0 != ata_read(lba, 1, sector)) return FAIL;
+	if(desc->magic == FS_JOURNAL_MAGIC) return FAIL;							// cleared after the checkpoint
+	if(0 != ata_read((1 + dentry.inode) * FS_SECTORS_PER_BLOCK, 1, sector)) return FAIL;	// the inode block, after the boot block
+	for(i = 0; i < ATA_SECTOR_SIZE; i++){
+		if(sector[i] != ((uint8_t*)(inode_ptr + dentry.inode))[i]) return FAIL;
+	}
+	return PASS;
+}
+
+/* fd_table_test
+ * Asserts that the fd table grows past the pcb, reuses the lowest free descriptor,
+ * and that dup shares the open file and its position
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: borrows pid 0, no process may be running
+ * Coverage: open, close, dup, fd_table_init, fd_table_release, fd_lookup
+ * Files: system_call.c/h
+ */
+int fd_table_test(){
+	TEST_HEADER;
+	static pcb_t pcb_store;
+	pcb_t* pcb = &pcb_store;
+	pcb_t* saved_pcb = pcb_array[0];
+	int8_t saved = cur_process;
+	uint8_t first[MAX_FILENAME_LEN + 1] = {"\0"}, second[MAX_FILENAME_LEN + 1] = {"\0"};
+	int32_t i, result = PASS;
+
+	cur_process = 0;
+	pcb_array[0] = pcb;
+	fd_table_init(pcb);
+	for(i = 0; i < 3 * FD_CHUNK; i++){
+		if(open((const uint8_t*)".") != i) result = FAIL;					// the table grows by two chunks
+	}
+	if(dup(5) != 3 * FD_CHUNK) result = FAIL;
+	if(dir_read(5, first, MAX_FILENAME_LEN) <= 0) result = FAIL;
+	if(dir_read(3 * FD_CHUNK, second, MAX_FILENAME_LEN) <= 0) result = FAIL;	// continues where fd 5 stopped
+	if(0 == strncmp((int8_t*)first, (int8_t*)second, MAX_FILENAME_LEN)) result = FAIL;
+	if(close(5) != 0) result = FAIL;
+	if(fd_lookup(3 * FD_CHUNK) == NULL) result = FAIL;						// the dup keeps the file open
+	if(open((const uint8_t*)".") != 5) result = FAIL;						// the lowest free descriptor
+	fd_table_release(pcb);
+	if(fd_lookup(0) != NULL) result = FAIL;
+	pcb_array[0] = saved_pcb;
+	cur_process = saved;
+	return result;
+}
+
+/* exec_cache_test
+ * Asserts that the executable cache answers with the entry point in the file, and
+ * forgets a file once it is written
+ * Inputs: exe - name of an executable, fname - name of a file to create
+ * Outputs: PASS/FAIL
+ * Side Effects: creates and writes the file
+ * Coverage: fs_exec_info, ecache_invalidate
+ * Files: filesys.c/h
+ */
+int exec_cache_test(const char* exe, const char* fname){
+	TEST_HEADER;
+	dentry_t dentry;
+	uint32_t entry, length, magic = EXE_MAGIC, eip;
+
+	if(0 != read_dentry_by_name((const uint8_t*)exe, &dentry)) return FAIL;
+	if(0 != fs_exec_info(dentry.inode, &entry, &length)) return FAIL;
+	if(4 != read_data(dentry.inode, EIP_START, (uint8_t*)&eip, 4)) return FAIL;
+	if((entry != eip) || (length != inode_ptr[dentry.inode].length)) return FAIL;
+	if(0 != fs_exec_info(dentry.inode, &entry, &length) || (entry != eip)) return FAIL;	// now from the cache
+
+	if(fs_create(FS_ROOT_INODE, (const uint8_t*)fname, FILE_TYPE_REGULAR) != 0) return FAIL;
+	if(0 != read_dentry_by_name((const uint8_t*)fname, &dentry)) return FAIL;
+	if(-1 != fs_exec_info(dentry.inode, &entry, &length)) return FAIL;		// empty, no header to remember
+	if(4 != write_data(dentry.inode, EIP_START, (const uint8_t*)&eip, 4)) return FAIL;
+	if(-1 != fs_exec_info(dentry.inode, &entry, &length)) return FAIL;		// no magic, remembered as not executable
+	if(4 != write_data(dentry.inode, 0, (const uint8_t*)&magic, 4)) return FAIL;
+	if(0 != fs_exec_info(dentry.inode, &entry, &length)) return FAIL;		// the write dropped the negative entry
+	if((entry != eip) || (length != EIP_START + 4)) return FAIL;
+	return PASS;
+}
+
+/* palloc_test
+ * Asserts that palloc returns blocks aligned to their size, that blocks merge back
+ * when freed, and that the free count comes back
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: none, every block is freed again
+ * Coverage: palloc, pfree, palloc_free_frames
+ * Files: palloc.c/h
+ */
+int palloc_test(){
+	TEST_HEADER;
+	uint32_t before = palloc_free_frames();
+	uint32_t big = palloc(PALLOC_ORDER_4MB);
+	uint32_t a = palloc(PALLOC_ORDER_4KB);
+	uint32_t b = palloc(PALLOC_ORDER_4KB);
+	uint32_t c = palloc(PALLOC_ORDER_8KB);
+	int32_t result = PASS;
+
+	if((big == 0) || (a == 0) || (b == 0) || (c == 0)) result = FAIL;				// needs at least 12MB of RAM
+	if((big % PAGE_SIZE_4M) || (c % SIZE_8KB) || (a < PALLOC_MIN_ADDR)) result = FAIL;
+	if((a == b) || (a % PAGE_SIZE) || (b % PAGE_SIZE)) result = FAIL;
+	if(palloc_free_frames() != before - (1 << PALLOC_ORDER_4MB) - 4) result = FAIL;
+	*(uint32_t*)PHYS_TO_VIRT(a) = 0x391;										// the kernel reaches frames through the physical map
+	if(*(uint32_t*)PHYS_TO_VIRT(a) != 0x391) result = FAIL;
+	pfree(a, PALLOC_ORDER_4KB);
+	pfree(b, PALLOC_ORDER_4KB);
+	pfree(c, PALLOC_ORDER_8KB);
+	pfree(big, PALLOC_ORDER_4MB);
+	if(palloc_free_frames() != before) result = FAIL;
+	if(palloc(PALLOC_ORDER_4KB) != a) result = FAIL;							// merged back, the same frame comes first
+	pfree(a, PALLOC_ORDER_4KB);
+	return result;
+}
+
+/* user_paging_test
+ * Asserts that a program page table gets one zeroed frame per page touched, and that
+ * freeing the table gives every frame back
+ * Inputs: None
+ * Outputs: PASS/FAIL
+ * Side Effects: none, the table is freed again
+ * Coverage: user_paging_map, user_paging_free
+ * Files: paging.c/h
+ */
+int user_paging_test(){
+	TEST_HEADER;
+	uint32_t before = palloc_free_frames();
+	uint32_t tbl = palloc(PALLOC_ORDER_4KB);
+	uint32_t idx = (user_img_addr % PAGE_SIZE_4M) / PAGE_SIZE;
+	page_table_entry_t* table = PHYS_TO_VIRT(tbl);
+	int32_t result = PASS;
+
+	if(tbl == 0) return FAIL;
+	memset(table, 0, PAGE_SIZE);
+	if(0 != user_paging_map(tbl, user_img_addr)) result = FAIL;
+	if(0 != user_paging_map(tbl, user_img_addr + 100)) result = FAIL;			// the same page, no new frame
+	if(palloc_free_frames() != before - 2) result = FAIL;						// the table and one page
+	if(!table[idx].present || !table[idx].user_sup || table[idx + 1].present) result = FAIL;
+	if(*(uint32_t*)PHYS_TO_VIRT(table[idx].base_addr * PAGE_SIZE) != 0) result = FAIL;
+	user_paging_free(tbl);
+	if(palloc_free_frames() != before) result = FAIL;
+	return result;
+}
 
 /* Test suite entry point */
 void launch_tests(){
@@ -390,4 +1054,26 @@ void launch_tests(){
 	// TEST_OUTPUT("file_test", file_test("fish"));
 	// TEST_OUTPUT("file_test", file_test("verylargetextwithverylongname.tx"));
 	// TEST_OUTPUT("file_test", file_test("non-exist-file"));
+
+	/* Checkpoint 5 tests */
+	// TEST_OUTPUT("write_data_test", write_data_test("write_test.txt"));
+	// TEST_OUTPUT("path_lookup_test", path_lookup_test("dir_test"));
+	// TEST_OUTPUT("inline_data_test", inline_data_test("inline_test.txt"));
+	// TEST_OUTPUT("compressed_read_test", compressed_read_test("lz4_test.txt"));
+	// TEST_OUTPUT("reflink_test", reflink_test("reflink_src.txt", "reflink_dst.txt"));
+	// TEST_OUTPUT("rm_test", rm_test("rm_test.txt"));
+	// TEST_OUTPUT("stat_test", stat_test("frame0.txt"));
+	// TEST_OUTPUT("seek_test", seek_test("seek_test.txt"));
+	// TEST_OUTPUT("getdents_test", getdents_test());
+	// TEST_OUTPUT("mmap_test", mmap_test("fish"));
+	// TEST_OUTPUT("mmap_ref_test", mmap_ref_test("mmap_ref_test.txt"));
+	// TEST_OUTPUT("sendfile_test", sendfile_test("fish", "sendfile_test.txt"));
+	// TEST_OUTPUT("iovec_test", iovec_test("iovec_test.txt"));
+	// TEST_OUTPUT("crc32c_test", crc32c_test());
+	// TEST_OUTPUT("disk_sync_test", disk_sync_test("disk_test.txt"));
+	// TEST_OUTPUT("journal_test", journal_test("journal_test.txt"));
+	// TEST_OUTPUT("fd_table_test", fd_table_test());
+	// TEST_OUTPUT("exec_cache_test", exec_cache_test("ls", "exec_cache_test"));
+	// TEST_OUTPUT("palloc_test", palloc_test());
+	// TEST_OUTPUT("user_paging_test", user_paging_test());
 }
@@ -9,6 +9,7 @@ int main ()
 {
     uint32_t i, cnt, max = 0;
     uint8_t buf[BUFSIZE];
+    ece391_iovec_t iov[2];
 
     ece391_fdputs(1, (uint8_t*)"Enter the Test Number: (0): 100, (1): 10000, (2): 100000\n");
     if (-1 == (cnt = ece391_read(0, buf, BUFSIZE-1)) ) {
@@ -34,10 +35,13 @@ int main ()
         }
     }
 
+    iov[1].iov_base = (void*)"\n";
+    iov[1].iov_len = 1;
     for (i = 0; i < max; i++) {
         ece391_itoa(i+1, buf, 10);
-        ece391_fdputs(1, buf);
-        ece391_fdputs(1, (uint8_t*)"\n");
+        iov[0].iov_base = buf;
+        iov[0].iov_len = ece391_strlen(buf);
+        ece391_writev(1, iov, 2);
     }
 
     return 0;
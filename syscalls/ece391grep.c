@@ -4,13 +4,14 @@
 #include "ece391syscall.h"
 
 #define BUFSIZE 1024
-#define SBUFSIZE 33
+#define NUM_DIRENTS 16
 
 int32_t
 do_one_file (const char* s, const char* fname) 
 {
     int32_t fd, cnt, last, line_start, line_end, check, s_len;
     uint8_t data[BUFSIZE+1];
+    ece391_iovec_t iov[3];
 
     s_len = ece391_strlen ((uint8_t*)s);
     if (-1 == (fd = ece391_open ((uint8_t*)fname))) {
@@ -42,10 +43,16 @@ do_one_file (const char* s, const char* fname)
 	    for (check = line_start; check < line_end; check++) {
 		if (s[0] == data[check] && 
 		    0 == ece391_strncmp ((uint8_t*)(data + check), (uint8_t*)s, s_len)) {
-		    ece391_fdputs (1, (uint8_t*)fname);
-		    ece391_fdputs (1, (uint8_t*)":");
-		    ece391_fdputs (1, data + line_start);
-		    ece391_fdputs (1, (uint8_t*)"\n");
+		    /* the whole "name:line\n" goes out in one call */
+		    data[line_end] = '\n';
+		    iov[0].iov_base = (void*)fname;
+		    iov[0].iov_len = ece391_strlen ((uint8_t*)fname);
+		    iov[1].iov_base = (void*)":";
+		    iov[1].iov_len = 1;
+		    iov[2].iov_base = data + line_start;
+		    iov[2].iov_len = line_end - line_start + 1;
+		    ece391_writev (1, iov, 3);
+		    data[line_end] = '\0';
 		    break;
 		}
 	    }
@@ -67,8 +74,8 @@ do_one_file (const char* s, const char* fname)
 
 int main ()
 {
-    int32_t fd, cnt;
-    uint8_t buf[SBUFSIZE];
+    int32_t fd, cnt, i;
+    ece391_dirent_t dents[NUM_DIRENTS];
     uint8_t search[BUFSIZE];
 
     if (0 != ece391_getargs (search, BUFSIZE)) {
@@ -81,16 +88,18 @@ int main ()
 	return 2;
     }
 
-    while (0 != (cnt = ece391_read (fd, buf, SBUFSIZE-1))) {
+    while (0 != (cnt = ece391_getdents (fd, dents, sizeof (dents)))) {
         if (-1 == cnt) {
 	    ece391_fdputs (1, (uint8_t*)"directory entry read failed\n");
 	    return 3;
 	}
-	if ('.' == buf[0]) /* a directory... */
-	    continue;
-	buf[cnt] = '\0';
-	if (0 != do_one_file ((char*)search, (char*)buf))
-	    return 3;
+	for (i = 0; i < cnt / (int32_t)sizeof (ece391_dirent_t); i++) {
+	    /* only regular files with data are worth opening */
+	    if (ECE391_TYPE_REGULAR != dents[i].file_type || 0 == dents[i].length)
+		continue;
+	    if (0 != do_one_file ((char*)search, (char*)dents[i].name))
+		return 3;
+	}
     }
 
     return 0;
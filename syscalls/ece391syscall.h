@@ -3,6 +3,38 @@
 
 #include <stdint.h>
 
+/* file types reported by stat and fstat */
+#define ECE391_TYPE_RTC     0
+#define ECE391_TYPE_DIR     1
+#define ECE391_TYPE_REGULAR 2
+
+/* whence values of lseek */
+#define ECE391_SEEK_SET 0
+#define ECE391_SEEK_CUR 1
+#define ECE391_SEEK_END 2
+
+/* filled in by stat and fstat, matches fs_stat_t in the kernel */
+typedef struct ece391_stat {
+	uint32_t length;
+	uint32_t file_type;
+	uint32_t inode;
+} ece391_stat_t;
+
+/* one record filled in by getdents, matches fs_dirent_t in the kernel */
+typedef struct ece391_dirent {
+	uint8_t  name[36];	/* NUL terminated */
+	uint32_t file_type;
+	uint32_t inode;
+	uint32_t length;
+} ece391_dirent_t;
+
+/* one buffer of readv and writev, matches iovec_t in the kernel */
+#define ECE391_IOV_MAX 16
+typedef struct ece391_iovec {
+	void*   iov_base;
+	int32_t iov_len;
+} ece391_iovec_t;
+
 /* All calls return >= 0 on success or -1 on failure. */
 
 /*  
@@ -21,6 +53,22 @@ extern int32_t ece391_getargs (uint8_t* buf, int32_t nbytes);
 extern int32_t ece391_vidmap (uint8_t** screen_start);
 extern int32_t ece391_set_handler (int32_t signum, void* handler);
 extern int32_t ece391_sigreturn (void);
+extern int32_t ece391_mkdir (const uint8_t* path);
+extern int32_t ece391_stat (const uint8_t* filename, ece391_stat_t* buf);
+extern int32_t ece391_fstat (int32_t fd, ece391_stat_t* buf);
+extern int32_t ece391_lseek (int32_t fd, int32_t offset, int32_t whence);
+extern int32_t ece391_pread (int32_t fd, void* buf, int32_t nbytes, uint32_t offset);
+extern int32_t ece391_pwrite (int32_t fd, const void* buf, int32_t nbytes, uint32_t offset);
+extern int32_t ece391_getdents (int32_t fd, ece391_dirent_t* buf, int32_t nbytes);
+/* read-only mapping of a regular file, offset must be a multiple of 4096, (void*)-1 on failure */
+extern void* ece391_mmap (int32_t fd, uint32_t offset, uint32_t length);
+extern int32_t ece391_munmap (void* addr, uint32_t length);
+extern int32_t ece391_sendfile (int32_t out_fd, int32_t in_fd, int32_t count);
+/* scatter a read over / gather a write from iovcnt buffers in one call */
+extern int32_t ece391_readv (int32_t fd, const ece391_iovec_t* iov, int32_t iovcnt);
+extern int32_t ece391_writev (int32_t fd, const ece391_iovec_t* iov, int32_t iovcnt);
+/* a second descriptor for the open file of fd, sharing its position */
+extern int32_t ece391_dup (int32_t fd);
 
 enum signums {
 	DIV_ZERO = 0,
@@ -13,5 +13,18 @@
 #define SYS_SIGRETURN  10
 #define SYS_CP  11
 #define SYS_RM  12
+#define SYS_MKDIR  13
+#define SYS_STAT  14
+#define SYS_FSTAT  15
+#define SYS_LSEEK  16
+#define SYS_PREAD  17
+#define SYS_PWRITE  18
+#define SYS_GETDENTS  19
+#define SYS_MMAP  20
+#define SYS_MUNMAP  21
+#define SYS_SENDFILE  22
+#define SYS_READV  23
+#define SYS_WRITEV  24
+#define SYS_DUP  25
 
 #endif /* ECE391SYSNUM_H */